@@ -0,0 +1,132 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "AsyncTradeApi.h"
+
+using namespace std;
+
+AsyncTradeApiAdapter::AsyncTradeApiAdapter(TradeApi& api):
+	m_api(api),
+	m_work(new boost::asio::io_service::work(m_ios)),
+	m_worker([this]() { m_ios.run(); })
+{
+}
+
+AsyncTradeApiAdapter::~AsyncTradeApiAdapter()
+{
+	m_work.reset();
+	m_worker.join();
+}
+
+template<class Call>
+auto AsyncTradeApiAdapter::run(Call call) -> std::future<decltype(call())>
+{
+	// io_service runs what is posted in order on its only thread
+	auto task = std::make_shared<std::packaged_task<decltype(call())()>>(call);
+	m_ios.post([task]() { (*task)(); });
+	return task->get_future();
+}
+
+std::future<Decimal> AsyncTradeApiAdapter::balance(const std::string& coin)
+{
+	return run([this, coin]() { return m_api.balance(coin); });
+}
+
+std::future<TradeApi::CoinInfo> AsyncTradeApiAdapter::info(const std::string& coin)
+{
+	return run([this, coin]() { return m_api.info(coin); });
+}
+
+std::future<std::map<std::string, Decimal>> AsyncTradeApiAdapter::nonZeroBalances()
+{
+	return run([this]() { return m_api.nonZeroBalances(); });
+}
+
+std::future<std::map<std::string, double>> AsyncTradeApiAdapter::nonZeroBalancesInBTC()
+{
+	return run([this]() { return m_api.nonZeroBalancesInBTC(); });
+}
+
+std::future<bool> AsyncTradeApiAdapter::execute(const std::vector<TradeApi::Order>& orders,
+	unsigned timeout, const TradeApi::OrderEvents& events)
+{
+	return run([this, orders, timeout, events]()
+	{
+		return m_api.execute(orders, timeout, events);
+	});
+}
+
+std::future<long long> AsyncTradeApiAdapter::createOrder(const TradeApi::Order& order)
+{
+	return run([this, order]() { return m_api.createOrder(order); });
+}
+
+std::future<void> AsyncTradeApiAdapter::deleteOrder(long long id)
+{
+	return run([this, id]() { m_api.deleteOrder(id); });
+}
+
+std::future<TradeApi::OrderStatus> AsyncTradeApiAdapter::orderStatus(long long id, const std::string& coin)
+{
+	return run([this, id, coin]() { return m_api.orderStatus(id, coin); });
+}
+
+std::future<void> AsyncTradeApiAdapter::cancelCurrentOrders()
+{
+	return run([this]() { m_api.cancelCurrentOrders(); });
+}
+
+Decimal BlockingTradeApiAdapter::balance(const std::string& coin)
+{
+	return m_api.balance(coin).get();
+}
+
+TradeApi::CoinInfo BlockingTradeApiAdapter::info(const std::string& coin)
+{
+	return m_api.info(coin).get();
+}
+
+std::map<std::string, Decimal> BlockingTradeApiAdapter::nonZeroBalances()
+{
+	return m_api.nonZeroBalances().get();
+}
+
+std::map<std::string, double> BlockingTradeApiAdapter::nonZeroBalancesInBTC()
+{
+	return m_api.nonZeroBalancesInBTC().get();
+}
+
+bool BlockingTradeApiAdapter::execute(const std::vector<Order>& orders, unsigned timeout)
+{
+	return m_api.execute(orders, timeout).get();
+}
+
+bool BlockingTradeApiAdapter::execute(const std::vector<Order>& orders, unsigned timeout,
+	const OrderEvents& events)
+{
+	return m_api.execute(orders, timeout, events).get();
+}
+
+long long BlockingTradeApiAdapter::createOrder(const Order& order)
+{
+	return m_api.createOrder(order).get();
+}
+
+void BlockingTradeApiAdapter::deleteOrder(long long id)
+{
+	m_api.deleteOrder(id).get();
+}
+
+bool BlockingTradeApiAdapter::checkOrder(long long id, const std::string& coin)
+{
+	return m_api.orderStatus(id, coin).get().open;
+}
+
+TradeApi::OrderStatus BlockingTradeApiAdapter::orderStatus(long long id, const std::string& coin)
+{
+	return m_api.orderStatus(id, coin).get();
+}
+
+void BlockingTradeApiAdapter::cancelCurrentOrders()
+{
+	m_api.cancelCurrentOrders().get();
+}
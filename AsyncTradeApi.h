@@ -0,0 +1,88 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio/io_service.hpp>
+#include "TradeApi.h"
+
+// Non-blocking counterpart of TradeApi: every call returns at once, its
+// result or exception arrives through the future.
+class AsyncTradeApi
+{
+public:
+	virtual ~AsyncTradeApi() {}
+
+	virtual std::future<Decimal> balance(const std::string& coin) = 0;
+	virtual std::future<TradeApi::CoinInfo> info(const std::string& coin) = 0;
+	virtual std::future<std::map<std::string, Decimal>> nonZeroBalances() = 0;
+	virtual std::future<std::map<std::string, double>> nonZeroBalancesInBTC() = 0;
+
+	// events are called on a worker thread while the orders execute
+	virtual std::future<bool> execute(const std::vector<TradeApi::Order>& orders,
+		unsigned timeout, const TradeApi::OrderEvents& events = TradeApi::OrderEvents()) = 0;
+	virtual std::future<long long> createOrder(const TradeApi::Order& order) = 0;
+	virtual std::future<void> deleteOrder(long long id) = 0;
+	virtual std::future<TradeApi::OrderStatus> orderStatus(long long id, const std::string& coin) = 0;
+	virtual std::future<void> cancelCurrentOrders() = 0;
+};
+
+// Runs the calls of a blocking TradeApi on one worker thread, one at a
+// time and in the order they were made, so that orders are never placed
+// before the cancelling called ahead of them. Calls still queued when the
+// adapter is destroyed run first. The api must outlive the adapter.
+class AsyncTradeApiAdapter : public AsyncTradeApi
+{
+public:
+	explicit AsyncTradeApiAdapter(TradeApi& api);
+	~AsyncTradeApiAdapter();
+
+	virtual std::future<Decimal> balance(const std::string& coin);
+	virtual std::future<TradeApi::CoinInfo> info(const std::string& coin);
+	virtual std::future<std::map<std::string, Decimal>> nonZeroBalances();
+	virtual std::future<std::map<std::string, double>> nonZeroBalancesInBTC();
+
+	virtual std::future<bool> execute(const std::vector<TradeApi::Order>& orders,
+		unsigned timeout, const TradeApi::OrderEvents& events = TradeApi::OrderEvents());
+	virtual std::future<long long> createOrder(const TradeApi::Order& order);
+	virtual std::future<void> deleteOrder(long long id);
+	virtual std::future<TradeApi::OrderStatus> orderStatus(long long id, const std::string& coin);
+	virtual std::future<void> cancelCurrentOrders();
+private:
+	template<class Call>
+	auto run(Call call) -> std::future<decltype(call())>;
+
+	TradeApi& m_api;
+	boost::asio::io_service m_ios;
+	std::unique_ptr<boost::asio::io_service::work> m_work;
+	std::thread m_worker;
+};
+
+// Blocking TradeApi over an AsyncTradeApi, for Portfolio and other
+// synchronous callers
+class BlockingTradeApiAdapter : public TradeApi
+{
+public:
+	explicit BlockingTradeApiAdapter(AsyncTradeApi& api) : m_api(api) {}
+
+	virtual Decimal balance(const std::string& coin);
+	virtual CoinInfo info(const std::string& coin);
+	virtual std::map<std::string, Decimal> nonZeroBalances();
+	virtual std::map<std::string, double> nonZeroBalancesInBTC();
+
+	virtual bool execute(const std::vector<Order>& orders, unsigned timeout);
+	virtual bool execute(const std::vector<Order>& orders, unsigned timeout,
+		const OrderEvents& events);
+	virtual long long createOrder(const Order& order);
+	virtual void deleteOrder(long long id);
+	virtual bool checkOrder(long long id, const std::string& coin);
+	virtual OrderStatus orderStatus(long long id, const std::string& coin);
+	virtual void cancelCurrentOrders();
+private:
+	AsyncTradeApi& m_api;
+};
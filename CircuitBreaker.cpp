@@ -0,0 +1,76 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "CircuitBreaker.h"
+#include "Log.h"
+
+using namespace std;
+
+CircuitBreaker::CircuitBreaker(const std::string& host, unsigned threshold,
+	std::chrono::milliseconds cooldown):
+	m_host(host),
+	m_threshold(threshold ? threshold : 1),
+	m_cooldown(cooldown),
+	m_clock(&Clock::system()),
+	m_state(CLOSED),
+	m_failures(0),
+	m_probing(false),
+	m_stateGauge(Metrics::instance().gauge("circuit_breaker_state", Metrics::label("host", host))),
+	m_rejected(Metrics::instance().counter("circuit_breaker_rejections_total", Metrics::label("host", host)))
+{
+	m_stateGauge.set(CLOSED);
+}
+
+void CircuitBreaker::acquire()
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (m_state == OPEN && m_clock->now() - m_openedAt >= m_cooldown)
+		setState(HALF_OPEN);
+	if (m_state == CLOSED)
+		return;
+	if (m_state == HALF_OPEN && !m_probing)
+	{
+		m_probing = true;
+		return;
+	}
+	m_rejected.inc();
+	throw CircuitOpenError("circuit open for " + m_host);
+}
+
+void CircuitBreaker::success()
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_failures = 0;
+	m_probing = false;
+	if (m_state != CLOSED)
+	{
+		Log::write("circuit closed for " + m_host);
+		setState(CLOSED);
+	}
+}
+
+void CircuitBreaker::failure()
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_probing = false;
+	if (m_state == HALF_OPEN || ++m_failures >= m_threshold)
+	{
+		if (m_state != OPEN)
+			Log::write("circuit opened for " + m_host);
+		m_openedAt = m_clock->now();
+		setState(OPEN);
+	}
+}
+
+CircuitBreaker::State CircuitBreaker::state() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (m_state == OPEN && m_clock->now() - m_openedAt >= m_cooldown)
+		return HALF_OPEN;
+	return m_state;
+}
+
+void CircuitBreaker::setState(State state)
+{
+	m_state = state;
+	m_stateGauge.set(state);
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <boost/system/system_error.hpp>
+#include "Metrics.h"
+#include "Clock.h"
+
+class CircuitOpenError : public std::runtime_error
+{
+public:
+	explicit CircuitOpenError(const std::string& what) : std::runtime_error(what) {}
+};
+
+// Stops sending requests to a host after threshold transport failures in
+// a row. Once the cooldown has passed a single probe request is let through;
+// its success closes the circuit again, its failure restarts the cooldown.
+// Only boost::system::system_error counts as a failure: an error reply
+// still proves that the host is reachable.
+class CircuitBreaker
+{
+public:
+	enum State { CLOSED, OPEN, HALF_OPEN };
+
+	CircuitBreaker(const std::string& host, unsigned threshold = 5,
+		std::chrono::milliseconds cooldown = std::chrono::seconds(30));
+
+	void set_clock(Clock& clock)
+	{
+		m_clock = &clock;
+	}
+
+	// throws CircuitOpenError while requests are refused
+	void acquire();
+	void success();
+	void failure();
+
+	State state() const;
+
+	template<class Request>
+	auto call(Request request) -> decltype(request())
+	{
+		acquire();
+		try
+		{
+			auto result = request();
+			success();
+			return result;
+		}
+		catch (const boost::system::system_error&)
+		{
+			failure();
+			throw;
+		}
+		catch (...)
+		{
+			success();
+			throw;
+		}
+	}
+private:
+	void setState(State state);
+
+	std::string m_host;
+	unsigned m_threshold;
+	std::chrono::milliseconds m_cooldown;
+	Clock* m_clock;
+	mutable std::mutex m_mutex;
+	State m_state;
+	unsigned m_failures;
+	bool m_probing;
+	Clock::TimePoint m_openedAt;
+
+	Gauge& m_stateGauge;
+	Counter& m_rejected;
+};
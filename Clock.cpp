@@ -0,0 +1,63 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "Clock.h"
+#include <thread>
+
+using namespace std;
+
+Clock& Clock::system()
+{
+	static SystemClock clock;
+	return clock;
+}
+
+Clock::TimePoint SystemClock::now() const
+{
+	return chrono::steady_clock::now();
+}
+
+void SystemClock::sleep_for(Duration duration)
+{
+	this_thread::sleep_for(duration);
+}
+
+VirtualClock::VirtualClock()
+{
+}
+
+Clock::TimePoint VirtualClock::now() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_now;
+}
+
+void VirtualClock::sleep_for(Duration duration)
+{
+	advance(duration);
+}
+
+void VirtualClock::advance(Duration duration)
+{
+	unique_lock<mutex> lock(m_mutex);
+	TimePoint until = m_now + duration;
+	while (!m_actions.empty() && m_actions.begin()->first <= until)
+	{
+		auto first = m_actions.begin();
+		if (first->first > m_now)
+			m_now = first->first;
+		function<void()> action = first->second;
+		m_actions.erase(first);
+		// actions may read the clock or schedule more
+		lock.unlock();
+		action();
+		lock.lock();
+	}
+	if (until > m_now)
+		m_now = until;
+}
+
+void VirtualClock::schedule(TimePoint when, std::function<void()> action)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_actions.insert(make_pair(when, action));
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+
+// Time source of order execution and the circuit breaker. Code that polls
+// or waits asks its Clock instead of std::chrono and std::this_thread, so
+// a VirtualClock can run it without waiting.
+class Clock
+{
+public:
+	typedef std::chrono::steady_clock::time_point TimePoint;
+	typedef std::chrono::steady_clock::duration Duration;
+
+	virtual ~Clock() {}
+
+	virtual TimePoint now() const = 0;
+	virtual void sleep_for(Duration duration) = 0;
+
+	// the real steady clock, shared by everyone not given another one
+	static Clock& system();
+};
+
+class SystemClock : public Clock
+{
+public:
+	virtual TimePoint now() const;
+	virtual void sleep_for(Duration duration);
+};
+
+// Time that only moves when someone sleeps or advance() is called, at
+// once. Actions scheduled for a point in time run, in time order, when
+// the clock gets there, and see now() at exactly that point.
+class VirtualClock : public Clock
+{
+public:
+	VirtualClock();
+
+	virtual TimePoint now() const;
+	virtual void sleep_for(Duration duration);
+
+	void advance(Duration duration);
+	void schedule(TimePoint when, std::function<void()> action);
+	void schedule(Duration after, std::function<void()> action)
+	{
+		schedule(now() + after, action);
+	}
+private:
+	mutable std::mutex m_mutex;
+	TimePoint m_now;
+	std::multimap<TimePoint, std::function<void()>> m_actions;
+};
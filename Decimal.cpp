@@ -0,0 +1,165 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "Decimal.h"
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+const int Decimal::places;
+const int64_t Decimal::scale;
+const size_t Decimal::maxLength;
+
+namespace
+{
+	const uint64_t powers[] = { 1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+		1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+		100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+		1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+		1000000000000000000ULL, 10000000000000000000ULL };
+	const int max_power = 19;
+	// digits are kept while one more fits; later ones only shift the exponent
+	const uint64_t max_mantissa = 1844674407370955161ULL;
+
+	bool isDigit(char c)
+	{
+		return c >= '0' && c <= '9';
+	}
+}
+
+Decimal::Decimal(double value)
+{
+	double units = std::round(value * scale);
+	if (!(std::abs(units) < 9.2e18))
+		throw std::range_error("Decimal out of range");
+	m_units = static_cast<int64_t>(units);
+}
+
+bool Decimal::parse(const char* p, const char* end, Decimal& value)
+{
+	bool negative = false;
+	if (p != end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	bool digits = false;
+	for (; p != end && isDigit(*p); ++p, digits = true)
+	{
+		if (mantissa < max_mantissa)
+			mantissa = mantissa * 10 + (*p - '0');
+		else
+			++exponent;
+	}
+	if (p != end && *p == '.')
+	{
+		for (++p; p != end && isDigit(*p); ++p, digits = true)
+		{
+			if (mantissa < max_mantissa)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				--exponent;
+			}
+		}
+	}
+	if (!digits)
+		return false;
+	if (p != end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		bool negativeExponent = false;
+		if (p != end && (*p == '-' || *p == '+'))
+			negativeExponent = *p++ == '-';
+		if (p == end || !isDigit(*p))
+			return false;
+		int e = 0;
+		for (; p != end && isDigit(*p); ++p)
+			if (e < 1000)
+				e = e * 10 + (*p - '0');
+		exponent += negativeExponent ? -e : e;
+	}
+	if (p != end)
+		return false;
+
+	int shift = exponent + places;
+	if (mantissa == 0)
+		shift = 0;
+	if (shift > 0)
+	{
+		if (shift > max_power || mantissa > static_cast<uint64_t>(numeric_limits<int64_t>::max()) / powers[shift])
+			return false;
+		mantissa *= powers[shift];
+	}
+	else if (shift < 0)
+	{
+		if (-shift > max_power)
+			mantissa = 0;
+		else
+		{
+			// round half away from zero
+			uint64_t divisor = powers[-shift];
+			uint64_t rest = mantissa % divisor;
+			mantissa /= divisor;
+			if (rest >= divisor - rest)
+				++mantissa;
+		}
+	}
+	if (mantissa > static_cast<uint64_t>(numeric_limits<int64_t>::max()))
+		return false;
+	value.m_units = negative ? -static_cast<int64_t>(mantissa) : static_cast<int64_t>(mantissa);
+	return true;
+}
+
+Decimal Decimal::parse(const std::string& text)
+{
+	Decimal value;
+	if (!parse(text.data(), text.data() + text.size(), value))
+		throw std::runtime_error("Invalid number: " + text);
+	return value;
+}
+
+size_t Decimal::format(char (&buffer)[maxLength]) const
+{
+	char* p = buffer;
+	uint64_t units = static_cast<uint64_t>(m_units);
+	if (m_units < 0)
+	{
+		*p++ = '-';
+		units = 0 - units;
+	}
+	uint64_t whole = units / scale;
+	uint64_t fraction = units % scale;
+	char digits[20];
+	int n = 0;
+	do
+	{
+		digits[n++] = static_cast<char>('0' + whole % 10);
+		whole /= 10;
+	} while (whole);
+	while (n)
+		*p++ = digits[--n];
+	if (fraction)
+	{
+		*p++ = '.';
+		int length = places;
+		for (; fraction % 10 == 0; fraction /= 10)
+			--length;
+		for (int i = length - 1; i >= 0; --i, fraction /= 10)
+			p[i] = static_cast<char>('0' + fraction % 10);
+		p += length;
+	}
+	*p = '\0';
+	return p - buffer;
+}
+
+std::string Decimal::str() const
+{
+	char buffer[maxLength];
+	return std::string(buffer, format(buffer));
+}
+
+std::ostream& operator<<(std::ostream& os, Decimal value)
+{
+	char buffer[Decimal::maxLength];
+	return os.write(buffer, value.format(buffer));
+}
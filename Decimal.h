@@ -0,0 +1,56 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Fixed-point number with the eight decimal places the exchange works in,
+// stored as an integer count of satoshis. It converts to and from double
+// implicitly, so arithmetic stays in double and every value stored in a
+// Decimal is rounded to the nearest satoshi.
+class Decimal
+{
+public:
+	static const int places = 8;
+	static const int64_t scale = 100000000;
+	// longest formatted value including sign and terminating zero
+	static const size_t maxLength = 30;
+
+	Decimal() : m_units(0) {}
+	// throws std::range_error for NaN, infinity and values out of range
+	Decimal(double value);
+
+	static Decimal fromUnits(int64_t units)
+	{
+		Decimal d;
+		d.m_units = units;
+		return d;
+	}
+	int64_t units() const
+	{
+		return m_units;
+	}
+
+	operator double() const
+	{
+		return static_cast<double>(m_units) / scale;
+	}
+
+	// Reads decimal text such as "0.00470002" or "1e-05", rounding extra
+	// digits to the nearest satoshi; returns false on malformed text.
+	static bool parse(const char* begin, const char* end, Decimal& value);
+	// throws std::runtime_error on malformed text
+	static Decimal parse(const std::string& text);
+
+	// Writes the shortest plain text that reads back to the same value,
+	// never in exponent form; returns its length.
+	size_t format(char (&buffer)[maxLength]) const;
+	std::string str() const;
+private:
+	int64_t m_units;
+};
+
+std::ostream& operator<<(std::ostream& os, Decimal value);
@@ -0,0 +1,146 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "ExecutionPlanner.h"
+#include "Log.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+ExecutionPlanner::ExecutionPlanner(TradeApi& api, const TradeApi::OrderEvents& events):
+	m_events(events),
+	m_executor(api, [this](const TradeApi::OrderEvent& e) { onEvent(e); }),
+	m_clock(&Clock::system()),
+	m_pollInterval(chrono::seconds(30)),
+	m_fee(0.0025),
+	m_funds(0.0)
+{
+}
+
+bool ExecutionPlanner::run(const std::vector<TradeApi::Order>& orders, Decimal available,
+	std::chrono::milliseconds timeout, const std::map<size_t, TradeApi::OpenOrder>& placed)
+{
+	TimePoint until = m_clock->now() + timeout;
+	start(orders, available, placed);
+	poll(until);
+	return cancel();
+}
+
+void ExecutionPlanner::start(const std::vector<TradeApi::Order>& orders, Decimal available,
+	const std::map<size_t, TradeApi::OpenOrder>& placed)
+{
+	Log l("ExecutionPlanner::start");
+	m_funds = available;
+	for (size_t i = 0; i < orders.size(); ++i)
+	{
+		auto open = placed.find(i);
+		if (open != placed.end())
+			m_executor.adopt(open->second, i);
+		else if (orders[i].action == TradeApi::SELL || !orders[i].base.empty())
+			m_executor.place(orders[i], i);
+		else
+		{
+			Buy b;
+			b.index = i;
+			b.order = orders[i];
+			m_buys.push_back(b);
+		}
+	}
+	release();
+}
+
+void ExecutionPlanner::poll(TimePoint until)
+{
+	Log l("ExecutionPlanner::poll");
+	while (!m_executor.done())
+	{
+		m_executor.update();
+		release();
+		TimePoint now = m_clock->now();
+		if (m_executor.done() || now >= until)
+			break;
+		m_clock->sleep_for(std::min<Clock::Duration>(m_pollInterval, until - now));
+	}
+}
+
+bool ExecutionPlanner::cancel()
+{
+	Log l("ExecutionPlanner::cancel");
+	bool unfilled = m_executor.cancel();
+	for (const Buy& b : m_buys)
+	{
+		unfilled = true;
+		if (!m_events)
+			continue;
+		TradeApi::OrderEvent e;
+		e.type = TradeApi::OrderEvent::FAILED;
+		e.index = b.index;
+		e.order = b.order;
+		e.error = "Not enough BTC from sells";
+		m_events(e);
+	}
+	m_buys.clear();
+	return unfilled;
+}
+
+void ExecutionPlanner::onEvent(const TradeApi::OrderEvent& e)
+{
+	const TradeApi::Order& o = e.order;
+	// orders on the direct markets neither need nor bring BTC
+	bool btc = o.base.empty();
+	if (btc && o.action == TradeApi::SELL)
+	{
+		switch (e.type)
+		{
+		case TradeApi::OrderEvent::PLACED:
+			m_sells[e.index] = 0.0;
+			break;
+		case TradeApi::OrderEvent::PARTIALLY_FILLED:
+		case TradeApi::OrderEvent::FILLED:
+			m_funds += (e.filled - m_sells[e.index]) * o.amount * o.price * (1.0 - m_fee);
+			m_sells[e.index] = e.filled;
+			if (e.type == TradeApi::OrderEvent::FILLED)
+				m_sells.erase(e.index);
+			break;
+		case TradeApi::OrderEvent::CANCELLED:
+			m_sells.erase(e.index);
+			break;
+		case TradeApi::OrderEvent::FAILED:
+			break;
+		}
+	}
+	else if (btc && e.type == TradeApi::OrderEvent::FAILED && !e.id)
+	{
+		// the buy was refused, its funds are free again
+		m_funds += o.amount * o.price;
+	}
+	if (m_events)
+		m_events(e);
+}
+
+void ExecutionPlanner::release()
+{
+	for (auto it = m_buys.begin(); it != m_buys.end();)
+	{
+		TradeApi::Order& o = it->order;
+		double cost = o.amount * o.price;
+		if (cost > m_funds)
+		{
+			// scale down only once no more proceeds can come in
+			if (!m_sells.empty() || o.price.units() <= 0)
+			{
+				++it;
+				continue;
+			}
+			o.amount = Decimal::fromUnits(static_cast<int64_t>(
+				std::floor(m_funds / o.price * Decimal::scale)));
+			if (o.amount.units() <= 0)
+				break;
+			cost = o.amount * o.price;
+		}
+		m_funds -= cost;
+		Buy b = *it;
+		it = m_buys.erase(it);
+		m_executor.place(b.order, b.index);
+	}
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <vector>
+#include "OrderExecutor.h"
+
+// Rebalances in a single run: sells are placed first, and every buy is
+// placed as soon as the BTC on hand plus the proceeds of the sells filled
+// so far, partial fills included, pay for it. When no sell is left open
+// the first buy still short of funds is scaled down to what is left;
+// buys never funded are reported as FAILED. Orders on direct markets,
+// paid in another coin than BTC, are placed at once.
+class ExecutionPlanner
+{
+public:
+	typedef OrderExecutor::TimePoint TimePoint;
+
+	ExecutionPlanner(TradeApi& api, const TradeApi::OrderEvents& events = TradeApi::OrderEvents());
+
+	void set_poll_interval(std::chrono::milliseconds interval)
+	{
+		m_pollInterval = interval;
+	}
+	void set_clock(Clock& clock)
+	{
+		m_clock = &clock;
+		m_executor.set_clock(clock);
+	}
+	// part of the sell proceeds kept by the exchange
+	void set_fee(double fee)
+	{
+		m_fee = fee;
+	}
+
+	// All three steps below; true when some orders were not filled
+	bool run(const std::vector<TradeApi::Order>& orders, Decimal available,
+		std::chrono::milliseconds timeout,
+		const std::map<size_t, TradeApi::OpenOrder>& placed = std::map<size_t, TradeApi::OpenOrder>());
+
+	// places the sells and the buys that available BTC already pays for;
+	// orders found in placed are open already and are only taken over
+	void start(const std::vector<TradeApi::Order>& orders, Decimal available,
+		const std::map<size_t, TradeApi::OpenOrder>& placed = std::map<size_t, TradeApi::OpenOrder>());
+	void poll(TimePoint until);
+	bool cancel();
+private:
+	struct Buy
+	{
+		size_t index;
+		TradeApi::Order order;
+	};
+
+	void onEvent(const TradeApi::OrderEvent& e);
+	void release();
+
+	TradeApi::OrderEvents m_events;
+	OrderExecutor m_executor;
+	Clock* m_clock;
+	std::chrono::milliseconds m_pollInterval;
+	double m_fee;
+	// BTC not yet spent on placed buys
+	double m_funds;
+	std::list<Buy> m_buys;
+	// filled part of every open sell, as last reported
+	std::map<size_t, double> m_sells;
+};
@@ -0,0 +1,57 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "Hedging.h"
+
+using namespace std;
+
+HedgeWorkers::HedgeWorkers():
+	m_idle(0),
+	m_stop(false)
+{
+}
+
+HedgeWorkers::~HedgeWorkers()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_ready.notify_all();
+	for (thread& t : m_threads)
+		t.join();
+}
+
+void HedgeWorkers::run(std::function<void()> task)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_tasks.push_back(std::move(task));
+	if (m_idle < m_tasks.size())
+		m_threads.push_back(thread([this]() { work(); }));
+	else
+		m_ready.notify_one();
+}
+
+size_t HedgeWorkers::threads() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_threads.size();
+}
+
+void HedgeWorkers::work()
+{
+	unique_lock<mutex> lock(m_mutex);
+	for (;;)
+	{
+		++m_idle;
+		m_ready.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+		--m_idle;
+		// attempts still queued run before the workers stop
+		if (m_tasks.empty())
+			return;
+		function<void()> task = std::move(m_tasks.front());
+		m_tasks.pop_front();
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+}
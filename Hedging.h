@@ -0,0 +1,146 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+
+struct HedgePolicy
+{
+	bool enabled;
+	// latency quantile of the command after which the second request goes out
+	double quantile;
+	std::chrono::milliseconds minDelay;
+	// used until the command has minSamples latency observations
+	std::chrono::milliseconds initialDelay;
+	unsigned minSamples;
+
+	HedgePolicy():
+		enabled(false),
+		quantile(0.95),
+		minDelay(50),
+		initialDelay(2000),
+		minSamples(20)
+	{
+	}
+
+	std::chrono::milliseconds delay(const Histogram& latency) const
+	{
+		if (latency.count() < minSamples)
+			return initialDelay;
+		std::chrono::milliseconds d(static_cast<long long>(latency.quantile(quantile) * 1000));
+		return (d < minDelay) ? minDelay : d;
+	}
+};
+
+// Threads hedged attempts run on. An idle thread takes the next attempt
+// and a new one starts only when all are busy, so steady-state attempts
+// start no threads. The destructor waits for the attempts still running,
+// the slower ones of calls that returned already, so none outlives the
+// owner or the statics it uses.
+class HedgeWorkers
+{
+public:
+	HedgeWorkers();
+	~HedgeWorkers();
+
+	void run(std::function<void()> task);
+	size_t threads() const;
+private:
+	void work();
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_ready;
+	std::deque<std::function<void()>> m_tasks;
+	std::vector<std::thread> m_threads;
+	size_t m_idle;
+	bool m_stop;
+};
+
+namespace detail
+{
+	template<class Result>
+	struct HedgeState
+	{
+		std::mutex mutex;
+		std::condition_variable done;
+		std::unique_ptr<Result> result;
+		std::exception_ptr error;
+		int running;
+		int winner;
+
+		HedgeState() : running(0), winner(-1) {}
+
+		bool finished() const
+		{
+			return result || !running;
+		}
+	};
+
+	template<class Result>
+	void startAttempt(HedgeWorkers& workers, const std::shared_ptr<HedgeState<Result>>& state,
+		std::function<Result()> attempt, int index)
+	{
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			++state->running;
+		}
+		workers.run([state, attempt, index]()
+		{
+			std::unique_ptr<Result> result;
+			std::exception_ptr error;
+			try
+			{
+				result.reset(new Result(attempt()));
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (result && !state->result)
+			{
+				state->result = std::move(result);
+				state->winner = index;
+			}
+			else if (error)
+				state->error = error;
+			--state->running;
+			state->done.notify_all();
+		});
+	}
+}
+
+// Runs makeAttempt()() on one of workers. If it has not finished within
+// delay, a second attempt from makeAttempt() is started and the first
+// successful result wins; an error is reported only when both fail. The
+// slower attempt keeps running on its worker until it ends, so attempts
+// must own their data. makeAttempt is always called on the calling thread.
+template<class Result, class MakeAttempt>
+Result hedged(HedgeWorkers& workers, MakeAttempt makeAttempt, std::chrono::milliseconds delay,
+	bool& hedgeSent, bool& hedgeWon)
+{
+	auto state = std::make_shared<detail::HedgeState<Result>>();
+	detail::startAttempt<Result>(workers, state, makeAttempt(), 0);
+	std::unique_lock<std::mutex> lock(state->mutex);
+	hedgeSent = !state->done.wait_for(lock, delay, [&state]() { return state->finished(); });
+	if (hedgeSent)
+	{
+		lock.unlock();
+		detail::startAttempt<Result>(workers, state, makeAttempt(), 1);
+		lock.lock();
+		state->done.wait(lock, [&state]() { return state->finished(); });
+	}
+	if (!state->result)
+		std::rethrow_exception(state->error);
+	hedgeWon = state->winner == 1;
+	return std::move(*state->result);
+}
@@ -0,0 +1,140 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "HostResolver.h"
+#include "Metrics.h"
+#include "Log.h"
+#include <boost/asio/io_service.hpp>
+#include <boost/system/system_error.hpp>
+
+using tcp = boost::asio::ip::tcp;
+using namespace std;
+
+namespace
+{
+	// one family, then the other, starting with the first returned
+	vector<HostResolver::Endpoint> interleave(const vector<HostResolver::Endpoint>& found)
+	{
+		vector<HostResolver::Endpoint> first, second;
+		for (const HostResolver::Endpoint& e : found)
+			(e.address().is_v6() == found[0].address().is_v6() ? first : second).push_back(e);
+		vector<HostResolver::Endpoint> res;
+		for (size_t i = 0; i < max(first.size(), second.size()); ++i)
+		{
+			if (i < first.size())
+				res.push_back(first[i]);
+			if (i < second.size())
+				res.push_back(second[i]);
+		}
+		return res;
+	}
+}
+
+HostResolver::HostResolver(std::chrono::seconds ttl, const Lookup& lookup):
+	m_ttl(ttl),
+	m_lookup(lookup ? lookup : Lookup(&HostResolver::systemLookup)),
+	m_clock(&Clock::system()),
+	m_lookups(0)
+{
+}
+
+HostResolver::~HostResolver()
+{
+	vector<shared_future<void>> lookups;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		for (const auto& e : m_entries)
+			if (e.second.lookup.valid())
+				lookups.push_back(e.second.lookup);
+	}
+	for (const shared_future<void>& f : lookups)
+		f.wait();
+}
+
+bool HostResolver::running(const Entry& e)
+{
+	return e.lookup.valid() && e.lookup.wait_for(chrono::seconds(0)) != future_status::ready;
+}
+
+std::vector<HostResolver::Endpoint> HostResolver::resolve(const std::string& host,
+	const std::string& port, Deadline deadline)
+{
+	string key = host + ":" + port;
+	shared_future<void> lookup;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		Entry& e = m_entries[key];
+		Clock::TimePoint now = m_clock->now();
+		if (!e.addresses.empty() && now < e.expires)
+		{
+			if (now >= e.expires - m_ttl / 2 && !running(e))
+				startLookup(key, host, port, e);
+			return e.addresses;
+		}
+		if (!running(e))
+			startLookup(key, host, port, e);
+		lookup = e.lookup;
+	}
+	if (deadline == Deadline::max())
+		lookup.wait();
+	else if (lookup.wait_until(deadline) != future_status::ready)
+		throw boost::system::system_error(boost::asio::error::timed_out);
+	lock_guard<mutex> lock(m_mutex);
+	const Entry& e = m_entries[key];
+	if (e.addresses.empty())
+		rethrow_exception(e.error);
+	return e.addresses;
+}
+
+unsigned HostResolver::lookups() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_lookups;
+}
+
+void HostResolver::startLookup(const std::string& key, const std::string& host,
+	const std::string& port, Entry& e)
+{
+	++m_lookups;
+	Metrics::instance().counter("dns_lookups_total", Metrics::label("host", host)).inc();
+	e.lookup = async(launch::async, [this, key, host, port]()
+	{
+		vector<Endpoint> found;
+		exception_ptr error;
+		try
+		{
+			found = m_lookup(host, port);
+			if (found.empty())
+				throw boost::system::system_error(boost::asio::error::host_not_found);
+		}
+		catch (...)
+		{
+			error = current_exception();
+			Metrics::instance().counter("dns_lookup_failures_total", Metrics::label("host", host)).inc();
+			Log::write("lookup failed for " + key);
+		}
+		lock_guard<mutex> lock(m_mutex);
+		Entry& e = m_entries[key];
+		e.error = error;
+		if (error)
+			return;
+		e.addresses = interleave(found);
+		e.expires = m_clock->now() + m_ttl;
+	}).share();
+}
+
+HostResolver& HostResolver::shared()
+{
+	static HostResolver resolver;
+	return resolver;
+}
+
+std::vector<HostResolver::Endpoint> HostResolver::systemLookup(const std::string& host,
+	const std::string& port)
+{
+	boost::asio::io_service ios;
+	tcp::resolver resolver(ios);
+	vector<Endpoint> res;
+	for (const auto& r : resolver.resolve(host, port))
+		res.push_back(r.endpoint());
+	return res;
+}
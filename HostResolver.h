@@ -0,0 +1,76 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio/ip/tcp.hpp>
+#include "Clock.h"
+
+// Addresses of host names, kept for ttl. Once half of it has passed a
+// lookup starts in the background and the kept addresses are handed out
+// meanwhile, so a request waits for DNS only the first time a name is
+// used or after it went unused for long. When a lookup fails, expired
+// addresses are used until one succeeds. Addresses come alternating
+// between IPv6 and IPv4, the family the lookup returned first first, as
+// happy eyeballs connects want them.
+class HostResolver
+{
+public:
+	typedef boost::asio::ip::tcp::endpoint Endpoint;
+	typedef std::chrono::steady_clock::time_point Deadline;
+	// blocking lookup; throws boost::system::system_error
+	typedef std::function<std::vector<Endpoint>(const std::string& host, const std::string& port)> Lookup;
+
+	// looks up in the system resolver unless given another lookup
+	explicit HostResolver(std::chrono::seconds ttl = std::chrono::seconds(300),
+		const Lookup& lookup = Lookup());
+	// waits for background lookups
+	~HostResolver();
+
+	// ttl follows clock
+	void set_clock(Clock& clock)
+	{
+		m_clock = &clock;
+	}
+
+	// Throws boost::system::system_error when the lookup fails with no
+	// addresses kept, or timed_out when it does not finish by deadline
+	std::vector<Endpoint> resolve(const std::string& host, const std::string& port,
+		Deadline deadline = Deadline::max());
+	// lookups started so far
+	unsigned lookups() const;
+
+	// used by every HttpsClient not given another
+	static HostResolver& shared();
+	static std::vector<Endpoint> systemLookup(const std::string& host, const std::string& port);
+private:
+	HostResolver(const HostResolver&);
+	HostResolver& operator=(const HostResolver&);
+
+	struct Entry
+	{
+		std::vector<Endpoint> addresses;
+		Clock::TimePoint expires;
+		// of the last lookup, reset by a successful one
+		std::exception_ptr error;
+		std::shared_future<void> lookup;
+	};
+
+	static bool running(const Entry& e);
+	void startLookup(const std::string& key, const std::string& host,
+		const std::string& port, Entry& e);
+
+	std::chrono::seconds m_ttl;
+	Lookup m_lookup;
+	Clock* m_clock;
+	mutable std::mutex m_mutex;
+	std::map<std::string, Entry> m_entries;
+	unsigned m_lookups;
+};
@@ -0,0 +1,554 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "HttpsClient.h"
+#include "RequestBuilder.h"
+#include "Metrics.h"
+#include "Log.h"
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+namespace ssl = boost::asio::ssl;       // from <boost/asio/ssl.hpp>
+namespace http = boost::beast::http;    // from <boost/beast/http.hpp>
+using namespace std;
+
+static void
+load_root_certificates(ssl::context& ctx)
+{
+	std::string const cert =
+		/*  This is the DigiCert root certificate.
+
+		CN = DigiCert High Assurance EV Root CA
+		OU = www.digicert.com
+		O = DigiCert Inc
+		C = US
+
+		Valid to: Sunday, ?November ?9, ?2031 5:00:00 PM
+
+		Thumbprint(sha1):
+		5f b7 ee 06 33 e2 59 db ad 0c 4c 9a e6 d3 8f 1a 61 c7 dc 25
+		*/
+		"-----BEGIN CERTIFICATE-----\n"
+		"MIIDxTCCAq2gAwIBAgIQAqxcJmoLQJuPC3nyrkYldzANBgkqhkiG9w0BAQUFADBs\n"
+		"MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
+		"d3cuZGlnaWNlcnQuY29tMSswKQYDVQQDEyJEaWdpQ2VydCBIaWdoIEFzc3VyYW5j\n"
+		"ZSBFViBSb290IENBMB4XDTA2MTExMDAwMDAwMFoXDTMxMTExMDAwMDAwMFowbDEL\n"
+		"MAkGA1UEBhMCVVMxFTATBgNVBAoTDERpZ2lDZXJ0IEluYzEZMBcGA1UECxMQd3d3\n"
+		"LmRpZ2ljZXJ0LmNvbTErMCkGA1UEAxMiRGlnaUNlcnQgSGlnaCBBc3N1cmFuY2Ug\n"
+		"RVYgUm9vdCBDQTCCASIwDQYJKoZIhvcNAQEBBQADggEPADCCAQoCggEBAMbM5XPm\n"
+		"+9S75S0tMqbf5YE/yc0lSbZxKsPVlDRnogocsF9ppkCxxLeyj9CYpKlBWTrT3JTW\n"
+		"PNt0OKRKzE0lgvdKpVMSOO7zSW1xkX5jtqumX8OkhPhPYlG++MXs2ziS4wblCJEM\n"
+		"xChBVfvLWokVfnHoNb9Ncgk9vjo4UFt3MRuNs8ckRZqnrG0AFFoEt7oT61EKmEFB\n"
+		"Ik5lYYeBQVCmeVyJ3hlKV9Uu5l0cUyx+mM0aBhakaHPQNAQTXKFx01p8VdteZOE3\n"
+		"hzBWBOURtCmAEvF5OYiiAhF8J2a3iLd48soKqDirCmTCv2ZdlYTBoSUeh10aUAsg\n"
+		"EsxBu24LUTi4S8sCAwEAAaNjMGEwDgYDVR0PAQH/BAQDAgGGMA8GA1UdEwEB/wQF\n"
+		"MAMBAf8wHQYDVR0OBBYEFLE+w2kD+L9HAdSYJhoIAu9jZCvDMB8GA1UdIwQYMBaA\n"
+		"FLE+w2kD+L9HAdSYJhoIAu9jZCvDMA0GCSqGSIb3DQEBBQUAA4IBAQAcGgaX3Nec\n"
+		"nzyIZgYIVyHbIUf4KmeqvxgydkAQV8GK83rZEWWONfqe/EW1ntlMMUu4kehDLI6z\n"
+		"eM7b41N5cdblIZQB2lWHmiRk9opmzN6cN82oNLFpmyPInngiK3BD41VHMWEZ71jF\n"
+		"hS9OMPagMRYjyOfiZRYzy78aG6A9+MpeizGLYAiJLQwGXFK3xPkKmNEVX58Svnw2\n"
+		"Yzi9RKR/5CYrCsSXaQ3pjOLAEFe4yHYSkVXySGnYvCoCWw9E1CAx2/S6cCZdkGCe\n"
+		"vEsXCS+0yx5DaMkHJ8HSXPfqIbloEpw8nL+e/IBcm2PN7EeqJSdnoDfzAIJ9VNep\n"
+		"+OkuE6N36B9K\n"
+		"-----END CERTIFICATE-----\n"
+		/*  This is the GeoTrust root certificate.
+
+		CN = GeoTrust Global CA
+		O = GeoTrust Inc.
+		C = US
+		Valid to: Friday, ‎May ‎20, ‎2022 9:00:00 PM
+
+		Thumbprint(sha1):
+		‎de 28 f4 a4 ff e5 b9 2f a3 c5 03 d1 a3 49 a7 f9 96 2a 82 12
+		*/
+		"-----BEGIN CERTIFICATE-----\n"
+		"MIIDxTCCAq2gAwIBAgIQAqxcJmoLQJuPC3nyrkYldzANBgkqhkiG9w0BAQUFADBs\n"
+		"MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
+		"d3cuZGlnaWNlcnQuY29tMSswKQYDVQQDEyJEaWdpQ2VydCBIaWdoIEFzc3VyYW5j\n"
+		"ZSBFViBSb290IENBMB4XDTA2MTExMDAwMDAwMFoXDTMxMTExMDAwMDAwMFowbDEL\n"
+		"MAkGA1UEBhMCVVMxFTATBgNVBAoTDERpZ2lDZXJ0IEluYzEZMBcGA1UECxMQd3d3\n"
+		"LmRpZ2ljZXJ0LmNvbTErMCkGA1UEAxMiRGlnaUNlcnQgSGlnaCBBc3N1cmFuY2Ug\n"
+		"RVYgUm9vdCBDQTCCASIwDQYJKoZIhvcNAQEBBQADggEPADCCAQoCggEBAMbM5XPm\n"
+		"+9S75S0tMqbf5YE/yc0lSbZxKsPVlDRnogocsF9ppkCxxLeyj9CYpKlBWTrT3JTW\n"
+		"PNt0OKRKzE0lgvdKpVMSOO7zSW1xkX5jtqumX8OkhPhPYlG++MXs2ziS4wblCJEM\n"
+		"xChBVfvLWokVfnHoNb9Ncgk9vjo4UFt3MRuNs8ckRZqnrG0AFFoEt7oT61EKmEFB\n"
+		"Ik5lYYeBQVCmeVyJ3hlKV9Uu5l0cUyx+mM0aBhakaHPQNAQTXKFx01p8VdteZOE3\n"
+		"hzBWBOURtCmAEvF5OYiiAhF8J2a3iLd48soKqDirCmTCv2ZdlYTBoSUeh10aUAsg\n"
+		"EsxBu24LUTi4S8sCAwEAAaNjMGEwDgYDVR0PAQH/BAQDAgGGMA8GA1UdEwEB/wQF\n"
+		"MAMBAf8wHQYDVR0OBBYEFLE+w2kD+L9HAdSYJhoIAu9jZCvDMB8GA1UdIwQYMBaA\n"
+		"FLE+w2kD+L9HAdSYJhoIAu9jZCvDMA0GCSqGSIb3DQEBBQUAA4IBAQAcGgaX3Nec\n"
+		"nzyIZgYIVyHbIUf4KmeqvxgydkAQV8GK83rZEWWONfqe/EW1ntlMMUu4kehDLI6z\n"
+		"eM7b41N5cdblIZQB2lWHmiRk9opmzN6cN82oNLFpmyPInngiK3BD41VHMWEZ71jF\n"
+		"hS9OMPagMRYjyOfiZRYzy78aG6A9+MpeizGLYAiJLQwGXFK3xPkKmNEVX58Svnw2\n"
+		"Yzi9RKR/5CYrCsSXaQ3pjOLAEFe4yHYSkVXySGnYvCoCWw9E1CAx2/S6cCZdkGCe\n"
+		"vEsXCS+0yx5DaMkHJ8HSXPfqIbloEpw8nL+e/IBcm2PN7EeqJSdnoDfzAIJ9VNep\n"
+		"+OkuE6N36B9K\n"
+		"-----END CERTIFICATE-----\n"
+		;
+
+	boost::system::error_code ec;
+	ctx.add_certificate_authority(
+		boost::asio::buffer(cert.data(), cert.size()), ec);
+	if (ec)
+		throw boost::system::system_error{ ec };
+}
+
+typedef http::basic_fields<ArenaAllocator<char>> ArenaFields;
+
+// Memory for the intermediate handlers of the asynchronous operations of a
+// connection. Only a few are alive at once, so a handful of blocks serve
+// every request; oversized or surplus handlers go to the heap.
+class HandlerMemory
+{
+public:
+	HandlerMemory()
+	{
+		for (size_t i = 0; i < block_count; ++i)
+			m_used[i] = false;
+	}
+
+	void* allocate(size_t size)
+	{
+		if (size <= block_size)
+			for (size_t i = 0; i < block_count; ++i)
+				if (!m_used[i])
+				{
+					m_used[i] = true;
+					return &m_blocks[i];
+				}
+		return ::operator new(size);
+	}
+
+	void deallocate(void* p)
+	{
+		for (size_t i = 0; i < block_count; ++i)
+			if (p == &m_blocks[i])
+			{
+				m_used[i] = false;
+				return;
+			}
+		::operator delete(p);
+	}
+private:
+	static const size_t block_size = 1024;
+	static const size_t block_count = 8;
+
+	typename aligned_storage<block_size, alignof(max_align_t)>::type m_blocks[block_count];
+	bool m_used[block_count];
+};
+
+template<class T>
+class HandlerAllocator
+{
+public:
+	typedef T value_type;
+
+	explicit HandlerAllocator(HandlerMemory& memory) : m_memory(&memory) {}
+	template<class U>
+	HandlerAllocator(const HandlerAllocator<U>& other) : m_memory(other.memory()) {}
+
+	T* allocate(size_t n)
+	{
+		return static_cast<T*>(m_memory->allocate(n * sizeof(T)));
+	}
+	void deallocate(T* p, size_t)
+	{
+		m_memory->deallocate(p);
+	}
+
+	HandlerMemory* memory() const
+	{
+		return m_memory;
+	}
+
+	bool operator==(const HandlerAllocator& other) const
+	{
+		return m_memory == other.m_memory;
+	}
+	bool operator!=(const HandlerAllocator& other) const
+	{
+		return m_memory != other.m_memory;
+	}
+private:
+	HandlerMemory* m_memory;
+};
+
+// Completion handler that makes asio allocate from the connection memory
+template<class Handler>
+class MemoryHandler
+{
+public:
+	typedef HandlerAllocator<Handler> allocator_type;
+
+	MemoryHandler(HandlerMemory& memory, Handler handler):
+		m_memory(memory),
+		m_handler(handler)
+	{
+	}
+
+	allocator_type get_allocator() const
+	{
+		return allocator_type(m_memory);
+	}
+
+	template<class... Args>
+	void operator()(Args&&... args)
+	{
+		m_handler(std::forward<Args>(args)...);
+	}
+private:
+	HandlerMemory& m_memory;
+	Handler m_handler;
+};
+
+// Bound to the concrete io_service executor: the type-erased default
+// executor wraps every completion into a heap-allocated function object.
+typedef boost::asio::basic_stream_socket<tcp, boost::asio::io_service::executor_type> Socket;
+typedef boost::asio::basic_waitable_timer<chrono::steady_clock, boost::asio::wait_traits<chrono::steady_clock>,
+	boost::asio::io_service::executor_type> Timer;
+
+struct HttpsClient::Connection
+{
+	boost::asio::io_service ios;
+	ssl::context ctx{ ssl::context::sslv23_client };
+	unique_ptr<ssl::stream<Socket>> stream;
+	// header fields of the current request and response live here
+	RequestArena arena;
+	http::request<http::string_body, ArenaFields> request;
+	http::response<http::string_body, ArenaFields> response;
+	boost::beast::flat_buffer buffer;
+	// sockets racing to connect, and the stagger between them
+	vector<unique_ptr<Socket>> attempts;
+	Timer stagger{ ios };
+	HandlerMemory memory;
+	bool connectedBefore;
+
+	Counter& handshakes;
+	Counter& reconnects;
+	Counter& connectAttempts;
+	Counter& bytesSent;
+	Counter& bytesReceived;
+	Counter& timeouts;
+
+	Connection(const string& host):
+		request(piecewise_construct, make_tuple(), make_tuple(ArenaAllocator<char>(arena))),
+		response(piecewise_construct, make_tuple(), make_tuple(ArenaAllocator<char>(arena))),
+		connectedBefore(false),
+		handshakes(Metrics::instance().counter("https_handshakes_total", Metrics::label("host", host))),
+		reconnects(Metrics::instance().counter("https_reconnects_total", Metrics::label("host", host))),
+		connectAttempts(Metrics::instance().counter("https_connect_attempts_total", Metrics::label("host", host))),
+		bytesSent(Metrics::instance().counter("https_bytes_sent_total", Metrics::label("host", host))),
+		bytesReceived(Metrics::instance().counter("https_bytes_received_total", Metrics::label("host", host))),
+		timeouts(Metrics::instance().counter("https_timeouts_total", Metrics::label("host", host)))
+	{
+		// This holds the root certificate used for verification
+		load_root_certificates(ctx);
+	}
+
+	template<class Handler>
+	MemoryHandler<Handler> handler(Handler h)
+	{
+		return MemoryHandler<Handler>(memory, h);
+	}
+
+	void clear()
+	{
+		request.clear();
+		request.body().clear();
+		response.clear();
+		response.body().clear();
+		arena.reset();
+	}
+
+	// Runs the started operation until it completes or the deadline passes.
+	// A late operation is aborted by closing the socket and reported as
+	// timed out; either way its handler has run when this returns.
+	void run(Deadline deadline, const bool& done, boost::system::error_code& ec)
+	{
+		ios.restart();
+		if (deadline == Deadline::max())
+			ios.run();
+		else
+			ios.run_until(deadline);
+		if (done)
+			return;
+		boost::system::error_code ignored;
+		for (unique_ptr<Socket>& s : attempts)
+			s->close(ignored);
+		stagger.cancel();
+		if (stream)
+			stream->next_layer().close(ignored);
+		ios.restart();
+		ios.run();
+		timeouts.inc();
+		ec = boost::asio::error::timed_out;
+	}
+};
+
+HttpsClient::HttpsClient(const string& host, const string& port):
+	m_host(host),
+	m_port(port),
+	m_conn(new Connection(host)),
+	m_resolver(&HostResolver::shared()),
+	m_stagger(250),
+	m_compression(true),
+	m_encoding(IDENTITY)
+{
+}
+
+HttpsClient::~HttpsClient()
+{
+	disconnect();
+}
+
+void HttpsClient::connect(Deadline deadline)
+{
+	Log l("HttpsClient::connect");
+	Connection& c = *m_conn;
+	c.stream.reset(new ssl::stream<Socket>(c.ios, c.ctx));
+	c.buffer.consume(c.buffer.size());
+	boost::system::error_code ec;
+	bool done = false;
+
+	// Look up the domain name, mostly in the cache, and connect to the
+	// first address to answer
+	try
+	{
+		race(m_resolver->resolve(m_host, m_port, deadline), deadline, ec);
+	}
+	catch (const boost::system::system_error& e)
+	{
+		ec = e.code();
+	}
+
+	// Perform the SSL handshake
+	if (!ec)
+	{
+		done = false;
+		c.stream->async_handshake(ssl::stream_base::client, c.handler(
+			[&](const boost::system::error_code& e)
+		{
+			ec = e;
+			done = true;
+		}));
+		c.run(deadline, done, ec);
+	}
+	if (ec)
+	{
+		c.stream.reset();
+		throw boost::system::system_error{ ec };
+	}
+	c.handshakes.inc();
+	if (c.connectedBefore)
+		c.reconnects.inc();
+	c.connectedBefore = true;
+}
+
+void HttpsClient::race(const vector<HostResolver::Endpoint>& addresses, Deadline deadline,
+	boost::system::error_code& ec)
+{
+	Connection& c = *m_conn;
+	c.attempts.clear();
+	size_t failed = 0;
+	size_t winner = addresses.size();
+	bool done = false;
+	auto finish = [&]()
+	{
+		done = true;
+		boost::system::error_code ignored;
+		for (size_t i = 0; i < c.attempts.size(); ++i)
+			if (i != winner)
+				c.attempts[i]->close(ignored);
+		c.stagger.cancel();
+	};
+	function<void()> startNext = [&]()
+	{
+		if (c.attempts.size() == addresses.size())
+			return;
+		size_t i = c.attempts.size();
+		c.attempts.emplace_back(new Socket(c.ios));
+		c.connectAttempts.inc();
+		c.attempts[i]->async_connect(addresses[i], c.handler([&, i](const boost::system::error_code& e)
+		{
+			// closed by finish() or at the deadline
+			if (done || e == boost::asio::error::operation_aborted)
+				return;
+			if (!e)
+			{
+				winner = i;
+				ec = e;
+				finish();
+			}
+			else if (++failed == addresses.size())
+			{
+				ec = e;
+				finish();
+			}
+			else
+				// a refused address makes way for the next one at once
+				startNext();
+		}));
+		c.stagger.expires_after(m_stagger);
+		c.stagger.async_wait(c.handler([&](const boost::system::error_code& e)
+		{
+			if (!e && !done)
+				startNext();
+		}));
+	};
+	startNext();
+	c.run(deadline, done, ec);
+	if (winner < addresses.size())
+		c.stream->next_layer() = std::move(*c.attempts[winner]);
+	c.attempts.clear();
+}
+
+void HttpsClient::disconnect()
+{
+	Connection& c = *m_conn;
+	if (!c.stream)
+		return;
+	// Gracefully close the stream, without waiting long for the peer
+	boost::system::error_code ec;
+	bool done = false;
+	c.stream->async_shutdown(c.handler([&](const boost::system::error_code&)
+	{
+		done = true;
+	}));
+	c.run(chrono::steady_clock::now() + chrono::seconds(1), done, ec);
+	c.stream->next_layer().close(ec);
+	c.stream.reset();
+}
+
+const string& HttpsClient::get(const char* target, Deadline deadline)
+{
+	Connection& c = *m_conn;
+	c.clear();
+	c.request.method(http::verb::get);
+	c.request.target(target);
+	c.request.version(11);
+	c.request.set(http::field::host, m_host);
+	c.request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+	if (m_compression)
+		c.request.set(http::field::accept_encoding, "gzip, deflate");
+	return send(deadline, true);
+}
+
+const string& HttpsClient::post(const char* target, const string& body,
+	initializer_list<Header> headers, Deadline deadline, bool idempotent)
+{
+	Connection& c = *m_conn;
+	c.clear();
+	c.request.method(http::verb::post);
+	c.request.target(target);
+	c.request.version(11);
+	c.request.set(http::field::host, m_host);
+	c.request.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+	c.request.set(http::field::content_type,
+		"application/x-www-form-urlencoded");
+	if (m_compression)
+		c.request.set(http::field::accept_encoding, "gzip, deflate");
+	for (const Header& h : headers)
+		c.request.set(h.name, h.value);
+	c.request.body().assign(body);
+	c.request.prepare_payload();
+	return send(deadline, idempotent);
+}
+
+const string& HttpsClient::send(Deadline deadline, bool idempotent)
+{
+	Connection& c = *m_conn;
+	bool reused = c.stream != nullptr;
+	for (;;)
+	{
+		if (!c.stream)
+			connect(deadline);
+		boost::system::error_code ec;
+		bool done = false;
+		http::async_write(*c.stream, c.request, c.handler(
+			[&](const boost::system::error_code& e, size_t bytes)
+		{
+			ec = e;
+			c.bytesSent.inc(bytes);
+			done = true;
+		}));
+		c.run(deadline, done, ec);
+		http::response_parser<http::string_body, ArenaAllocator<char>> parser(std::move(c.response));
+		if (!ec)
+		{
+			done = false;
+			http::async_read(*c.stream, c.buffer, parser, c.handler(
+				[&](const boost::system::error_code& e, size_t bytes)
+			{
+				ec = e;
+				c.bytesReceived.inc(bytes);
+				done = true;
+			}));
+			c.run(deadline, done, ec);
+		}
+		bool answered = parser.got_some();
+		c.response = parser.release();
+		if (!ec)
+			break;
+		boost::system::error_code ignored;
+		c.stream->next_layer().close(ignored);
+		c.stream.reset();
+		// the server may drop an idle keep-alive connection; the request
+		// is sent again only if nothing came back on the old one and doing
+		// it twice is harmless, else the caller learns that it may be lost
+		if (!reused || !idempotent || answered || ec == boost::asio::error::timed_out)
+			throw boost::system::system_error{ ec };
+		reused = false;
+	}
+	if (!c.response.keep_alive())
+		disconnect();
+	boost::beast::string_view encoding = c.response[http::field::content_encoding];
+	if (encoding.empty() || boost::beast::iequals(encoding, "identity"))
+		m_encoding = IDENTITY;
+	else if (boost::beast::iequals(encoding, "gzip") || boost::beast::iequals(encoding, "x-gzip"))
+		m_encoding = GZIP;
+	else if (boost::beast::iequals(encoding, "deflate"))
+		m_encoding = DEFLATE;
+	else
+		throw runtime_error("Unsupported content encoding " + string(encoding.data(), encoding.size()));
+	return c.response.body();
+}
+
+HttpsPool::HttpsPool(const string& host, const string& port):
+	m_host(host),
+	m_port(port),
+	m_compression(true)
+{
+}
+
+HttpsPool::Lease HttpsPool::acquire()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if (!m_idle.empty())
+		{
+			unique_ptr<HttpsClient> client(std::move(m_idle.back()));
+			m_idle.pop_back();
+			client->set_compression(m_compression);
+			return Lease(*this, std::move(client));
+		}
+	}
+	unique_ptr<HttpsClient> client(new HttpsClient(m_host, m_port));
+	client->set_compression(m_compression);
+	return Lease(*this, std::move(client));
+}
+
+void HttpsPool::release(unique_ptr<HttpConnection> client)
+{
+	// only clients leased here come back
+	unique_ptr<HttpsClient> https(static_cast<HttpsClient*>(client.release()));
+	lock_guard<mutex> lock(m_mutex);
+	m_idle.push_back(std::move(https));
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <initializer_list>
+#include "Transport.h"
+#include "HostResolver.h"
+
+// Keep-alive HTTPS connection to one host. Request and response buffers
+// belong to the connection and are reused by every call, so steady-state
+// requests do not allocate. Every network phase of a request ends at its
+// deadline; a late request fails with boost::asio::error::timed_out.
+// Connects race the addresses of the host, happy eyeballs style: the next
+// address is tried when the last one failed or has not answered within
+// the stagger, and the first to answer is kept.
+class HttpsClient : public HttpConnection
+{
+public:
+	HttpsClient(const std::string& host, const std::string& port);
+	~HttpsClient();
+
+	// Asks for gzip or deflate bodies, on by default. The body is handed
+	// back as it came, see encoding() and InflateBuf.
+	void set_compression(bool compression)
+	{
+		m_compression = compression;
+	}
+	virtual Encoding encoding() const
+	{
+		return m_encoding;
+	}
+	// HostResolver::shared() unless set
+	void set_resolver(HostResolver& resolver)
+	{
+		m_resolver = &resolver;
+	}
+	// 250 ms unless set
+	void set_connect_stagger(std::chrono::milliseconds stagger)
+	{
+		m_stagger = stagger;
+	}
+
+	// The returned body stays valid until the next request on this client
+	virtual const std::string& get(const char* target, Deadline deadline = Deadline::max());
+	virtual const std::string& post(const char* target, const std::string& body,
+		std::initializer_list<Header> headers, Deadline deadline = Deadline::max(),
+		bool idempotent = false);
+
+	void disconnect();
+private:
+	HttpsClient(const HttpsClient&);
+	HttpsClient& operator=(const HttpsClient&);
+
+	struct Connection;
+
+	void connect(Deadline deadline);
+	void race(const std::vector<HostResolver::Endpoint>& addresses, Deadline deadline,
+		boost::system::error_code& ec);
+	const std::string& send(Deadline deadline, bool idempotent);
+
+	std::string m_host;
+	std::string m_port;
+	std::unique_ptr<Connection> m_conn;
+	HostResolver* m_resolver;
+	std::chrono::milliseconds m_stagger;
+	bool m_compression;
+	Encoding m_encoding;
+};
+
+// Idle connections to one host, the transport of live runs
+class HttpsPool : public Transport
+{
+public:
+	HttpsPool(const std::string& host, const std::string& port);
+
+	virtual void set_compression(bool compression)
+	{
+		m_compression = compression;
+	}
+
+	virtual Lease acquire();
+protected:
+	virtual void release(std::unique_ptr<HttpConnection> client);
+private:
+	std::string m_host;
+	std::string m_port;
+	std::atomic<bool> m_compression;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<HttpsClient>> m_idle;
+};
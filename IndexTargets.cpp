@@ -0,0 +1,101 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "IndexTargets.h"
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+IndexTargets::IndexTargets(size_t size, size_t margin):
+	m_size(size),
+	m_margin(margin),
+	m_weighting(BY_SCORE),
+	m_joined(0),
+	m_left(0)
+{
+	if (!size)
+		throw runtime_error("Index of no coins");
+}
+
+void IndexTargets::exclude(const string& coin)
+{
+	auto it = lower_bound(m_excluded.begin(), m_excluded.end(), coin);
+	if (it == m_excluded.end() || *it != coin)
+		m_excluded.insert(it, coin);
+}
+
+void IndexTargets::set_members(const vector<string>& coins)
+{
+	m_members = coins;
+	sort(m_members.begin(), m_members.end());
+	m_members.erase(unique(m_members.begin(), m_members.end()), m_members.end());
+}
+
+bool IndexTargets::member(const string& coin) const
+{
+	return binary_search(m_members.begin(), m_members.end(), coin);
+}
+
+const vector<IndexTargets::Target>& IndexTargets::update(const map<string, TradeApi::CoinInfo>& tickers)
+{
+	m_candidates.clear();
+	for (const auto& t : tickers)
+	{
+		// direct markets such as ETH_XMR are priced in another coin
+		if (t.first.find('_') != string::npos ||
+			binary_search(m_excluded.begin(), m_excluded.end(), t.first))
+			continue;
+		double score = m_ranking ? m_ranking(t.second) : static_cast<double>(t.second.volume);
+		if (score > 0.0)
+			m_candidates.push_back({ score, &t.first });
+	}
+	auto higher = [](const Candidate& a, const Candidate& b)
+	{
+		return a.score > b.score || (a.score == b.score && *a.coin < *b.coin);
+	};
+	// members stay within the first size + margin, outsiders join from
+	// the first size, which alone are put in order
+	size_t keep = min(m_candidates.size(), m_size + m_margin);
+	size_t enter = min(m_candidates.size(), m_size);
+	if (keep < m_candidates.size())
+		nth_element(m_candidates.begin(), m_candidates.begin() + keep, m_candidates.end(), higher);
+	if (enter < keep)
+		nth_element(m_candidates.begin(), m_candidates.begin() + enter, m_candidates.begin() + keep, higher);
+	sort(m_candidates.begin(), m_candidates.begin() + enter, higher);
+
+	auto ranked = [](const Target& a, const Target& b)
+	{
+		return a.score > b.score || (a.score == b.score && a.coin < b.coin);
+	};
+	m_targets.clear();
+	for (size_t i = 0; i < keep; ++i)
+		if (member(*m_candidates[i].coin))
+			m_targets.push_back({ *m_candidates[i].coin, 0.0, m_candidates[i].score });
+	// more members than places, as when every coin held was taken for one:
+	// the best ranked keep theirs
+	if (m_targets.size() > m_size)
+	{
+		sort(m_targets.begin(), m_targets.end(), ranked);
+		m_targets.resize(m_size);
+	}
+	size_t stayed = m_targets.size();
+	for (size_t i = 0; i < enter && m_targets.size() < m_size; ++i)
+		if (!member(*m_candidates[i].coin))
+			m_targets.push_back({ *m_candidates[i].coin, 0.0, m_candidates[i].score });
+	sort(m_targets.begin(), m_targets.end(), ranked);
+
+	double sum = 0.0;
+	for (const Target& t : m_targets)
+		sum += (m_weighting == EQUAL) ? 1.0 : t.score;
+	for (Target& t : m_targets)
+		t.part = ((m_weighting == EQUAL) ? 1.0 : t.score) / sum;
+
+	m_joined = m_targets.size() - stayed;
+	m_left = m_members.size() - stayed;
+	m_next.clear();
+	for (const Target& t : m_targets)
+		m_next.push_back(t.coin);
+	sort(m_next.begin(), m_next.end());
+	m_members.swap(m_next);
+	return m_targets;
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "TradeApi.h"
+
+// Target parts of an index portfolio: the size BTC markets ranking
+// highest, by 24h volume unless ranked otherwise, weighted by their score
+// or equally. A member keeps its place while it ranks within size +
+// margin, and an outsider joins only when it ranks within size and a
+// place is free, so coins near the cut do not trade in and out every run.
+class IndexTargets
+{
+public:
+	enum Weighting
+	{
+		BY_SCORE,
+		EQUAL
+	};
+	// markets scoring zero or less never join
+	typedef std::function<double(const TradeApi::CoinInfo&)> Ranking;
+
+	struct Target
+	{
+		std::string coin;
+		// of the index, all of them sum to 1
+		double part;
+		double score;
+	};
+
+	IndexTargets(size_t size, size_t margin);
+
+	void set_weighting(Weighting weighting)
+	{
+		m_weighting = weighting;
+	}
+	void set_ranking(const Ranking& ranking)
+	{
+		m_ranking = ranking;
+	}
+	// coins never to be members, such as USDT
+	void exclude(const std::string& coin);
+	// members before the first update, such as the coins held
+	void set_members(const std::vector<std::string>& coins);
+
+	// Ranks the tickers, by coin as in MarketSnapshot, and returns the
+	// members by rank; only size + margin markets are ever sorted
+	const std::vector<Target>& update(const std::map<std::string, TradeApi::CoinInfo>& tickers);
+	const std::vector<Target>& targets() const
+	{
+		return m_targets;
+	}
+	// of the last update
+	size_t joined() const
+	{
+		return m_joined;
+	}
+	size_t left() const
+	{
+		return m_left;
+	}
+private:
+	struct Candidate
+	{
+		double score;
+		const std::string* coin;
+	};
+
+	bool member(const std::string& coin) const;
+
+	size_t m_size;
+	size_t m_margin;
+	Weighting m_weighting;
+	Ranking m_ranking;
+	// sorted
+	std::vector<std::string> m_excluded;
+	std::vector<std::string> m_members;
+	std::vector<std::string> m_next;
+	// reused from one update to the next
+	std::vector<Candidate> m_candidates;
+	std::vector<Target> m_targets;
+	size_t m_joined;
+	size_t m_left;
+};
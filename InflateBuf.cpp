@@ -0,0 +1,51 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "InflateBuf.h"
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+InflateBuf::InflateBuf(const char* data, size_t size):
+	m_end(false)
+{
+	memset(&m_zs, 0, sizeof(m_zs));
+	m_zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	m_zs.avail_in = static_cast<uInt>(size);
+	// "deflate" should come with a zlib header, yet some servers send
+	// the bare stream; 32 has zlib tell gzip from zlib by itself
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+	bool wrapped = size >= 2 && ((p[0] == 0x1f && p[1] == 0x8b) ||
+		((p[0] & 0x0f) == 8 && (p[0] * 256 + p[1]) % 31 == 0));
+	if (inflateInit2(&m_zs, wrapped ? 15 + 32 : -15) != Z_OK)
+		throw runtime_error("Failed to start decompression");
+	setg(m_buffer, m_buffer, m_buffer);
+}
+
+InflateBuf::~InflateBuf()
+{
+	inflateEnd(&m_zs);
+}
+
+InflateBuf::int_type InflateBuf::underflow()
+{
+	while (!m_end)
+	{
+		m_zs.next_out = reinterpret_cast<Bytef*>(m_buffer);
+		m_zs.avail_out = sizeof(m_buffer);
+		int res = inflate(&m_zs, Z_NO_FLUSH);
+		if (res == Z_STREAM_END)
+			m_end = true;
+		else if (res == Z_BUF_ERROR)
+			throw runtime_error("Truncated compressed reply");
+		else if (res != Z_OK)
+			throw runtime_error("Corrupt compressed reply");
+		size_t produced = sizeof(m_buffer) - m_zs.avail_out;
+		if (produced)
+		{
+			setg(m_buffer, m_buffer, m_buffer + produced);
+			return traits_type::to_int_type(m_buffer[0]);
+		}
+	}
+	return traits_type::eof();
+}
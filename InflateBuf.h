@@ -0,0 +1,25 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <streambuf>
+#include <zlib.h>
+
+// Decompresses a gzip or deflate reply chunk by chunk as the reader asks
+// for more, so a compressed body reaches the JSON parser without ever
+// being held inflated in full. Corrupt data throws std::runtime_error.
+class InflateBuf : public std::streambuf
+{
+public:
+	InflateBuf(const char* data, size_t size);
+	~InflateBuf();
+protected:
+	virtual int_type underflow();
+private:
+	InflateBuf(const InflateBuf&);
+	InflateBuf& operator=(const InflateBuf&);
+
+	z_stream m_zs;
+	bool m_end;
+	char m_buffer[16384];
+};
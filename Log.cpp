@@ -1,31 +1,60 @@
 #include "Log.h"
-#include <fstream>
-#include <cstdarg>
-#include <boost/format.hpp>
+#include <cstdio>
 
 const char* log_file = "polo.log";
 
-Log::Log(const std::string& label):
+// the file stays open for the whole run, so logging on the request path
+// neither reopens it nor allocates
+static FILE*& log_stream()
+{
+	static FILE* f = std::fopen(log_file, "a");
+	return f;
+}
+
+static void log_line(const char* prefix, const char* msg, const char* suffix)
+{
+	FILE* f = log_stream();
+	if (!f)
+		return;
+	std::fprintf(f, "%s%s%s\n", prefix, msg, suffix);
+	std::fflush(f);
+}
+
+Log::Log(const char* label):
 	label_(label)
 {
-	std::ofstream f(log_file, std::ios_base::app | std::ofstream::out);
-	f << label_ << " opened" << std::endl;
+	log_line("", label_, " opened");
+}
+
+Log::Log(const std::string& label):
+	owned_(label)
+{
+	label_ = owned_.c_str();
+	log_line("", label_, " opened");
 }
 
 
 Log::~Log()
 {
-	std::ofstream f(log_file, std::ios_base::app | std::ofstream::out);
-	f << label_ << " closed" << std::endl;
+	log_line("", label_, " closed");
 }
 
 void Log::init()
 {
-	std::ofstream f(log_file, std::ios_base::trunc | std::ofstream::out);
+	FILE*& f = log_stream();
+	if (f)
+		std::fclose(f);
+	f = std::fopen(log_file, "w");
+	if (f)
+		f = std::freopen(log_file, "a", f);
+}
+
+void Log::write(const char* msg)
+{
+	log_line("\t", msg, "");
 }
 
 void Log::write(const std::string& msg)
 {
-	std::ofstream f(log_file, std::ios_base::app | std::ofstream::out);
-	f << '\t' << msg << std::endl;
+	log_line("\t", msg.c_str(), "");
 }
@@ -5,12 +5,15 @@
 
 class Log
 {
-	std::string label_;
+	const char* label_;
+	std::string owned_;
 public:
+	Log(const char* label);
 	Log(const std::string& label);
 	~Log();
 
 	static void init();
+	static void write(const char* msg);
 	static void write(const std::string& msg);
 };
 
@@ -0,0 +1,118 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "MarketPipeline.h"
+#include "MarketSnapshot.h"
+#include "Log.h"
+
+using namespace std;
+
+MarketPipeline::MarketPipeline(const std::vector<std::string>& coins, Clock& clock):
+	m_clock(&clock),
+	m_tickers(new LatestValue<TradeApi::CoinInfo>[coins.size()]),
+	m_pending(0),
+	m_updates(Metrics::instance().counter("market_pipeline_updates_total")),
+	m_conflated(Metrics::instance().counter("market_pipeline_conflated_total")),
+	m_evaluations(Metrics::instance().counter("market_pipeline_evaluations_total")),
+	m_depth(Metrics::instance().gauge("market_pipeline_depth")),
+	m_staleness(Metrics::instance().histogram("market_pipeline_staleness_seconds")),
+	m_stop(false)
+{
+	for (size_t i = 0; i < coins.size(); ++i)
+		m_index[coins[i]] = i;
+}
+
+MarketPipeline::~MarketPipeline()
+{
+	stop();
+}
+
+void MarketPipeline::publish(const std::map<std::string, TradeApi::CoinInfo>& tickers)
+{
+	Clock::TimePoint now = m_clock->now();
+	for (const auto& t : tickers)
+	{
+		auto it = m_index.find(t.first);
+		if (it == m_index.end())
+			continue;
+		++m_pending;
+		published(m_tickers[it->second].put(t.second, now));
+	}
+}
+
+void MarketPipeline::publish(const std::map<std::string, Decimal>& balances)
+{
+	++m_pending;
+	published(m_balances.put(balances, m_clock->now()));
+}
+
+void MarketPipeline::published(bool newlyPending)
+{
+	m_updates.inc();
+	if (newlyPending)
+		m_depth.set(static_cast<double>(m_pending.load()));
+	else
+	{
+		--m_pending;
+		m_conflated.inc();
+	}
+}
+
+bool MarketPipeline::consume(MarketSnapshot& snapshot)
+{
+	Clock::TimePoint now = m_clock->now();
+	size_t taken = 0;
+	for (const auto& i : m_index)
+	{
+		const LatestValue<TradeApi::CoinInfo>::Entry* e = m_tickers[i.second].take();
+		if (!e)
+			continue;
+		snapshot.tickers[i.first] = e->value;
+		m_staleness.observe(chrono::duration<double>(now - e->time).count());
+		++taken;
+	}
+	if (const LatestValue<std::map<std::string, Decimal>>::Entry* e = m_balances.take())
+	{
+		snapshot.balances = e->value;
+		m_staleness.observe(chrono::duration<double>(now - e->time).count());
+		++taken;
+	}
+	if (taken)
+		m_depth.set(static_cast<double>(m_pending -= taken));
+	return taken > 0;
+}
+
+void MarketPipeline::start(Evaluate evaluate, Clock::Duration interval)
+{
+	m_stop = false;
+	m_thread = thread([this, evaluate, interval]()
+	{
+		MarketSnapshot snapshot;
+		while (!m_stop)
+		{
+			Clock::TimePoint started = m_clock->now();
+			if (consume(snapshot))
+			{
+				m_evaluations.inc();
+				try
+				{
+					// evaluate may keep its snapshot, the next round changes this one
+					evaluate(make_shared<const MarketSnapshot>(snapshot));
+				}
+				catch (const exception& e)
+				{
+					Log::write(string("evaluation failed: ") + e.what());
+				}
+			}
+			Clock::Duration spent = m_clock->now() - started;
+			if (spent < interval)
+				m_clock->sleep_for(interval - spent);
+		}
+	});
+}
+
+void MarketPipeline::stop()
+{
+	m_stop = true;
+	if (m_thread.joinable())
+		m_thread.join();
+}
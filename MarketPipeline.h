@@ -0,0 +1,112 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Clock.h"
+#include "Metrics.h"
+#include "TradeApi.h"
+
+struct MarketSnapshot;
+
+// The latest of a stream of values, passed from one producer thread to one
+// consumer thread through three buffers without locks: the producer never
+// waits, and values the consumer has not taken yet are overwritten.
+template<class T>
+class LatestValue
+{
+public:
+	struct Entry
+	{
+		T value;
+		Clock::TimePoint time;
+	};
+
+	LatestValue() : m_shared(1), m_back(0), m_front(2) {}
+
+	// false when it replaced a value never taken
+	bool put(const T& value, Clock::TimePoint time)
+	{
+		m_buffers[m_back].value = value;
+		m_buffers[m_back].time = time;
+		unsigned old = m_shared.exchange(m_back | fresh, std::memory_order_acq_rel);
+		m_back = old & index;
+		return !(old & fresh);
+	}
+	// nullptr when nothing was put since the last take
+	const Entry* take()
+	{
+		if (!(m_shared.load(std::memory_order_acquire) & fresh))
+			return nullptr;
+		unsigned old = m_shared.exchange(m_front, std::memory_order_acq_rel);
+		m_front = old & index;
+		return &m_buffers[m_front];
+	}
+private:
+	static const unsigned index = 3;
+	static const unsigned fresh = 4;
+
+	Entry m_buffers[3];
+	std::atomic<unsigned> m_shared;
+	// owned by the producer and the consumer, on lines of their own
+	alignas(64) unsigned m_back;
+	alignas(64) unsigned m_front;
+};
+
+// Hands market data from the thread that downloads it to the one that
+// evaluates the portfolio. Every coin has a slot keeping only its latest
+// ticker, balances have one more, so a slow evaluation makes updates
+// conflate instead of queue up and the downloads never wait for it.
+class MarketPipeline
+{
+public:
+	typedef std::function<void(const std::shared_ptr<const MarketSnapshot>&)> Evaluate;
+
+	// tickers of coins not given here are not passed on
+	MarketPipeline(const std::vector<std::string>& coins, Clock& clock = Clock::system());
+	~MarketPipeline();
+
+	// the producer side, from one thread only
+	void publish(const std::map<std::string, TradeApi::CoinInfo>& tickers);
+	void publish(const std::map<std::string, Decimal>& balances);
+
+	// The consumer side: applies what changed to snapshot, false when
+	// nothing did. Not to be called while started.
+	bool consume(MarketSnapshot& snapshot);
+	// Consumes on a thread of its own and calls evaluate with a copy of
+	// the changed snapshot, at most once per interval
+	void start(Evaluate evaluate, Clock::Duration interval);
+	void stop();
+
+	// slots published but not consumed yet
+	size_t pending() const
+	{
+		return m_pending.load(std::memory_order_relaxed);
+	}
+private:
+	// counts a put, which left its slot pending unless it conflated. The
+	// slot is counted pending before the put, so that the consumer never
+	// takes more than was counted; a conflated put takes it back.
+	void published(bool newlyPending);
+
+	Clock* m_clock;
+	std::map<std::string, size_t> m_index;
+	std::unique_ptr<LatestValue<TradeApi::CoinInfo>[]> m_tickers;
+	LatestValue<std::map<std::string, Decimal>> m_balances;
+	std::atomic<size_t> m_pending;
+
+	Counter& m_updates;
+	Counter& m_conflated;
+	Counter& m_evaluations;
+	Gauge& m_depth;
+	Histogram& m_staleness;
+
+	std::atomic<bool> m_stop;
+	std::thread m_thread;
+};
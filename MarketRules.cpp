@@ -0,0 +1,250 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "MarketRules.h"
+#include "Log.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+	int64_t roundTo(int64_t units, int64_t step, bool down)
+	{
+		if (step <= 1)
+			return units;
+		return ((down ? units : units + step / 2) / step) * step;
+	}
+
+	// the number after text in message, if any
+	bool numberAfter(const std::string& message, const char* text, Decimal& value)
+	{
+		size_t pos = message.find(text);
+		if (pos == string::npos)
+			return false;
+		const char* begin = message.c_str() + pos + strlen(text);
+		const char* end = begin;
+		while (*end && (isdigit(static_cast<unsigned char>(*end)) || *end == '.'))
+			++end;
+		// a full stop ends the sentence
+		if (end > begin && end[-1] == '.')
+			--end;
+		return Decimal::parse(begin, end, value);
+	}
+}
+
+MarketRules::Rule::Rule():
+	minTotal(Decimal::fromUnits(10000)),
+	minAmount(),
+	tick(Decimal::fromUnits(1)),
+	step(Decimal::fromUnits(1)),
+	frozen(false)
+{
+}
+
+MarketRules::MarketRules()
+{
+	// counted in USDT there, and not documented
+	m_rules["USDT"].minTotal = Decimal();
+}
+
+MarketRules::Rule MarketRules::rule(const std::string& coin) const
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto it = m_rules.find(coin);
+	return (it != m_rules.end()) ? it->second : Rule();
+}
+
+void MarketRules::set(const std::string& coin, const Rule& rule)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_rules[coin] = rule;
+}
+
+bool MarketRules::set_frozen(const std::string& coin, bool frozen)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto it = m_rules.find(coin);
+	if (it == m_rules.end())
+	{
+		if (!frozen)
+			return false;
+		it = m_rules.insert(make_pair(coin, Rule())).first;
+	}
+	if (it->second.frozen == frozen)
+		return false;
+	it->second.frozen = frozen;
+	return true;
+}
+
+bool MarketRules::apply(TradeApi::Order& order, std::string& reason) const
+{
+	Rule r = rule(order.market());
+	if (r.frozen)
+	{
+		reason = "Market " + order.market() + " is frozen";
+		return false;
+	}
+	order.price = Decimal::fromUnits(roundTo(order.price.units(), r.tick.units(), false));
+	order.amount = Decimal::fromUnits(roundTo(order.amount.units(), r.step.units(), true));
+	if (order.price.units() <= 0 || order.amount.units() <= 0)
+	{
+		reason = "Invalid amount";
+		return false;
+	}
+	if (order.amount.units() < r.minAmount.units())
+	{
+		reason = "Amount below the minimum of " + r.minAmount.str();
+		return false;
+	}
+	if (total(order) < r.minTotal)
+	{
+		reason = "Total below the minimum of " + r.minTotal.str();
+		return false;
+	}
+	return true;
+}
+
+size_t MarketRules::prepare(std::vector<TradeApi::Order>& orders) const
+{
+	vector<size_t> origins;
+	map<size_t, string> removed;
+	return prepare(orders, origins, removed);
+}
+
+size_t MarketRules::prepare(std::vector<TradeApi::Order>& orders, std::vector<size_t>& origins,
+	std::map<size_t, std::string>& removed) const
+{
+	vector<TradeApi::Order> res;
+	origins.clear();
+	removed.clear();
+	// by position in res, the orders merged into it
+	vector<vector<size_t>> merged;
+	for (size_t i = 0; i < orders.size(); ++i)
+	{
+		const TradeApi::Order& o = orders[i];
+		size_t same = 0;
+		while (same < res.size() && (res[same].market() != o.market() || res[same].action != o.action))
+			++same;
+		if (same == res.size())
+		{
+			res.push_back(o);
+			origins.push_back(i);
+			merged.push_back(vector<size_t>());
+			continue;
+		}
+		// the merged order goes at the average price
+		TradeApi::Order& into = res[same];
+		double amount = into.amount + o.amount;
+		into.price = (into.price * into.amount + o.price * o.amount) / amount;
+		into.amount = amount;
+		merged[same].push_back(i);
+	}
+	size_t dropped = 0;
+	string reason;
+	size_t kept = 0;
+	for (size_t i = 0; i < res.size(); ++i)
+	{
+		if (!apply(res[i], reason))
+		{
+			Log::write("dropped order for " + res[i].market() + ": " + reason);
+			removed[origins[i]] = reason;
+			for (size_t m : merged[i])
+				removed[m] = reason;
+			++dropped;
+			continue;
+		}
+		char into[64];
+		snprintf(into, sizeof(into), "merged into order %zu", origins[i]);
+		for (size_t m : merged[i])
+			removed[m] = into;
+		res[kept] = res[i];
+		origins[kept++] = origins[i];
+	}
+	res.resize(kept);
+	origins.resize(kept);
+	orders.swap(res);
+	return dropped;
+}
+
+bool MarketRules::learn(const std::string& coin, const std::string& error)
+{
+	Decimal value;
+	lock_guard<mutex> lock(m_mutex);
+	auto it = m_rules.find(coin);
+	Rule r = (it != m_rules.end()) ? it->second : Rule();
+	if (numberAfter(error, "Total must be at least ", value) && value.units() > r.minTotal.units())
+		r.minTotal = value;
+	else if (numberAfter(error, "Amount must be at least ", value) && value.units() > r.minAmount.units())
+		r.minAmount = value;
+	else
+		return false;
+	m_rules[coin] = r;
+	return true;
+}
+
+bool MarketRules::load(const std::string& path, unsigned maxAge)
+{
+	ifstream f(path);
+	string word;
+	long long saved = 0;
+	if (!(f >> word >> saved) || word != "saved" ||
+		time(0) - saved > static_cast<time_t>(maxAge))
+		return false;
+	map<string, Rule> rules;
+	string coin, minTotal, minAmount, tick, step;
+	int frozen;
+	while (f >> coin >> minTotal >> minAmount >> tick >> step >> frozen)
+	{
+		Rule& r = rules[coin];
+		r.minTotal = Decimal::parse(minTotal);
+		r.minAmount = Decimal::parse(minAmount);
+		r.tick = Decimal::parse(tick);
+		r.step = Decimal::parse(step);
+		r.frozen = frozen != 0;
+	}
+	lock_guard<mutex> lock(m_mutex);
+	for (const auto& r : rules)
+		m_rules[r.first] = r.second;
+	return true;
+}
+
+void MarketRules::save(const std::string& path) const
+{
+	ostringstream out;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		out << "saved " << static_cast<long long>(time(0)) << '\n';
+		for (const auto& r : m_rules)
+			out << r.first << ' ' << r.second.minTotal << ' ' << r.second.minAmount << ' ' <<
+				r.second.tick << ' ' << r.second.step << ' ' << (r.second.frozen ? 1 : 0) << '\n';
+	}
+	// write aside and rename, like the other state files
+	string tmp = path + ".tmp";
+	{
+		ofstream f(tmp, ios_base::trunc);
+		if (!f.is_open())
+			throw runtime_error("Failed to open file " + tmp);
+		f << out.str();
+		if (!f)
+			throw runtime_error("Failed to write file " + tmp);
+	}
+	if (std::rename(tmp.c_str(), path.c_str()) != 0)
+	{
+		std::remove(path.c_str());
+		if (std::rename(tmp.c_str(), path.c_str()) != 0)
+			throw runtime_error("Failed to replace file " + path);
+	}
+}
+
+Decimal MarketRules::total(const TradeApi::Order& order)
+{
+	if (order.coin == "USDT" && order.base.empty())
+		return order.amount;
+	// rounded down, a total just below the minimum must not pass
+	return Decimal::fromUnits(static_cast<int64_t>(
+		static_cast<double>(order.amount.units()) * order.price.units() / Decimal::scale));
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "TradeApi.h"
+
+// What the exchange accepts on each market, by Order::market(), so that orders it would turn
+// down are rounded or dropped before the round trip. The exchange does not
+// publish these rules; they start from its documented minimum of 0.0001
+// BTC and satoshi steps, frozen markets come with the ticker, and larger
+// minimums are learned from the errors of rejected orders.
+class MarketRules
+{
+public:
+	struct Rule
+	{
+		// in the base coin, except for USDT where the exchange counts USDT
+		Decimal minTotal;
+		Decimal minAmount;
+		// price and amount are multiples of these
+		Decimal tick;
+		Decimal step;
+		bool frozen;
+
+		Rule();
+	};
+
+	MarketRules();
+
+	Rule rule(const std::string& coin) const;
+	void set(const std::string& coin, const Rule& rule);
+	// true when the market was not known to be so
+	bool set_frozen(const std::string& coin, bool frozen);
+
+	// Rounds the price to the tick and the amount down to the step; false
+	// with the reason when the order still cannot be placed
+	bool apply(TradeApi::Order& order, std::string& reason) const;
+	// Applies the rules to a whole plan: orders of the same market and side
+	// are merged first, so that two pieces of dust may still make an order,
+	// and what stays unplaceable is dropped. Returns the dropped count.
+	size_t prepare(std::vector<TradeApi::Order>& orders) const;
+	// Same, also telling where every order left comes from: its position
+	// in orders as given, the first of those merged into it. Every order
+	// given that is not left is in removed with the reason.
+	size_t prepare(std::vector<TradeApi::Order>& orders, std::vector<size_t>& origins,
+		std::map<size_t, std::string>& removed) const;
+	// Takes a minimum from an error such as "Total must be at least
+	// 0.0001."; true when a rule changed
+	bool learn(const std::string& coin, const std::string& error);
+
+	// Rules saved more than maxAge seconds ago are not loaded, to learn
+	// them anew; false when nothing was loaded
+	bool load(const std::string& path, unsigned maxAge);
+	void save(const std::string& path) const;
+private:
+	static Decimal total(const TradeApi::Order& order);
+
+	mutable std::mutex m_mutex;
+	std::map<std::string, Rule> m_rules;
+};
@@ -0,0 +1,38 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "MarketSnapshot.h"
+#include <stdexcept>
+
+using namespace std;
+
+const TradeApi::CoinInfo* MarketSnapshot::ticker(const std::string& coin) const
+{
+	auto it = tickers.find(coin);
+	return (it != tickers.end()) ? &it->second : nullptr;
+}
+
+const TradeApi::CoinInfo& MarketSnapshot::info(const std::string& coin) const
+{
+	const TradeApi::CoinInfo* ci = ticker(coin);
+	if (!ci)
+		throw runtime_error("Invalid coin " + coin);
+	return *ci;
+}
+
+const TradeApi::CoinInfo* MarketSnapshot::pair(const std::string& base, const std::string& coin) const
+{
+	return (base == "BTC") ? ticker(coin) : ticker(base + "_" + coin);
+}
+
+Decimal MarketSnapshot::balance(const std::string& coin) const
+{
+	auto it = balances.find(coin);
+	return (it != balances.end()) ? it->second : Decimal();
+}
+
+std::map<std::string, double> MarketSnapshot::balancesInBTC() const
+{
+	map<string, double> res;
+	forEachValue([&res](const std::string& coin, double value) { res[coin] = value; });
+	return res;
+}
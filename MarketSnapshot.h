@@ -0,0 +1,46 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <map>
+#include <string>
+#include "TradeApi.h"
+
+// Tickers and balances as of one moment. A snapshot is never changed once
+// handed out, so everyone holding the pointer reads the same prices
+// without copies or locks.
+struct MarketSnapshot
+{
+	// by coin for the BTC markets, by BASE_COIN for the direct ones
+	std::map<std::string, TradeApi::CoinInfo> tickers;
+	std::map<std::string, Decimal> balances;
+
+	// nullptr when the coin has no ticker
+	const TradeApi::CoinInfo* ticker(const std::string& coin) const;
+	// throws std::runtime_error when the coin has no ticker
+	const TradeApi::CoinInfo& info(const std::string& coin) const;
+	// the direct market trading coin for base, nullptr when there is none
+	const TradeApi::CoinInfo* pair(const std::string& base, const std::string& coin) const;
+	// zero for coins not held
+	Decimal balance(const std::string& coin) const;
+	// every non-zero balance valued in BTC at the middle of the spread,
+	// zero without a ticker
+	std::map<std::string, double> balancesInBTC() const;
+	// calls f(coin, value) for the same without building the map
+	template<class F>
+	void forEachValue(F f) const
+	{
+		for (const auto& b : balances)
+		{
+			if (b.second.units() == 0)
+				continue;
+			if (b.first == "BTC")
+			{
+				f(b.first, static_cast<double>(b.second));
+				continue;
+			}
+			const TradeApi::CoinInfo* ci = ticker(b.first);
+			f(b.first, ci ? b.second * (ci->buyPrice + ci->sellPrice) / 2 : 0.0);
+		}
+	}
+};
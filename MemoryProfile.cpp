@@ -0,0 +1,295 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "MemoryProfile.h"
+#include <sys/resource.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+using namespace std;
+
+namespace
+{
+	const size_t max_phases = 32;
+	const size_t no_phase = max_phases;
+
+	// Plain statics, ready before any constructor runs: operator new is
+	// called during static initialization already.
+	struct Slot
+	{
+		atomic<const char*> name;
+		atomic<uint64_t> allocations;
+		atomic<uint64_t> bytes;
+		atomic<long> peakRss;
+		atomic<long> rssGrowth;
+	};
+	Slot slots[max_phases];
+	atomic<size_t> slotCount(1);
+	atomic<bool> profiling(false);
+	mutex registryMutex;
+
+	thread_local uint64_t threadAllocations = 0;
+	thread_local uint64_t threadBytes = 0;
+	thread_local size_t threadPhase = 0;
+
+	long residentPeak()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss;
+	}
+
+	size_t slotOf(const char* name)
+	{
+		lock_guard<mutex> lock(registryMutex);
+		size_t count = slotCount.load();
+		for (size_t i = 1; i < count; ++i)
+			if (strcmp(slots[i].name.load(), name) == 0)
+				return i;
+		// phases past the limit count as outside any
+		if (count == max_phases)
+			return 0;
+		slots[count].name = name;
+		slotCount = count + 1;
+		return count;
+	}
+
+	// as the standard operator new does: the new_handler may free memory
+	// and have the allocation tried again, or give up by throwing
+	void* allocate(size_t size, size_t alignment = 0)
+	{
+		MemoryProfile::allocated(size);
+		if (!size)
+			size = 1;
+		for (;;)
+		{
+			void* p = nullptr;
+			if (!alignment)
+				p = malloc(size);
+			else if (posix_memalign(&p, alignment, size) != 0)
+				p = nullptr;
+			if (p)
+				return p;
+			new_handler handler = get_new_handler();
+			if (!handler)
+				throw bad_alloc();
+			handler();
+		}
+	}
+
+	void* allocateNothrow(size_t size, size_t alignment = 0) noexcept
+	{
+		try
+		{
+			return allocate(size, alignment);
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
+	}
+}
+
+void MemoryProfile::enable()
+{
+	slots[0].name = "other";
+	profiling = true;
+}
+
+bool MemoryProfile::enabled()
+{
+	return profiling.load(memory_order_relaxed);
+}
+
+void MemoryProfile::allocated(size_t size)
+{
+	++threadAllocations;
+	threadBytes += size;
+	if (!profiling.load(memory_order_relaxed))
+		return;
+	Slot& s = slots[threadPhase];
+	s.allocations.fetch_add(1, memory_order_relaxed);
+	s.bytes.fetch_add(size, memory_order_relaxed);
+}
+
+std::vector<MemoryProfile::Phase> MemoryProfile::phases()
+{
+	vector<Phase> res;
+	size_t count = slotCount.load();
+	for (size_t i = 0; i < count; ++i)
+	{
+		Phase p;
+		p.name = slots[i].name.load() ? slots[i].name.load() : "other";
+		p.allocations = slots[i].allocations.load(memory_order_relaxed);
+		p.bytes = slots[i].bytes.load(memory_order_relaxed);
+		p.peakRss = slots[i].peakRss.load(memory_order_relaxed);
+		p.rssGrowth = slots[i].rssGrowth.load(memory_order_relaxed);
+		res.push_back(p);
+	}
+	return res;
+}
+
+void MemoryProfile::report(std::ostream& out)
+{
+	char line[160];
+	snprintf(line, sizeof(line), "%-16s %12s %14s %14s %12s\n", "phase", "allocations", "bytes",
+		"peak RSS, KB", "growth, KB");
+	out << line;
+	for (const Phase& p : phases())
+	{
+		snprintf(line, sizeof(line), "%-16s %12llu %14llu %14ld %12ld\n", p.name.c_str(),
+			static_cast<unsigned long long>(p.allocations), static_cast<unsigned long long>(p.bytes),
+			p.peakRss, p.rssGrowth);
+		out << line;
+	}
+	snprintf(line, sizeof(line), "%-16s %12s %14s %14ld\n", "total", "", "", residentPeak());
+	out << line;
+}
+
+MemoryPhase::MemoryPhase(const char* name):
+	m_slot(no_phase),
+	m_previous(threadPhase),
+	m_startRss(0)
+{
+	if (!MemoryProfile::enabled())
+		return;
+	m_slot = slotOf(name);
+	m_startRss = residentPeak();
+	threadPhase = m_slot;
+}
+
+MemoryPhase::~MemoryPhase()
+{
+	if (m_slot == no_phase)
+		return;
+	threadPhase = m_previous;
+	long peak = residentPeak();
+	Slot& s = slots[m_slot];
+	s.rssGrowth.fetch_add(peak - m_startRss, memory_order_relaxed);
+	long last = s.peakRss.load(memory_order_relaxed);
+	while (last < peak && !s.peakRss.compare_exchange_weak(last, peak, memory_order_relaxed))
+		;
+}
+
+AllocationCounter::AllocationCounter():
+	m_allocations(threadAllocations),
+	m_bytes(threadBytes)
+{
+}
+
+uint64_t AllocationCounter::allocations() const
+{
+	return threadAllocations - m_allocations;
+}
+
+uint64_t AllocationCounter::bytes() const
+{
+	return threadBytes - m_bytes;
+}
+
+// The program's own operator new, counting as above; every form is
+// replaced so that none bypasses the counters or pairs with another free
+void* operator new(size_t size)
+{
+	return allocate(size);
+}
+
+void* operator new[](size_t size)
+{
+	return allocate(size);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept
+{
+	return allocateNothrow(size);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept
+{
+	return allocateNothrow(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept
+{
+	free(p);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, align_val_t alignment)
+{
+	return allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, align_val_t alignment)
+{
+	return allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept
+{
+	return allocateNothrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept
+{
+	return allocateNothrow(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* p, align_val_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, align_val_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t, align_val_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t, align_val_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, align_val_t, const nothrow_t&) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept
+{
+	free(p);
+}
+#endif
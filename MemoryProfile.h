@@ -0,0 +1,69 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Heap use by phase of a run. The global operator new of this program
+// counts every allocation for the calling thread; once enabled it also
+// adds it to the phase the thread is in, see MemoryPhase.
+class MemoryProfile
+{
+public:
+	struct Phase
+	{
+		std::string name;
+		uint64_t allocations;
+		uint64_t bytes;
+		// peak resident memory of the process when the phase last ended,
+		// and how much the phase raised it, in kilobytes
+		long peakRss;
+		long rssGrowth;
+	};
+
+	static void enable();
+	static bool enabled();
+
+	// in the order first entered, allocations outside any phase first
+	static std::vector<Phase> phases();
+	static void report(std::ostream& out);
+
+	// counts one allocation, for operator new
+	static void allocated(size_t size);
+};
+
+// Attributes the allocations of the calling thread to the named phase
+// while it lives; phases nest. The name must outlive the run, as a
+// literal does. Does nothing unless the profile is enabled.
+class MemoryPhase
+{
+public:
+	explicit MemoryPhase(const char* name);
+	~MemoryPhase();
+private:
+	MemoryPhase(const MemoryPhase&);
+	MemoryPhase& operator=(const MemoryPhase&);
+
+	size_t m_slot;
+	size_t m_previous;
+	long m_startRss;
+};
+
+// Allocations made by the calling thread since construction, whether the
+// profile is enabled or not; benchmarks and tests hold hot paths to an
+// allocation budget with it.
+class AllocationCounter
+{
+public:
+	AllocationCounter();
+
+	uint64_t allocations() const;
+	uint64_t bytes() const;
+private:
+	uint64_t m_allocations;
+	uint64_t m_bytes;
+};
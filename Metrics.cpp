@@ -0,0 +1,298 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "Metrics.h"
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+namespace http = boost::beast::http;    // from <boost/beast/http.hpp>
+using namespace std;
+
+static uint64_t to_bits(double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+static double from_bits(uint64_t bits)
+{
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void Gauge::set(double value)
+{
+	m_bits.store(to_bits(value), memory_order_relaxed);
+}
+
+double Gauge::value() const
+{
+	return from_bits(m_bits.load(memory_order_relaxed));
+}
+
+Histogram::Histogram(const vector<double>& bounds):
+	m_bounds(bounds),
+	m_buckets(new atomic<uint64_t>[bounds.size() + 1]),
+	m_count(0),
+	m_sumBits(to_bits(0.0))
+{
+	sort(m_bounds.begin(), m_bounds.end());
+	for (size_t i = 0; i <= m_bounds.size(); ++i)
+		m_buckets[i].store(0, memory_order_relaxed);
+}
+
+void Histogram::observe(double value)
+{
+	size_t i = lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+	m_buckets[i].fetch_add(1, memory_order_relaxed);
+	m_count.fetch_add(1, memory_order_relaxed);
+	uint64_t old = m_sumBits.load(memory_order_relaxed);
+	while (!m_sumBits.compare_exchange_weak(old, to_bits(from_bits(old) + value),
+		memory_order_relaxed))
+	{
+	}
+}
+
+double Histogram::sum() const
+{
+	return from_bits(m_sumBits.load(memory_order_relaxed));
+}
+
+double Histogram::quantile(double q) const
+{
+	uint64_t total = count();
+	if (!total)
+		return 0.0;
+	double rank = q * total;
+	uint64_t seen = 0;
+	for (size_t i = 0; i <= m_bounds.size(); ++i)
+	{
+		uint64_t n = bucket(i);
+		if (n && seen + n >= rank)
+		{
+			// the overflow bucket has no upper bound to interpolate to
+			if (i == m_bounds.size())
+				return m_bounds.empty() ? 0.0 : m_bounds.back();
+			double lower = i ? m_bounds[i - 1] : 0.0;
+			return lower + (m_bounds[i] - lower) * (rank - seen) / n;
+		}
+		seen += n;
+	}
+	return m_bounds.empty() ? 0.0 : m_bounds.back();
+}
+
+const vector<double>& Histogram::latencyBounds()
+{
+	static const vector<double> bounds = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25,
+		0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0 };
+	return bounds;
+}
+
+Metrics& Metrics::instance()
+{
+	static Metrics metrics;
+	return metrics;
+}
+
+void Metrics::checkName(const string& name, const void* family) const
+{
+	if ((family != &m_counters && m_counters.count(name)) ||
+		(family != &m_gauges && m_gauges.count(name)) ||
+		(family != &m_histograms && m_histograms.count(name)))
+		throw logic_error("Metric " + name + " registered with another type");
+}
+
+Counter& Metrics::counter(const string& name, const string& labels)
+{
+	lock_guard<mutex> lock(m_mutex);
+	checkName(name, &m_counters);
+	unique_ptr<Counter>& c = m_counters[name][labels];
+	if (!c)
+		c.reset(new Counter);
+	return *c;
+}
+
+Gauge& Metrics::gauge(const string& name, const string& labels)
+{
+	lock_guard<mutex> lock(m_mutex);
+	checkName(name, &m_gauges);
+	unique_ptr<Gauge>& g = m_gauges[name][labels];
+	if (!g)
+		g.reset(new Gauge);
+	return *g;
+}
+
+Histogram& Metrics::histogram(const string& name, const string& labels,
+	const vector<double>& bounds)
+{
+	lock_guard<mutex> lock(m_mutex);
+	checkName(name, &m_histograms);
+	unique_ptr<Histogram>& h = m_histograms[name][labels];
+	if (!h)
+		h.reset(new Histogram(bounds));
+	return *h;
+}
+
+string Metrics::label(const string& name, const string& value)
+{
+	string res = name + "=\"";
+	for (char c : value)
+	{
+		if (c == '\\' || c == '"')
+			res += '\\';
+		if (c == '\n')
+		{
+			res += "\\n";
+			continue;
+		}
+		res += c;
+	}
+	return res + "\"";
+}
+
+static string series(const string& name, const string& labels)
+{
+	return labels.empty() ? name : name + "{" + labels + "}";
+}
+
+static string join_labels(const string& labels, const string& extra)
+{
+	return labels.empty() ? extra : labels + "," + extra;
+}
+
+void Metrics::write(ostream& out) const
+{
+	lock_guard<mutex> lock(m_mutex);
+	for (const auto& f : m_counters)
+	{
+		out << "# TYPE " << f.first << " counter\n";
+		for (const auto& s : f.second)
+			out << series(f.first, s.first) << " " << s.second->value() << "\n";
+	}
+	for (const auto& f : m_gauges)
+	{
+		out << "# TYPE " << f.first << " gauge\n";
+		for (const auto& s : f.second)
+			out << series(f.first, s.first) << " " << s.second->value() << "\n";
+	}
+	for (const auto& f : m_histograms)
+	{
+		out << "# TYPE " << f.first << " histogram\n";
+		for (const auto& s : f.second)
+		{
+			const Histogram& h = *s.second;
+			uint64_t cumulative = 0;
+			for (size_t i = 0; i < h.bounds().size(); ++i)
+			{
+				cumulative += h.bucket(i);
+				ostringstream le;
+				le << "le=\"" << h.bounds()[i] << "\"";
+				out << series(f.first + "_bucket", join_labels(s.first, le.str()))
+					<< " " << cumulative << "\n";
+			}
+			cumulative += h.bucket(h.bounds().size());
+			out << series(f.first + "_bucket", join_labels(s.first, "le=\"+Inf\""))
+				<< " " << cumulative << "\n";
+			out << series(f.first + "_sum", s.first) << " " << h.sum() << "\n";
+			out << series(f.first + "_count", s.first) << " " << h.count() << "\n";
+		}
+	}
+}
+
+void Metrics::save(const string& path) const
+{
+	// write aside and rename, so a scraper never reads a partial file
+	string tmp = path + ".tmp";
+	{
+		ofstream f(tmp, ios_base::trunc);
+		if (!f.is_open())
+			throw runtime_error("Failed to open file " + tmp);
+		write(f);
+	}
+	if (std::rename(tmp.c_str(), path.c_str()) != 0)
+	{
+		std::remove(path.c_str());
+		if (std::rename(tmp.c_str(), path.c_str()) != 0)
+			throw runtime_error("Failed to replace file " + path);
+	}
+}
+
+struct MetricsServer::Impl
+{
+	boost::asio::io_service ios;
+	tcp::acceptor acceptor;
+
+	struct Session : enable_shared_from_this<Session>
+	{
+		tcp::socket socket;
+		boost::beast::flat_buffer buffer;
+		http::request<http::string_body> req;
+		http::response<http::string_body> res;
+
+		Session(boost::asio::io_service& ios) : socket(ios) {}
+
+		void start()
+		{
+			auto self = shared_from_this();
+			http::async_read(socket, buffer, req,
+				[self](const boost::system::error_code& ec, size_t)
+			{
+				if (ec)
+					return;
+				ostringstream out;
+				Metrics::instance().write(out);
+				self->res.version(self->req.version());
+				self->res.result(http::status::ok);
+				self->res.set(http::field::content_type, "text/plain; version=0.0.4");
+				self->res.body() = out.str();
+				self->res.keep_alive(false);
+				self->res.prepare_payload();
+				http::async_write(self->socket, self->res,
+					[self](const boost::system::error_code&, size_t)
+				{
+					boost::system::error_code ignored;
+					self->socket.shutdown(tcp::socket::shutdown_send, ignored);
+				});
+			});
+		}
+	};
+
+	Impl(unsigned short port):
+		acceptor(ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+	{
+		accept();
+	}
+
+	void accept()
+	{
+		auto session = make_shared<Session>(ios);
+		acceptor.async_accept(session->socket,
+			[this, session](const boost::system::error_code& ec)
+		{
+			if (!ec)
+				session->start();
+			accept();
+		});
+	}
+};
+
+MetricsServer::MetricsServer(unsigned short port):
+	m_impl(new Impl(port))
+{
+	m_thread = thread([this]() { m_impl->ios.run(); });
+}
+
+MetricsServer::~MetricsServer()
+{
+	m_impl->ios.stop();
+	m_thread.join();
+}
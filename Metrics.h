@@ -0,0 +1,114 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Metric values are plain atomics: registering a series takes a lock,
+// updating it never does, so callers keep the returned references.
+class Counter
+{
+public:
+	Counter() : m_value(0) {}
+
+	void inc(uint64_t n = 1)
+	{
+		m_value.fetch_add(n, std::memory_order_relaxed);
+	}
+	uint64_t value() const
+	{
+		return m_value.load(std::memory_order_relaxed);
+	}
+private:
+	std::atomic<uint64_t> m_value;
+};
+
+class Gauge
+{
+public:
+	Gauge() : m_bits(0) {}
+
+	void set(double value);
+	double value() const;
+private:
+	std::atomic<uint64_t> m_bits;
+};
+
+class Histogram
+{
+public:
+	explicit Histogram(const std::vector<double>& bounds);
+
+	void observe(double value);
+	uint64_t count() const
+	{
+		return m_count.load(std::memory_order_relaxed);
+	}
+	double sum() const;
+	// Estimated q-quantile, interpolated inside the matching bucket
+	double quantile(double q) const;
+
+	const std::vector<double>& bounds() const
+	{
+		return m_bounds;
+	}
+	uint64_t bucket(size_t i) const
+	{
+		return m_buckets[i].load(std::memory_order_relaxed);
+	}
+
+	// request latency buckets, in seconds
+	static const std::vector<double>& latencyBounds();
+private:
+	std::vector<double> m_bounds;
+	std::unique_ptr<std::atomic<uint64_t>[]> m_buckets;
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sumBits;
+};
+
+class Metrics
+{
+public:
+	static Metrics& instance();
+
+	Counter& counter(const std::string& name, const std::string& labels = std::string());
+	Gauge& gauge(const std::string& name, const std::string& labels = std::string());
+	Histogram& histogram(const std::string& name, const std::string& labels = std::string(),
+		const std::vector<double>& bounds = Histogram::latencyBounds());
+
+	// Prometheus text exposition format
+	void write(std::ostream& out) const;
+	void save(const std::string& path) const;
+
+	static std::string label(const std::string& name, const std::string& value);
+private:
+	template<class T>
+	using Family = std::map<std::string, std::unique_ptr<T>>;
+
+	void checkName(const std::string& name, const void* family) const;
+
+	mutable std::mutex m_mutex;
+	std::map<std::string, Family<Counter>> m_counters;
+	std::map<std::string, Family<Gauge>> m_gauges;
+	std::map<std::string, Family<Histogram>> m_histograms;
+};
+
+// Serves the current metrics over plain HTTP on a local port
+class MetricsServer
+{
+public:
+	explicit MetricsServer(unsigned short port);
+	~MetricsServer();
+private:
+	struct Impl;
+	std::unique_ptr<Impl> m_impl;
+	std::thread m_thread;
+};
@@ -0,0 +1,159 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "OrderExecutor.h"
+#include "Log.h"
+#include <algorithm>
+#include <exception>
+
+using namespace std;
+
+OrderExecutor::OrderExecutor(TradeApi& api, const TradeApi::OrderEvents& events):
+	m_api(api),
+	m_events(events),
+	m_clock(&Clock::system()),
+	m_pollInterval(chrono::seconds(30)),
+	m_placed(0),
+	m_unfilled(false),
+	m_filledTotal(Metrics::instance().counter("orders_filled_total")),
+	m_fillTime(Metrics::instance().histogram("order_fill_seconds", "",
+		{ 30, 60, 120, 300, 600, 1200, 1800, 3600, 7200 }))
+{
+}
+
+bool OrderExecutor::run(const std::vector<TradeApi::Order>& orders, std::chrono::milliseconds timeout)
+{
+	TimePoint until = m_clock->now() + timeout;
+	place(orders);
+	poll(until);
+	return cancel();
+}
+
+void OrderExecutor::place(const std::vector<TradeApi::Order>& orders)
+{
+	Log l("OrderExecutor::place");
+	for (const TradeApi::Order& o : orders)
+		place(o, m_placed);
+}
+
+void OrderExecutor::place(const TradeApi::Order& order, size_t index)
+{
+	Pending p;
+	p.index = index;
+	p.order = order;
+	p.id = 0;
+	p.filled = 0.0;
+	p.filledBefore = 0.0;
+	m_placed = std::max(m_placed, index + 1);
+	try
+	{
+		p.id = m_api.createOrder(order);
+	}
+	catch (const std::exception& e)
+	{
+		m_unfilled = true;
+		report(TradeApi::OrderEvent::FAILED, p, e.what());
+		return;
+	}
+	p.placed = m_clock->now();
+	m_pending.push_back(p);
+	report(TradeApi::OrderEvent::PLACED, p);
+}
+
+void OrderExecutor::adopt(const TradeApi::OpenOrder& open, size_t index)
+{
+	Pending p;
+	p.index = index;
+	p.order = open.order;
+	p.id = open.id;
+	p.filled = 0.0;
+	p.filledBefore = std::min(open.filled, 1.0);
+	p.placed = m_clock->now();
+	m_placed = std::max(m_placed, index + 1);
+	m_pending.push_back(p);
+	report(TradeApi::OrderEvent::PLACED, p);
+}
+
+void OrderExecutor::poll(TimePoint until)
+{
+	Log l("OrderExecutor::poll");
+	while (!m_pending.empty())
+	{
+		update();
+		TimePoint now = m_clock->now();
+		if (m_pending.empty() || now >= until)
+			break;
+		m_clock->sleep_for(std::min<Clock::Duration>(m_pollInterval, until - now));
+	}
+}
+
+void OrderExecutor::update()
+{
+	m_pending.remove_if([this](Pending& p) { return check(p); });
+}
+
+bool OrderExecutor::cancel()
+{
+	Log l("OrderExecutor::cancel");
+	for (const Pending& p : m_pending)
+	{
+		m_unfilled = true;
+		try
+		{
+			m_api.deleteOrder(p.id);
+		}
+		catch (const std::exception& e)
+		{
+			report(TradeApi::OrderEvent::FAILED, p, e.what());
+			continue;
+		}
+		report(TradeApi::OrderEvent::CANCELLED, p);
+	}
+	m_pending.clear();
+	return m_unfilled;
+}
+
+bool OrderExecutor::check(Pending& p)
+{
+	TradeApi::OrderStatus status;
+	try
+	{
+		status = m_api.orderStatus(p.id, p.order.market());
+	}
+	catch (const std::exception& e)
+	{
+		report(TradeApi::OrderEvent::FAILED, p, e.what());
+		return false;
+	}
+	if (!status.open)
+	{
+		p.filled = 1.0;
+		m_filledTotal.inc();
+		m_fillTime.observe(chrono::duration<double>(m_clock->now() - p.placed).count());
+		report(TradeApi::OrderEvent::FILLED, p);
+		return true;
+	}
+	// the order's amount is only what was left when it was adopted
+	double filled = (p.filledBefore < 1.0) ?
+		(status.filled - p.filledBefore) / (1.0 - p.filledBefore) : 0.0;
+	if (filled > p.filled)
+	{
+		p.filled = filled;
+		report(TradeApi::OrderEvent::PARTIALLY_FILLED, p);
+	}
+	return false;
+}
+
+void OrderExecutor::report(TradeApi::OrderEvent::Type type, const Pending& p,
+	const std::string& error)
+{
+	if (!m_events)
+		return;
+	TradeApi::OrderEvent e;
+	e.type = type;
+	e.index = p.index;
+	e.order = p.order;
+	e.id = p.id;
+	e.filled = p.filled;
+	e.error = error;
+	m_events(e);
+}
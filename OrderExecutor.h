@@ -0,0 +1,77 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <list>
+#include <vector>
+#include "TradeApi.h"
+#include "Metrics.h"
+
+// Places orders, polls them until they are filled or time is up and
+// cancels the rest, reporting every step as an OrderEvent. A failing
+// request is reported for its order and does not stop the others; an
+// order whose status could not be read is polled again next round.
+class OrderExecutor
+{
+public:
+	typedef Clock::TimePoint TimePoint;
+
+	OrderExecutor(TradeApi& api, const TradeApi::OrderEvents& events = TradeApi::OrderEvents());
+
+	void set_poll_interval(std::chrono::milliseconds interval)
+	{
+		m_pollInterval = interval;
+	}
+	void set_clock(Clock& clock)
+	{
+		m_clock = &clock;
+	}
+
+	// All three steps below; true when some orders were not filled
+	bool run(const std::vector<TradeApi::Order>& orders, std::chrono::milliseconds timeout);
+
+	void place(const std::vector<TradeApi::Order>& orders);
+	// index is reported in the order's events
+	void place(const TradeApi::Order& order, size_t index);
+	// takes over an order already open, reporting it as PLACED; fills
+	// are counted from the part executed before
+	void adopt(const TradeApi::OpenOrder& open, size_t index);
+	// returns early once nothing is open any more
+	void poll(TimePoint until);
+	// one round of status checks
+	void update();
+	bool done() const
+	{
+		return m_pending.empty();
+	}
+	// cancels the orders still open; true when some orders were not filled
+	bool cancel();
+private:
+	struct Pending
+	{
+		size_t index;
+		TradeApi::Order order;
+		long long id;
+		double filled;
+		// executed before the order was adopted
+		double filledBefore;
+		TimePoint placed;
+	};
+
+	// true when the order is done with
+	bool check(Pending& p);
+	void report(TradeApi::OrderEvent::Type type, const Pending& p,
+		const std::string& error = std::string());
+
+	TradeApi& m_api;
+	TradeApi::OrderEvents m_events;
+	Clock* m_clock;
+	std::chrono::milliseconds m_pollInterval;
+	std::list<Pending> m_pending;
+	size_t m_placed;
+	bool m_unfilled;
+
+	Counter& m_filledTotal;
+	Histogram& m_fillTime;
+};
@@ -0,0 +1,100 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "OrderState.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+OrderState::OrderState(const std::string& path):
+	m_path(path)
+{
+	ifstream f(m_path);
+	string line;
+	while (getline(f, line))
+	{
+		bool pending = line.compare(0, 8, "pending ") == 0;
+		istringstream is(pending ? line.substr(8) : line);
+		long long id;
+		if (is >> id)
+			(pending ? m_pending : m_ids).insert(id);
+	}
+}
+
+void OrderState::add(long long id)
+{
+	if (m_ids.insert(id).second)
+		save();
+}
+
+void OrderState::remove(long long id)
+{
+	if (m_ids.erase(id))
+		save();
+}
+
+void OrderState::retain(const std::vector<long long>& open)
+{
+	size_t size = m_ids.size();
+	for (auto it = m_ids.begin(); it != m_ids.end();)
+	{
+		if (std::find(open.begin(), open.end(), *it) == open.end())
+			it = m_ids.erase(it);
+		else
+			++it;
+	}
+	if (m_ids.size() != size)
+		save();
+}
+
+void OrderState::addPending(long long clientId)
+{
+	if (m_pending.insert(clientId).second)
+		save();
+}
+
+void OrderState::removePending(long long clientId)
+{
+	if (m_pending.erase(clientId))
+		save();
+}
+
+void OrderState::retainPending(const std::vector<long long>& keep)
+{
+	size_t size = m_pending.size();
+	for (auto it = m_pending.begin(); it != m_pending.end();)
+	{
+		if (std::find(keep.begin(), keep.end(), *it) == keep.end())
+			it = m_pending.erase(it);
+		else
+			++it;
+	}
+	if (m_pending.size() != size)
+		save();
+}
+
+void OrderState::save() const
+{
+	// write aside and rename, an interrupted run must not lose the file
+	string tmp = m_path + ".tmp";
+	{
+		ofstream f(tmp, ios_base::trunc);
+		if (!f.is_open())
+			throw runtime_error("Failed to open file " + tmp);
+		for (long long id : m_ids)
+			f << id << '\n';
+		for (long long id : m_pending)
+			f << "pending " << id << '\n';
+		if (!f)
+			throw runtime_error("Failed to write file " + tmp);
+	}
+	if (std::rename(tmp.c_str(), m_path.c_str()) != 0)
+	{
+		std::remove(m_path.c_str());
+		if (std::rename(tmp.c_str(), m_path.c_str()) != 0)
+			throw runtime_error("Failed to replace file " + m_path);
+	}
+}
@@ -0,0 +1,47 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+// Ids of the orders this tool placed, kept in a text file with one id per
+// line, so that a later run can tell them from orders placed by hand.
+// Orders sent without a reply yet are kept by client order id, on lines
+// "pending <id>", until they are found placed or known to be gone.
+class OrderState
+{
+public:
+	// a missing file is an empty state
+	explicit OrderState(const std::string& path);
+
+	bool contains(long long id) const
+	{
+		return m_ids.count(id) > 0;
+	}
+	void add(long long id);
+	void remove(long long id);
+	// forgets the ids not among the open orders, they are filled or gone
+	void retain(const std::vector<long long>& open);
+
+	bool pending(long long clientId) const
+	{
+		return m_pending.count(clientId) > 0;
+	}
+	void addPending(long long clientId);
+	void removePending(long long clientId);
+	// forgets the pending client ids not in keep
+	void retainPending(const std::vector<long long>& keep);
+
+	const std::string& path() const
+	{
+		return m_path;
+	}
+private:
+	void save() const;
+
+	std::string m_path;
+	std::set<long long> m_ids;
+	std::set<long long> m_pending;
+};
@@ -2,89 +2,283 @@
 // Distributed under the Apache 2.0 software license, see the LICENSE file
 #include "PoloniexTradeApi.h"
 #include "Log.h"
-#include <boost/beast/core.hpp>
-#include <boost/beast/http.hpp>
-#include <boost/beast/version.hpp>
-#include <boost/asio/connect.hpp>
-#include <boost/asio/ip/tcp.hpp>
-#include <boost/asio/ssl/stream.hpp>
-#include <boost/property_tree/ptree.hpp>
+#include "Reconciler.h"
+#include "InflateBuf.h"
+#include "MarketSnapshot.h"
+#include "MemoryProfile.h"
 #include <boost/property_tree/json_parser.hpp>
-#include <boost/format.hpp>
-#include <boost/lexical_cast.hpp>
 #include <chrono>
 #include <thread>
 #include <algorithm>
-#include <list>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
 
-using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
-namespace ssl = boost::asio::ssl;       // from <boost/asio/ssl.hpp>
-namespace http = boost::beast::http;    // from <boost/beast/http.hpp>
 using namespace boost::property_tree;
 using namespace std;
 
-PoloniexTradeApi::PoloniexTradeApi(const std::string& key, const std::string& secret):
-	m_key(key),
-	m_secret(secret), 
-	m_nonce(time(0))
+namespace
 {
-	Log l("PoloniexTradeApi::PoloniexTradeApi()");
-}
+	// lets the JSON parser read a reply in place instead of copying it
+	// into a string stream
+	struct ReplyBuf : std::streambuf
+	{
+		ReplyBuf(const std::string& reply)
+		{
+			char* p = const_cast<char*>(reply.data());
+			setg(p, p, p + reply.size());
+		}
+	};
 
-struct OrderChecker
-{
-	PoloniexTradeApi* m_api;
+	// coin may also name a direct market such as ETH_XMR
+	void addCurrencyPair(RequestParams& params, const std::string& coin)
+	{
+		if (coin.find('_') != std::string::npos)
+		{
+			params.add("currencyPair", coin);
+			return;
+		}
+		if (coin == "USDT")
+		{
+			params.add("currencyPair", "USDT_BTC");
+			return;
+		}
+		char pair[32];
+		snprintf(pair, sizeof(pair), "BTC_%s", coin.c_str());
+		params.add("currencyPair", pair);
+	}
 
-	OrderChecker(PoloniexTradeApi* api) : m_api(api) {}
+	// USDT is traded as USDT_BTC, where buying it means selling BTC
+	bool invertedMarket(const TradeApi::Order& order)
+	{
+		return order.coin == "USDT" && order.base.empty();
+	}
 
-    bool operator()(const pair<long long, std::string>& p)
+	// A price in BTC of a USDT keeps only about four digits, so the rate on
+	// USDT_BTC is the one the order carries, unless its price was changed
+	// since; then it is the inverse of the price.
+	Decimal invertedRate(const TradeApi::Order& order)
 	{
-		return !m_api->checkOrder(p.first, p.second);
+		if (order.rate.units() > 0 && std::abs(Decimal(1.0 / order.rate).units() - order.price.units()) <= 1)
+			return order.rate;
+		return 1.0 / order.price;
 	}
-};
+
+	void addRateAndAmount(RequestParams& params, const TradeApi::Order& order)
+	{
+		if (invertedMarket(order))
+		{
+			Decimal rate = invertedRate(order);
+			params.add("rate", rate);
+			params.add("amount", order.amount / rate);
+		}
+		else
+		{
+			params.add("rate", order.price);
+			params.add("amount", order.amount);
+		}
+	}
+
+	// commands that may safely be sent twice
+	bool isReadOnly(const char* command)
+	{
+		static const char* const commands[] = { "returnTicker", "returnBalances",
+			"returnCompleteBalances", "returnOpenOrders", "returnTradeHistory",
+			"returnOrderTrades" };
+		for (const char* c : commands)
+			if (!strcmp(c, command))
+				return true;
+		return false;
+	}
+
+	// prices and amounts come as JSON strings in the exchange's own
+	// eight-decimal notation and are read without a detour through double
+	Decimal number(const ptree& node, const char* name)
+	{
+		return Decimal::parse(node.get_child(name).data());
+	}
+
+	Decimal number(const ptree& node, const char* name, Decimal fallback)
+	{
+		boost::optional<const ptree&> child = node.get_child_optional(name);
+		return child ? Decimal::parse(child->data()) : fallback;
+	}
+
+	// zero for a market not quoted, as when its order book is empty
+	Decimal inverse(Decimal d)
+	{
+		return (d.units() > 0) ? Decimal(1.0 / d) : Decimal(0.0);
+	}
+
+	// a compressed reply is inflated piece by piece as the parser reads
+	void readReply(const std::string& reply, HttpsClient::Encoding encoding, ptree& pt)
+	{
+		if (encoding == HttpsClient::IDENTITY)
+		{
+			ReplyBuf buf(reply);
+			std::istream is(&buf);
+			read_json(is, pt);
+			return;
+		}
+		InflateBuf buf(reply.data(), reply.size());
+		std::istream is(&buf);
+		// corrupt data is reported as such, not as bad JSON
+		is.exceptions(std::ios_base::badbit);
+		read_json(is, pt);
+	}
+
+	ptree parse(const std::string& reply, HttpsClient::Encoding encoding)
+	{
+		ptree pt;
+		readReply(reply, encoding, pt);
+		return pt;
+	}
+}
+
+PoloniexTradeApi::PoloniexTradeApi(const std::string& key, const std::string& secret,
+	const std::string& host, const std::string& port):
+	m_key(key),
+	m_secret(secret), 
+	m_tickersTime(0),
+	m_balancesTime(0),
+	m_nonce(time(0)),
+	m_pool(std::make_shared<HttpsPool>(host, port)),
+	m_requestTimeout(chrono::seconds(30)),
+	m_deadline(HttpsClient::Deadline::max()),
+	m_host(host),
+	m_breaker(new CircuitBreaker(host)),
+	m_writes(0),
+	m_sharedTickersAge(0),
+	m_pipeline(nullptr),
+	m_orderRetries(2),
+	m_lastClientId(0)
+{
+	Log l("PoloniexTradeApi::PoloniexTradeApi()");
+}
 
 bool PoloniexTradeApi::execute(const std::vector<Order>& orders, unsigned timeout)
+{
+	return execute(orders, timeout, OrderEvents());
+}
+
+bool PoloniexTradeApi::execute(const std::vector<Order>& orders, unsigned timeout,
+	const OrderEvents& events)
 {
 	Log l("PoloniexTradeApi::execute");
-	chrono::steady_clock::time_point start = chrono::steady_clock::now();
-    list<pair<long long, std::string>> ids;
-	for (const Order& o : orders)
-		ids.push_back(make_pair(createOrder(o), o.coin));
-	OrderChecker check(this);
-	while (true)
-	{
-		if (ids.empty())
-			break;
-		ids.remove_if(check);
-		if (chrono::steady_clock::now() - start > chrono::minutes(timeout))
-			break;
-		std::this_thread::sleep_for(chrono::seconds(30));
-	}
-	bool res = !ids.empty();
-	for (auto p : ids)
-        deleteOrder(p.first);
+	std::vector<Order> placeable = orders;
+	if (m_tickersRefresh.valid())
+	{
+		// planned from the snapshot, placed at the prices of now
+		try
+		{
+			storeTickers(m_tickersRefresh.get());
+			reprice(placeable);
+		}
+		catch (const std::exception& e)
+		{
+			Log::write(std::string("tickers not refreshed: ") + e.what());
+		}
+	}
+	std::vector<size_t> origins;
+	std::map<size_t, std::string> removed;
+	size_t dropped = m_rules.prepare(placeable, origins, removed);
+	if (dropped)
+		Metrics::instance().counter("orders_rejected_total", Metrics::label("where", "local")).inc(dropped);
+	// events tell positions in orders, not in placeable
+	OrderEvents reported;
+	if (events)
+	{
+		for (const auto& r : removed)
+		{
+			OrderEvent e;
+			e.type = OrderEvent::FAILED;
+			e.index = r.first;
+			e.order = orders[r.first];
+			e.error = r.second;
+			events(e);
+		}
+		reported = [&events, &origins](const OrderEvent& e)
+		{
+			OrderEvent original = e;
+			original.index = origins[e.index];
+			events(original);
+		};
+	}
+	waitPrefetch();
+	ensureBalances();
+	auto btc = m_balances.find("BTC");
+	ExecutionPlanner planner(*this, reported);
+	planner.set_clock(clock());
+	ExecutionPlanner::TimePoint until = clock().now() + chrono::minutes(timeout);
+	// no request may outlive the run; cancelling what is left comes after it
+	m_deadline = chrono::steady_clock::now() + (until - clock().now());
+	try
+	{
+		Decimal available = (btc != m_balances.end()) ? btc->second : Decimal();
+		std::map<size_t, OpenOrder> placed;
+		if (m_orderState)
+		{
+			placed = Reconciler(*this).run(placeable);
+			// balances counted what open orders hold, new orders get the rest
+			std::map<std::string, Decimal> free = fetchBalances(false);
+			available = free["BTC"];
+		}
+		planner.start(placeable, available, placed);
+		planner.poll(until);
+	}
+	catch (...)
+	{
+		m_deadline = HttpsClient::Deadline::max();
+		throw;
+	}
+	m_deadline = HttpsClient::Deadline::max();
+	bool res = planner.cancel();
+	// balances have moved, only the tickers stay reusable for the next run
+	m_balances.clear();
+	m_balancesTime = 0;
+	m_market.reset();
+	saveSnapshot();
 	return res;
 }
 
-long long PoloniexTradeApi::createOrder(const Order& order)
+long long PoloniexTradeApi::createOrder(const Order& planned)
 {
 	Log l("PoloniexTradeApi::createOrder");
-	std::map<std::string, std::string> params;
-	params["command"] = (order.action == BUY) ? "buy" : "sell";
-	params["currencyPair"] = "BTC_" + order.coin;
-	params["rate"] = boost::lexical_cast<std::string>(order.price);
-	params["amount"] = boost::lexical_cast<std::string>(order.amount);
-    if(order.coin == "USDT")
-    {
-        params["command"] = (order.action == BUY) ? "sell" : "buy";
-        params["currencyPair"] = "USDT_BTC";
-        params["rate"] = boost::lexical_cast<std::string>(1.0 / order.price);
-        params["amount"] = boost::lexical_cast<std::string>(order.amount * order.price);
-    }
-    std::istringstream is(call(params));
+	Order order = planned;
+	std::string reason;
+	if (!m_rules.apply(order, reason))
+	{
+		Metrics::instance().counter("orders_rejected_total", Metrics::label("where", "local")).inc();
+		throw std::runtime_error(reason);
+	}
+	RequestParams params;
+	bool buy = (order.action == BUY) != invertedMarket(order);
+	params.add("command", buy ? "buy" : "sell");
+	addCurrencyPair(params, order.market());
+	addRateAndAmount(params, order);
+	long long clientId = nextClientId();
+	params.add("clientOrderId", clientId);
+	beginSubmission(clientId);
 	ptree pt;
-	read_json(is, pt);
+	long long found = 0;
+	try
+	{
+		found = submit(params, order, clientId, pt);
+	}
+	catch (...)
+	{
+		Metrics::instance().counter("orders_failed_total").inc();
+		endSubmission(clientId, true);
+		throw;
+	}
+	endSubmission(clientId, false);
+	if (found)
+	{
+		Metrics::instance().counter("orders_recovered_total").inc();
+		pt.clear();
+		pt.put("orderNumber", found);
+	}
 	std::string err = pt.get("error", "");
 	if (!m_log.empty())
 	{
@@ -93,7 +287,7 @@ long long PoloniexTradeApi::createOrder(const Order& order)
 		fout << "****" << std::ctime(&ttp) << "****" << endl;
 		fout << "Create order: " << endl;
 		fout << "Action: " << ((order.action == BUY) ? "buy" : "sell") << endl;
-		fout << "Currency: " << order.coin << endl;
+		fout << "Currency: " << order.market() << endl;
 		fout << "Rate: " << order.price << endl;
 		fout << "Amount: " << order.amount << endl;
 		fout << "Result: ";
@@ -104,35 +298,338 @@ long long PoloniexTradeApi::createOrder(const Order& order)
 	}
 	if (err.size())
 	{
+		Metrics::instance().counter("orders_failed_total").inc();
+		Metrics::instance().counter("orders_rejected_total", Metrics::label("where", "remote")).inc();
+		if (m_rules.learn(order.market(), err))
+			saveRules();
 		Log::write("throw");
 		throw std::runtime_error(err);
 	}
-	return pt.get<long long>("orderNumber");
+	Metrics::instance().counter("orders_created_total",
+		Metrics::label("side", (order.action == BUY) ? "buy" : "sell")).inc();
+	long long id = pt.get<long long>("orderNumber");
+	rememberOrder(id, 0);
+	return id;
+}
+
+// Sends the order until the exchange answers, up to m_orderRetries times
+// more after lost replies. Returns the id of an order that an attempt
+// placed although its reply was lost, or 0 with the reply in pt.
+long long PoloniexTradeApi::submit(const RequestParams& params, const Order& order,
+	long long clientId, ptree& pt)
+{
+	time_t sent = time(0);
+	for (unsigned attempt = 0; ; ++attempt)
+	{
+		try
+		{
+			call(params, pt);
+		}
+		catch (const boost::system::system_error& e)
+		{
+			Log::write(std::string("order reply lost: ") + e.what());
+			if (long long id = findOrder(order, clientId, sent))
+				return id;
+			if (attempt == m_orderRetries)
+				throw;
+			Metrics::instance().counter("orders_retried_total").inc();
+			continue;
+		}
+		// the exchange refuses a client id only while an order with it is
+		// open, as when an earlier attempt arrived after it was looked for;
+		// one filled at once by then lets the retry through
+		if (attempt > 0 && !pt.get("error", "").empty())
+		{
+			if (long long id = findOrder(order, clientId, sent))
+				return id;
+		}
+		else if (attempt > 0)
+			return undoDuplicate(order, clientId, sent, pt.get<long long>("orderNumber", 0));
+		return 0;
+	}
+}
+
+long long PoloniexTradeApi::findOrder(const Order& order, long long clientId, time_t since)
+{
+	Log l("PoloniexTradeApi::findOrder");
+	for (const OpenOrder& o : openOrders())
+		if (o.clientId == clientId)
+			return o.id;
+	// or filled at once
+	RequestParams params;
+	params.add("command", "returnTradeHistory");
+	addCurrencyPair(params, order.market());
+	params.add("start", static_cast<long long>(since - 60));
+	ptree pt;
+	call(params, pt);
+	for (const auto& trade : pt)
+		if (trade.second.get<long long>("clientOrderId", 0) == clientId)
+			return trade.second.get<long long>("orderNumber");
+	return 0;
+}
+
+long long PoloniexTradeApi::undoDuplicate(const Order& order, long long clientId, time_t since,
+	long long placed)
+{
+	Log l("PoloniexTradeApi::undoDuplicate");
+	long long twin = 0;
+	bool twinOpen = false, placedOpen = false;
+	for (const OpenOrder& o : openOrders())
+		if (o.clientId == clientId && o.id == placed)
+			placedOpen = true;
+		else if (o.clientId == clientId)
+		{
+			twin = o.id;
+			twinOpen = true;
+		}
+	if (!twin)
+	{
+		RequestParams params;
+		params.add("command", "returnTradeHistory");
+		addCurrencyPair(params, order.market());
+		params.add("start", static_cast<long long>(since - 60));
+		ptree pt;
+		call(params, pt);
+		for (const auto& trade : pt)
+			if (trade.second.get<long long>("clientOrderId", 0) == clientId &&
+				trade.second.get<long long>("orderNumber", 0) != placed)
+				twin = trade.second.get<long long>("orderNumber");
+	}
+	if (!twin)
+		return 0;
+	Metrics::instance().counter("orders_duplicated_total").inc();
+	try
+	{
+		// the open one goes, the filled one stands for the order
+		if (twinOpen)
+		{
+			deleteOrder(twin);
+			return 0;
+		}
+		if (placedOpen)
+		{
+			deleteOrder(placed);
+			return twin;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		Log::write(std::string("duplicate not cancelled: ") + e.what());
+	}
+	Log::write("duplicate order " + std::to_string(twin) + " of " + std::to_string(placed) + " left");
+	return 0;
+}
+
+long long PoloniexTradeApi::nextClientId()
+{
+	// microseconds since the epoch, unique among the orders of the account
+	std::lock_guard<std::mutex> lock(m_submitMutex);
+	long long now = chrono::duration_cast<chrono::microseconds>(
+		chrono::system_clock::now().time_since_epoch()).count();
+	m_lastClientId = std::max(now, m_lastClientId + 1);
+	return m_lastClientId;
+}
+
+void PoloniexTradeApi::beginSubmission(long long clientId)
+{
+	std::lock_guard<std::mutex> lock(m_submitMutex);
+	m_submitting.insert(clientId);
+	if (!m_orderState)
+		return;
+	try
+	{
+		m_orderState->addPending(clientId);
+	}
+	catch (const std::exception& e)
+	{
+		Log::write(std::string("order state not saved: ") + e.what());
+	}
+}
+
+void PoloniexTradeApi::endSubmission(long long clientId, bool pending)
+{
+	std::lock_guard<std::mutex> lock(m_submitMutex);
+	m_submitting.erase(clientId);
+	if (!m_orderState || pending)
+		return;
+	try
+	{
+		m_orderState->removePending(clientId);
+	}
+	catch (const std::exception& e)
+	{
+		Log::write(std::string("order state not saved: ") + e.what());
+	}
+}
+
+long long PoloniexTradeApi::moveOrder(long long id, const Order& order)
+{
+	char label[64];
+	snprintf(label, sizeof(label), "PoloniexTradeApi::moveOrder(%lld)", id);
+	Log l(label);
+	RequestParams params;
+	params.add("command", "moveOrder");
+	params.add("orderNumber", id);
+	addRateAndAmount(params, order);
+	ptree pt;
+	call(params, pt);
+	std::string err = pt.get("error", "");
+	if (!m_log.empty())
+	{
+		ofstream fout(m_log, ofstream::app);
+		time_t ttp = chrono::system_clock::to_time_t(chrono::system_clock::now());
+		fout << "****" << std::ctime(&ttp) << "****" << endl;
+		fout << "Move order " << id << endl;
+		fout << "Rate: " << order.price << endl;
+		fout << "Amount: " << order.amount << endl;
+		fout << "Result: ";
+		if (err.size())
+			fout << "error [" << err << "]" << endl;
+		else
+			fout << pt.get<long long>("orderNumber") << endl;
+	}
+	if (err.size())
+	{
+		Log::write("throw");
+		throw std::runtime_error(err);
+	}
+	long long moved = pt.get<long long>("orderNumber");
+	rememberOrder(moved, id);
+	return moved;
+}
+
+std::vector<TradeApi::OpenOrder> PoloniexTradeApi::openOrders()
+{
+	Log l("PoloniexTradeApi::openOrders()");
+	RequestParams params;
+	params.add("command", "returnOpenOrders");
+	params.add("currencyPair", "all");
+	ptree pt;
+	call(params, pt);
+	std::string err = pt.get("error", "");
+	if (err.size())
+	{
+		Log::write("throw");
+		throw std::runtime_error(err);
+	}
+	std::vector<OpenOrder> res;
+	std::vector<long long> ids;
+	std::vector<long long> clientIds;
+	for (const auto& pair : pt)
+	{
+		bool usdt = pair.first == "USDT_BTC";
+		size_t separator = pair.first.find('_');
+		std::string base = pair.first.substr(0, separator);
+		std::string coin = (separator != std::string::npos) ? pair.first.substr(separator + 1) : pair.first;
+		if (base == "BTC")
+			base.clear();
+		if (usdt)
+		{
+			coin = "USDT";
+			base.clear();
+		}
+		for (const auto& it : pair.second)
+		{
+			OpenOrder o;
+			o.id = it.second.get<long long>("orderNumber");
+			o.order.coin = coin;
+			o.order.base = base;
+			o.order.action = (it.second.get("type", "") == "buy") ? BUY : SELL;
+			o.order.price = number(it.second, "rate");
+			o.order.amount = number(it.second, "amount");
+			Decimal starting = number(it.second, "startingAmount", o.order.amount);
+			if (starting.units() > 0)
+				o.filled = 1.0 - static_cast<double>(o.order.amount.units()) / starting.units();
+			if (usdt && o.order.price.units() > 0)
+			{
+				o.order.action = (o.order.action == BUY) ? SELL : BUY;
+				o.order.amount = o.order.amount * o.order.price;
+				o.order.rate = o.order.price;
+				o.order.price = 1.0 / o.order.price;
+			}
+			o.clientId = it.second.get<long long>("clientOrderId", 0);
+			o.own = m_orderState && (m_orderState->contains(o.id) ||
+				(o.clientId && m_orderState->pending(o.clientId)));
+			ids.push_back(o.id);
+			if (o.clientId)
+				clientIds.push_back(o.clientId);
+			res.push_back(o);
+		}
+	}
+	if (m_orderState)
+	{
+		try
+		{
+			// orders sent by an earlier run without a reply turned up
+			for (const OpenOrder& o : res)
+				if (o.own && !m_orderState->contains(o.id))
+					m_orderState->add(o.id);
+			m_orderState->retain(ids);
+			// those not open are filled or never placed, unless still on the way
+			std::lock_guard<std::mutex> lock(m_submitMutex);
+			clientIds.insert(clientIds.end(), m_submitting.begin(), m_submitting.end());
+			m_orderState->retainPending(clientIds);
+		}
+		catch (const std::exception& e)
+		{
+			Log::write(std::string("order state not saved: ") + e.what());
+		}
+	}
+	return res;
+}
+
+void PoloniexTradeApi::rememberOrder(long long id, long long replaced)
+{
+	if (!m_orderState)
+		return;
+	// the order is on the exchange anyway, a lost id only means it is
+	// cancelled instead of kept next time
+	try
+	{
+		if (id)
+			m_orderState->add(id);
+		if (replaced)
+			m_orderState->remove(replaced);
+	}
+	catch (const std::exception& e)
+	{
+		Log::write(std::string("order state not saved: ") + e.what());
+	}
 }
 
 bool PoloniexTradeApi::checkOrder(long long id, const std::string& coin)
 {
-    Log l(boost::str(boost::format("PoloniexTradeApi::checkOrder(%d, %s)") %
-                            id % coin.c_str()));
-	std::map<std::string, std::string> params;
-	params["command"] = "returnOpenOrders";
-	params["currencyPair"] = "BTC_" + coin;
-    if(coin == "USDT")
-        params["currencyPair"] = "USDT_BTC";
-    std::istringstream is(call(params));
+	return orderStatus(id, coin).open;
+}
+
+TradeApi::OrderStatus PoloniexTradeApi::orderStatus(long long id, const std::string& coin)
+{
+	char label[96];
+	snprintf(label, sizeof(label), "PoloniexTradeApi::orderStatus(%lld, %s)", id, coin.c_str());
+	Log l(label);
+	RequestParams params;
+	params.add("command", "returnOpenOrders");
+	addCurrencyPair(params, coin);
 	ptree pt;
-	read_json(is, pt);
+	call(params, pt);
 	std::string err = pt.get("error", "");
 	if (err.size())
 	{
 		Log::write("throw");
 		throw std::runtime_error(err);
 	}
-	for (ptree::iterator it = pt.begin(); it != pt.end(); ++it)
+	OrderStatus status;
+	for (ptree::const_iterator it = pt.begin(); it != pt.end(); ++it)
 	{
-		ptree cpt = it->second;
-		if (id == cpt.get<long long>("orderNumber"))
-			return true;
+		if (id != it->second.get<long long>("orderNumber"))
+			continue;
+		// amount is what is left of startingAmount
+		Decimal starting = number(it->second, "startingAmount", Decimal());
+		Decimal left = number(it->second, "amount", starting);
+		status.open = true;
+		if (starting.units() > 0)
+			status.filled = 1.0 - static_cast<double>(left.units()) / starting.units();
+		return status;
 	}
 	if (!m_log.empty())
 	{
@@ -141,7 +638,8 @@ bool PoloniexTradeApi::checkOrder(long long id, const std::string& coin)
 		fout << "****" << std::ctime(&ttp) << "****" << endl;
 		fout << "Order " << id << " for " << coin << " is executed" << endl;
 	}
-    return false;
+	status.filled = 1.0;
+	return status;
 }
 
 void PoloniexTradeApi::cancelCurrentOrders()
@@ -155,12 +653,11 @@ void PoloniexTradeApi::cancelCurrentOrders()
 std::vector<long long> PoloniexTradeApi::getCurrentOrders()
 {
     Log l("PoloniexTradeApi::getCurrentOrders()");
-    std::map<std::string, std::string> params;
-    params["command"] = "returnOpenOrders";
-    params["currencyPair"] = "all";
-    std::istringstream is(call(params));
+    RequestParams params;
+    params.add("command", "returnOpenOrders");
+    params.add("currencyPair", "all");
     ptree pt;
-    read_json(is, pt);
+    call(params, pt);
     std::string err = pt.get("error", "");
     if (err.size())
     {
@@ -168,30 +665,24 @@ std::vector<long long> PoloniexTradeApi::getCurrentOrders()
         throw std::runtime_error(err);
     }
     std::vector<long long> res;
-    for (auto it: pt)
+    for (const auto& it: pt)
     {
-        ptree coinpt = it.second;
-        for(auto oit: coinpt)
-        {
-            ptree entry = oit.second;
-            res.push_back(entry.get<long long>("orderNumber"));
-        }
+        for(const auto& oit: it.second)
+            res.push_back(oit.second.get<long long>("orderNumber"));
     }
     return res;
 }
 
 std::vector<long long> PoloniexTradeApi::getCurrentOrders(const string &coin)
 {
-    Log l(boost::str(boost::format("PoloniexTradeApi::getCurrentOrders(%s)") %
-                            coin.c_str()));
-    std::map<std::string, std::string> params;
-    params["command"] = "returnOpenOrders";
-    params["currencyPair"] = "BTC_" + coin;
-    if(coin == "USDT")
-        params["currencyPair"] = "USDT_BTC";
-    std::istringstream is(call(params));
+	char label[96];
+	snprintf(label, sizeof(label), "PoloniexTradeApi::getCurrentOrders(%s)", coin.c_str());
+	Log l(label);
+    RequestParams params;
+    params.add("command", "returnOpenOrders");
+    addCurrencyPair(params, coin);
     ptree pt;
-    read_json(is, pt);
+    call(params, pt);
     std::string err = pt.get("error", "");
     if (err.size())
     {
@@ -199,23 +690,21 @@ std::vector<long long> PoloniexTradeApi::getCurrentOrders(const string &coin)
         throw std::runtime_error(err);
     }
     std::vector<long long> res;
-    for (ptree::iterator it = pt.begin(); it != pt.end(); ++it)
-    {
-        ptree cpt = it->second;
-        res.push_back(cpt.get<long long>("orderNumber"));
-    }
+    for (ptree::const_iterator it = pt.begin(); it != pt.end(); ++it)
+        res.push_back(it->second.get<long long>("orderNumber"));
     return res;
 }
 
 void PoloniexTradeApi::deleteOrder(long long id)
 {
-    Log l(boost::str(boost::format("PoloniexTradeApi::deleteOrder(%d)") % id));
-	std::map<std::string, std::string> params;
-	params["command"] = "cancelOrder";
-	params["orderNumber"] = boost::lexical_cast<std::string>(id);
-    std::istringstream is(call(params));
+	char label[64];
+	snprintf(label, sizeof(label), "PoloniexTradeApi::deleteOrder(%lld)", id);
+	Log l(label);
+	RequestParams params;
+	params.add("command", "cancelOrder");
+	params.add("orderNumber", id);
 	ptree pt;
-	read_json(is, pt);
+	call(params, pt);
 	std::string err = pt.get("error", "");
 	if (!m_log.empty())
 	{
@@ -231,13 +720,16 @@ void PoloniexTradeApi::deleteOrder(long long id)
 		Log::write("throw");
 		throw std::runtime_error(err);
 	}
+	Metrics::instance().counter("orders_cancelled_total").inc();
+	rememberOrder(0, id);
 }
 
-double PoloniexTradeApi::balance(const std::string& coin)
+Decimal PoloniexTradeApi::balance(const std::string& coin)
 {
-    Log l(boost::str(boost::format("PoloniexTradeApi::balance(%s)") % coin.c_str()));
-	if (m_balances.empty())
-		readBalances();
+	char label[64];
+	snprintf(label, sizeof(label), "PoloniexTradeApi::balance(%s)", coin.c_str());
+	Log l(label);
+	ensureBalances();
 	auto it = m_balances.find(coin);
 	if (it == m_balances.end())
 	{
@@ -249,9 +741,10 @@ double PoloniexTradeApi::balance(const std::string& coin)
 
 TradeApi::CoinInfo PoloniexTradeApi::info(const std::string& coin)
 {
-    Log l(boost::str(boost::format("PoloniexTradeApi::info(%s)") % coin.c_str()));
-	if (m_tickers.empty())
-		readTickers();
+	char label[64];
+	snprintf(label, sizeof(label), "PoloniexTradeApi::info(%s)", coin.c_str());
+	Log l(label);
+	ensureTickers();
 	auto it = m_tickers.find(coin);
 	if (it == m_tickers.end())
 	{
@@ -261,157 +754,250 @@ TradeApi::CoinInfo PoloniexTradeApi::info(const std::string& coin)
 	return it->second;
 }
 
-static void
-load_root_certificates(ssl::context& ctx)
-{
-	std::string const cert =
-		/*  This is the DigiCert root certificate.
-
-		CN = DigiCert High Assurance EV Root CA
-		OU = www.digicert.com
-		O = DigiCert Inc
-		C = US
-
-		Valid to: Sunday, ?November ?9, ?2031 5:00:00 PM
-
-		Thumbprint(sha1):
-		5f b7 ee 06 33 e2 59 db ad 0c 4c 9a e6 d3 8f 1a 61 c7 dc 25
-		*/
-		"-----BEGIN CERTIFICATE-----\n"
-		"MIIDxTCCAq2gAwIBAgIQAqxcJmoLQJuPC3nyrkYldzANBgkqhkiG9w0BAQUFADBs\n"
-		"MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
-		"d3cuZGlnaWNlcnQuY29tMSswKQYDVQQDEyJEaWdpQ2VydCBIaWdoIEFzc3VyYW5j\n"
-		"ZSBFViBSb290IENBMB4XDTA2MTExMDAwMDAwMFoXDTMxMTExMDAwMDAwMFowbDEL\n"
-		"MAkGA1UEBhMCVVMxFTATBgNVBAoTDERpZ2lDZXJ0IEluYzEZMBcGA1UECxMQd3d3\n"
-		"LmRpZ2ljZXJ0LmNvbTErMCkGA1UEAxMiRGlnaUNlcnQgSGlnaCBBc3N1cmFuY2Ug\n"
-		"RVYgUm9vdCBDQTCCASIwDQYJKoZIhvcNAQEBBQADggEPADCCAQoCggEBAMbM5XPm\n"
-		"+9S75S0tMqbf5YE/yc0lSbZxKsPVlDRnogocsF9ppkCxxLeyj9CYpKlBWTrT3JTW\n"
-		"PNt0OKRKzE0lgvdKpVMSOO7zSW1xkX5jtqumX8OkhPhPYlG++MXs2ziS4wblCJEM\n"
-		"xChBVfvLWokVfnHoNb9Ncgk9vjo4UFt3MRuNs8ckRZqnrG0AFFoEt7oT61EKmEFB\n"
-		"Ik5lYYeBQVCmeVyJ3hlKV9Uu5l0cUyx+mM0aBhakaHPQNAQTXKFx01p8VdteZOE3\n"
-		"hzBWBOURtCmAEvF5OYiiAhF8J2a3iLd48soKqDirCmTCv2ZdlYTBoSUeh10aUAsg\n"
-		"EsxBu24LUTi4S8sCAwEAAaNjMGEwDgYDVR0PAQH/BAQDAgGGMA8GA1UdEwEB/wQF\n"
-		"MAMBAf8wHQYDVR0OBBYEFLE+w2kD+L9HAdSYJhoIAu9jZCvDMB8GA1UdIwQYMBaA\n"
-		"FLE+w2kD+L9HAdSYJhoIAu9jZCvDMA0GCSqGSIb3DQEBBQUAA4IBAQAcGgaX3Nec\n"
-		"nzyIZgYIVyHbIUf4KmeqvxgydkAQV8GK83rZEWWONfqe/EW1ntlMMUu4kehDLI6z\n"
-		"eM7b41N5cdblIZQB2lWHmiRk9opmzN6cN82oNLFpmyPInngiK3BD41VHMWEZ71jF\n"
-		"hS9OMPagMRYjyOfiZRYzy78aG6A9+MpeizGLYAiJLQwGXFK3xPkKmNEVX58Svnw2\n"
-		"Yzi9RKR/5CYrCsSXaQ3pjOLAEFe4yHYSkVXySGnYvCoCWw9E1CAx2/S6cCZdkGCe\n"
-		"vEsXCS+0yx5DaMkHJ8HSXPfqIbloEpw8nL+e/IBcm2PN7EeqJSdnoDfzAIJ9VNep\n"
-		"+OkuE6N36B9K\n"
-		"-----END CERTIFICATE-----\n"
-		/*  This is the GeoTrust root certificate.
-
-		CN = GeoTrust Global CA
-		O = GeoTrust Inc.
-		C = US
-		Valid to: Friday, ‎May ‎20, ‎2022 9:00:00 PM
-
-		Thumbprint(sha1):
-		‎de 28 f4 a4 ff e5 b9 2f a3 c5 03 d1 a3 49 a7 f9 96 2a 82 12
-		*/
-		"-----BEGIN CERTIFICATE-----\n"
-		"MIIDxTCCAq2gAwIBAgIQAqxcJmoLQJuPC3nyrkYldzANBgkqhkiG9w0BAQUFADBs\n"
-		"MQswCQYDVQQGEwJVUzEVMBMGA1UEChMMRGlnaUNlcnQgSW5jMRkwFwYDVQQLExB3\n"
-		"d3cuZGlnaWNlcnQuY29tMSswKQYDVQQDEyJEaWdpQ2VydCBIaWdoIEFzc3VyYW5j\n"
-		"ZSBFViBSb290IENBMB4XDTA2MTExMDAwMDAwMFoXDTMxMTExMDAwMDAwMFowbDEL\n"
-		"MAkGA1UEBhMCVVMxFTATBgNVBAoTDERpZ2lDZXJ0IEluYzEZMBcGA1UECxMQd3d3\n"
-		"LmRpZ2ljZXJ0LmNvbTErMCkGA1UEAxMiRGlnaUNlcnQgSGlnaCBBc3N1cmFuY2Ug\n"
-		"RVYgUm9vdCBDQTCCASIwDQYJKoZIhvcNAQEBBQADggEPADCCAQoCggEBAMbM5XPm\n"
-		"+9S75S0tMqbf5YE/yc0lSbZxKsPVlDRnogocsF9ppkCxxLeyj9CYpKlBWTrT3JTW\n"
-		"PNt0OKRKzE0lgvdKpVMSOO7zSW1xkX5jtqumX8OkhPhPYlG++MXs2ziS4wblCJEM\n"
-		"xChBVfvLWokVfnHoNb9Ncgk9vjo4UFt3MRuNs8ckRZqnrG0AFFoEt7oT61EKmEFB\n"
-		"Ik5lYYeBQVCmeVyJ3hlKV9Uu5l0cUyx+mM0aBhakaHPQNAQTXKFx01p8VdteZOE3\n"
-		"hzBWBOURtCmAEvF5OYiiAhF8J2a3iLd48soKqDirCmTCv2ZdlYTBoSUeh10aUAsg\n"
-		"EsxBu24LUTi4S8sCAwEAAaNjMGEwDgYDVR0PAQH/BAQDAgGGMA8GA1UdEwEB/wQF\n"
-		"MAMBAf8wHQYDVR0OBBYEFLE+w2kD+L9HAdSYJhoIAu9jZCvDMB8GA1UdIwQYMBaA\n"
-		"FLE+w2kD+L9HAdSYJhoIAu9jZCvDMA0GCSqGSIb3DQEBBQUAA4IBAQAcGgaX3Nec\n"
-		"nzyIZgYIVyHbIUf4KmeqvxgydkAQV8GK83rZEWWONfqe/EW1ntlMMUu4kehDLI6z\n"
-		"eM7b41N5cdblIZQB2lWHmiRk9opmzN6cN82oNLFpmyPInngiK3BD41VHMWEZ71jF\n"
-		"hS9OMPagMRYjyOfiZRYzy78aG6A9+MpeizGLYAiJLQwGXFK3xPkKmNEVX58Svnw2\n"
-		"Yzi9RKR/5CYrCsSXaQ3pjOLAEFe4yHYSkVXySGnYvCoCWw9E1CAx2/S6cCZdkGCe\n"
-		"vEsXCS+0yx5DaMkHJ8HSXPfqIbloEpw8nL+e/IBcm2PN7EeqJSdnoDfzAIJ9VNep\n"
-		"+OkuE6N36B9K\n"
-		"-----END CERTIFICATE-----\n"
-		;
-
-	boost::system::error_code ec;
-	ctx.add_certificate_authority(
-		boost::asio::buffer(cert.data(), cert.size()), ec);
-	if (ec)
-		throw boost::system::system_error{ ec };
+void PoloniexTradeApi::set_snapshot(const std::string& path, unsigned maxAge)
+{
+	Log l("PoloniexTradeApi::set_snapshot");
+	m_snapshot.reset(new SnapshotCache(path, m_key));
+	SnapshotCache::Snapshot s;
+	if (!m_snapshot->load(s))
+		return;
+	time_t now = time(0);
+	if (now - s.tickersTime <= static_cast<time_t>(maxAge))
+	{
+		m_tickers.swap(s.tickers);
+		m_tickersTime = s.tickersTime;
+		m_market.reset();
+	}
+	if (now - s.balancesTime <= static_cast<time_t>(maxAge))
+	{
+		m_balances.swap(s.balances);
+		m_balancesTime = s.balancesTime;
+		m_market.reset();
+	}
 }
 
-void PoloniexTradeApi::readTickers()
+void PoloniexTradeApi::set_shared_tickers(const std::string& name, unsigned maxAge)
 {
-	Log l("PoloniexTradeApi::readTickers()");
-
-	// connection params
-	std::string host("poloniex.com");
-	std::string port("443");
-	std::string target("/public?command=returnTicker"); ///?????
-
-	// The io_service is required for all I/O
-	boost::asio::io_service ios;
+	Log l("PoloniexTradeApi::set_shared_tickers");
+	m_sharedTickers.reset(new SharedTickerCache(name));
+	m_sharedTickersAge = maxAge;
+}
 
-	// The SSL context is required, and holds certificates
-	ssl::context ctx{ ssl::context::sslv23_client };
+void PoloniexTradeApi::set_order_state(const std::string& path)
+{
+	m_orderState.reset(new OrderState(path));
+}
 
-	// This holds the root certificate used for verification
-	load_root_certificates(ctx);
+void PoloniexTradeApi::set_ticker_history(const std::string& path)
+{
+	m_tickerHistory.reset(new TickerRecorder(path));
+}
 
-	// These objects perform our I/O
-	tcp::resolver resolver{ ios };
-	ssl::stream<tcp::socket> stream{ ios, ctx };
+void PoloniexTradeApi::set_rules(const std::string& path, unsigned maxAge)
+{
+	m_rulesPath = path;
+	m_rules.load(path, maxAge);
+}
 
-	// Look up the domain name
-	auto const lookup = resolver.resolve({ host, port });
+void PoloniexTradeApi::saveRules()
+{
+	if (m_rulesPath.empty())
+		return;
+	try
+	{
+		m_rules.save(m_rulesPath);
+	}
+	catch (const std::exception& e)
+	{
+		// the rules are learned again next time
+		Log::write(e.what());
+	}
+}
 
-	// Make the connection on the IP address we get from a lookup
-	boost::asio::connect(stream.next_layer(), lookup);
+void PoloniexTradeApi::prefetch(bool cancelOrders, bool refresh)
+{
+	Log l("PoloniexTradeApi::prefetch");
+	if (m_tickers.empty())
+		m_tickersFetch = std::async(std::launch::async, [this]()
+		{
+			return loadTickers();
+		});
+	else if (refresh)
+		m_tickersRefresh = std::async(std::launch::async, [this]()
+		{
+			return loadTickers();
+		});
+	if (!cancelOrders && !m_balances.empty())
+		return;
+	// cancelled orders release their funds, older balances are void
+	m_balances.clear();
+	m_balancesTime = 0;
+	m_market.reset();
+	m_balancesFetch = std::async(std::launch::async, [this, cancelOrders]()
+	{
+		if (cancelOrders)
+			cancelCurrentOrders();
+		return fetchBalances(m_orderState != nullptr);
+	});
+}
 
-	// Perform the SSL handshake
-	stream.handshake(ssl::stream_base::client);
+void PoloniexTradeApi::waitPrefetch()
+{
+	if (m_tickersFetch.valid())
+		ensureTickers();
+	if (m_balancesFetch.valid())
+		ensureBalances();
+}
 
-	// Set up an HTTP GET request message
-	http::request<http::string_body> req{ http::verb::get, target, 11 };
-	req.set(http::field::host, host);
-	req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+void PoloniexTradeApi::ensureTickers()
+{
+	if (m_tickersFetch.valid())
+		storeTickers(m_tickersFetch.get());
+	else if (m_tickers.empty())
+		readTickers();
+}
 
-	// Send the HTTP request to the remote host
-	http::write(stream, req);
+void PoloniexTradeApi::ensureBalances()
+{
+	if (m_balancesFetch.valid())
+	{
+		m_balances = m_balancesFetch.get();
+		m_balancesTime = time(0);
+		m_market.reset();
+		if (m_pipeline)
+			m_pipeline->publish(m_balances);
+		saveSnapshot();
+	}
+	else if (m_balances.empty())
+		readBalances();
+}
 
-	// This buffer is used for reading and must be persisted
-	boost::beast::flat_buffer buffer;
+void PoloniexTradeApi::saveSnapshot()
+{
+	if (!m_snapshot)
+		return;
+	SnapshotCache::Snapshot s;
+	s.tickers = m_tickers;
+	s.tickersTime = m_tickersTime;
+	s.balances = m_balances;
+	s.balancesTime = m_balancesTime;
+	try
+	{
+		m_snapshot->save(s);
+	}
+	catch (const std::exception& e)
+	{
+		Log::write(std::string("snapshot not saved: ") + e.what());
+	}
+}
 
-	// Declare a container to hold the response
-    http::response<http::string_body> res;
+void PoloniexTradeApi::readTickers()
+{
+	Log l("PoloniexTradeApi::readTickers()");
+	storeTickers(loadTickers());
+}
 
-	// Receive the HTTP response
-	http::read(stream, buffer, res);
+void PoloniexTradeApi::storeTickers(std::map<std::string, CoinInfo> tickers)
+{
+	m_tickers.swap(tickers);
+	m_tickersTime = time(0);
+	m_market.reset();
+	if (m_pipeline)
+		m_pipeline->publish(m_tickers);
+	saveSnapshot();
+}
 
-	// Write the message to string stream to read in parser
-	std::stringstream is; 
-    is << res.body();
+void PoloniexTradeApi::reprice(std::vector<Order>& orders) const
+{
+	for (Order& o : orders)
+	{
+		auto it = m_tickers.find(o.market());
+		if (it == m_tickers.end() || o.price.units() <= 0)
+			continue;
+		const CoinInfo& ci = it->second;
+		Decimal middle = (ci.buyPrice + ci.sellPrice) / 2;
+		if (middle.units() <= 0)
+			continue;
+		o.amount = o.amount * o.price / middle;
+		o.price = middle;
+		o.rate = ci.rate;
+	}
+}
 
-	// Gracefully close the stream
-	boost::system::error_code ec;
-	stream.shutdown(ec);
-/*	if (ec == boost::asio::error::eof)
+std::map<std::string, TradeApi::CoinInfo> PoloniexTradeApi::loadTickers()
+{
+	MemoryPhase phase("ticker load");
+	std::map<std::string, CoinInfo> tickers;
+	if (m_sharedTickers && m_sharedTickers->read(tickers, m_sharedTickersAge))
+		return tickers;
+	tickers = fetchTickers();
+	if (m_tickerHistory)
 	{
-		// Rationale:
-		// http://stackoverflow.com/questions/25587403/boost-asio-ssl-async-shutdown-always-finishes-with-an-error
-		ec.assign(0, ec.category());
+		try
+		{
+			m_tickerHistory->append(time(0), tickers);
+		}
+		catch (const std::exception& e)
+		{
+			Log::write(std::string("tickers not recorded: ") + e.what());
+		}
 	}
-	if (ec)
-		throw boost::system::system_error{ ec };
-*/
-	// If we get here then the connection is closed gracefully
+	if (m_sharedTickers && !m_sharedTickers->publish(tickers))
+		Log::write("shared tickers busy, not published");
+	return tickers;
+}
 
-	// parse responce
-	ptree pt;
-	read_json(is, pt);
-	for (ptree::iterator it = pt.begin(); it != pt.end(); ++it)
+std::map<std::string, TradeApi::CoinInfo> PoloniexTradeApi::fetchTickers()
+{
+	Log l("PoloniexTradeApi::fetchTickers()");
+	std::map<std::string, CoinInfo> tickers;
+	bool rulesChanged = false;
+
+	// public requests carry no nonce, so they need not wait for m_callMutex;
+	// objects share a download only over the same transport and settings,
+	// so that a replay never gets a live reply or the other way round
+	static SingleFlight<ptree> tickerFlights;
+	char flight[96];
+	snprintf(flight, sizeof(flight), "returnTicker@%p/%lld/%d/%g", static_cast<const void*>(m_pool.get()),
+		static_cast<long long>(m_requestTimeout.count()), m_hedging.enabled ? 1 : 0, m_hedging.quantile);
+	RequestMetrics& m = requestMetrics("returnTicker");
+	bool joined = false;
+	std::shared_ptr<const ptree> shared = tickerFlights.run(flight, [&]()
+	{
+		ptree pt;
+		HttpsClient::Deadline deadline = requestDeadline();
+		measured(m, [&]()
+		{
+			if (m_hedging.enabled)
+			{
+				std::shared_ptr<Transport> pool = m_pool;
+				bool hedgeSent = false, hedgeWon = false;
+				pt = hedged<ptree>(m_hedgeWorkers, [&pool, deadline]()
+				{
+					return std::function<ptree()>([pool, deadline]()
+					{
+						Transport::Lease client = pool->acquire();
+						const std::string& reply = client->get("/public?command=returnTicker", deadline);
+						return parse(reply, client->encoding());
+					});
+				}, m_hedging.delay(*m.latency), hedgeSent, hedgeWon);
+				if (hedgeSent)
+					m.hedges->inc();
+				if (hedgeWon)
+					m.hedgeWins->inc();
+			}
+			else
+			{
+				Transport::Lease client = m_pool->acquire();
+				const std::string& reply = client->get("/public?command=returnTicker", deadline);
+				readReply(reply, client->encoding(), pt);
+			}
+		});
+		return pt;
+	}, joined);
+	countCoalesced(m, joined);
+	const ptree& pt = *shared;
+	for (ptree::const_iterator it = pt.begin(); it != pt.end(); ++it)
 	{
 		std::string name = it->first;
 		if (name.length() < 4)
@@ -419,37 +1005,62 @@ void PoloniexTradeApi::readTickers()
         if (name == "USDT_BTC")
         {
             name = "USDT";
-            ptree child = it->second;
+            const ptree& child = it->second;
             CoinInfo t;
             t.coin = name;
-            t.lastPrice = 1.0 / child.get<double>("last");
-            t.buyPrice = 1.0 / child.get<double>("highestBid");
-            t.sellPrice = 1.0 / child.get<double>("lowestAsk");
-            m_tickers[name] = t;
+            Decimal bid = number(child, "highestBid");
+            Decimal ask = number(child, "lowestAsk");
+            t.lastPrice = inverse(number(child, "last"));
+            t.buyPrice = inverse(bid);
+            t.sellPrice = inverse(ask);
+            if (bid.units() > 0 && ask.units() > 0)
+                t.rate = Decimal::fromUnits((bid.units() + ask.units()) / 2);
+            t.volume = number(child, "quoteVolume", 0.0);
+            tickers[name] = t;
             continue;
         }
-        if (name.substr(0, 4) != "BTC_")
-			continue;
-		name.erase(0, 4);
-		ptree child = it->second;
+		const ptree& child = it->second;
 		CoinInfo t;
-		t.coin = name;
-		t.lastPrice = child.get<double>("last");
-		t.buyPrice = child.get<double>("highestBid");
-		t.sellPrice = child.get<double>("lowestAsk");
-		m_tickers[name] = t;
+		// direct markets such as ETH_XMR keep their name, coin is the traded one
+		if (name.substr(0, 4) == "BTC_")
+			name.erase(0, 4);
+		if (name.find('_') == std::string::npos)
+			t.coin = name;
+		else
+			t.coin = name.substr(name.find('_') + 1);
+		t.lastPrice = number(child, "last");
+		t.buyPrice = number(child, "highestBid");
+		t.sellPrice = number(child, "lowestAsk");
+		t.volume = number(child, "baseVolume", 0.0);
+		tickers[name] = t;
+		if (m_rules.set_frozen(name, child.get("isFrozen", "0") == "1"))
+			rulesChanged = true;
 	}
+	if (rulesChanged)
+		saveRules();
+	return tickers;
 }
 
 void PoloniexTradeApi::readBalances()
 {
-	Log l("PoloniexTradeApi::readTickers()");
-	m_balances.clear();
-	std::map<std::string, std::string> params;
-	params["command"] = "returnBalances";
-	std::istringstream is(call(params));
+	Log l("PoloniexTradeApi::readBalances()");
+	m_balances = fetchBalances(m_orderState != nullptr);
+	m_balancesTime = time(0);
+	m_market.reset();
+	if (m_pipeline)
+		m_pipeline->publish(m_balances);
+	saveSnapshot();
+}
+
+std::map<std::string, Decimal> PoloniexTradeApi::fetchBalances(bool withOrders)
+{
+	Log l("PoloniexTradeApi::fetchBalances()");
+	MemoryPhase phase("balance load");
+	std::map<std::string, Decimal> balances;
+	RequestParams params;
+	params.add("command", withOrders ? "returnCompleteBalances" : "returnBalances");
 	ptree pt;
-	read_json(is, pt);
+	call(params, pt);
 	std::string err = pt.get("error", "");
 	if (err.size())
 	{
@@ -458,156 +1069,205 @@ void PoloniexTradeApi::readBalances()
 	}
 	for (ptree::iterator it = pt.begin(); it != pt.end(); ++it)
 	{
-        double balance = boost::lexical_cast<double>(it->second.data());
-        if(balance > 0.0001)
-            m_balances[it->first] = balance;
+        Decimal balance = withOrders ? Decimal::fromUnits(number(it->second, "available").units() +
+            number(it->second, "onOrders").units()) : Decimal::parse(it->second.data());
+        if(balance.units() > 10000)
+            balances[it->first] = balance;
 	}
+	return balances;
 }
 
-std::string PoloniexTradeApi::call(const std::map<std::string, std::string>& params)
+void PoloniexTradeApi::call(const RequestParams& params, ptree& pt)
 {
 	Log l("PoloniexTradeApi::call");
-    // connection params
-    std::string host("poloniex.com");
-    std::string port("443");
-    std::string target("/tradingApi");
-
-    std::string postData = postBody(params);
-	std::string sign = signBody(postData);
-
-    // The io_service is required for all I/O
-    boost::asio::io_service ios;
-
-    // The SSL context is required, and holds certificates
-    ssl::context ctx{ ssl::context::sslv23_client };
-
-    // This holds the root certificate used for verification
-    load_root_certificates(ctx);
-
-    // These objects perform our I/O
-    tcp::resolver resolver{ ios };
-    ssl::stream<tcp::socket> stream{ ios, ctx };
-
-    // Look up the domain name
-    auto const lookup = resolver.resolve({ host, port });
-
-    // Make the connection on the IP address we get from a lookup
-    boost::asio::connect(stream.next_layer(), lookup);
-
-    // Perform the SSL handshake
-    stream.handshake(ssl::stream_base::client);
-
-    // Set up an HTTP POST request message
-    http::request<http::string_body> req;
-    req.method(http::verb::post);
-    req.target(target);
-    req.set(http::field::host, host);
-    req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-    req.set(http::field::content_type,
-            "application/x-www-form-urlencoded");
-    req.set("Key", m_key);
-    req.set("Sign", sign);
-    req.body() = postData;
-    req.prepare_payload();
+	RequestMetrics& m = requestMetrics(params.get("command"));
+	if (!isReadOnly(m.command.c_str()))
+	{
+		++m_writes;
+		send(params, m, pt);
+		return;
+	}
+	// the count of writes takes the place of the nonce, so that a read
+	// never waits for one sent before a write that came back already
+	std::string key;
+	params.write(key, m_writes.load());
+	bool joined = false;
+	pt = *m_reads.run(key, [&]()
+	{
+		ptree res;
+		send(params, m, res);
+		return res;
+	}, joined);
+	countCoalesced(m, joined);
+}
 
-    // Send the HTTP request to the remote host
-    http::write(stream, req);
+void PoloniexTradeApi::send(const RequestParams& params, RequestMetrics& m, ptree& pt)
+{
+	// nonces must reach the exchange in increasing order
+	std::lock_guard<std::mutex> lock(m_callMutex);
+	measured(m, [&]()
+	{
+		if (m_hedging.enabled && isReadOnly(m.command.c_str()))
+			callHedged(params, m, pt);
+		else
+		{
+			params.write(m_body, m_nonce++);
+			Log::write(m_body);
+			char sign[129];
+			signRequest(m_secret, m_body, sign);
+			Transport::Lease client = m_pool->acquire();
+			// an order or cancel sent twice is a duplicate or a nonce error
+			// at best; a lost one is for the caller to look for
+			const std::string& reply = client->post("/tradingApi", m_body,
+				{ { "Key", m_key.c_str() }, { "Sign", sign } }, requestDeadline(),
+				isReadOnly(m.command.c_str()));
+			readReply(reply, client->encoding(), pt);
+		}
+	});
+}
 
-    // This buffer is used for reading and must be persisted
-    boost::beast::flat_buffer buffer;
+void PoloniexTradeApi::callHedged(const RequestParams& params, RequestMetrics& m, ptree& pt)
+{
+	// every attempt carries its own nonce; should the slower one reach the
+	// exchange last it is rejected, which no longer matters. An error reply
+	// fails its attempt, so that a nonce error cannot beat the answer of
+	// the other one; it is the result only when both attempts fail.
+	struct ErrorReply
+	{
+		ptree pt;
+	};
+	std::shared_ptr<Transport> pool = m_pool;
+	std::string key = m_key;
+	HttpsClient::Deadline deadline = requestDeadline();
+	auto makeAttempt = [&]()
+	{
+		std::string body;
+		params.write(body, m_nonce++);
+		Log::write(body);
+		char sign[129];
+		signRequest(m_secret, body, sign);
+		std::string signature(sign);
+		return std::function<ptree()>([pool, key, body, signature, deadline]()
+		{
+			Transport::Lease client = pool->acquire();
+			const std::string& reply = client->post("/tradingApi", body,
+				{ { "Key", key.c_str() }, { "Sign", signature.c_str() } }, deadline, true);
+			ptree res = parse(reply, client->encoding());
+			if (res.count("error"))
+				throw ErrorReply{ res };
+			return res;
+		});
+	};
+	bool hedgeSent = false, hedgeWon = false;
+	try
+	{
+		pt = hedged<ptree>(m_hedgeWorkers, makeAttempt, m_hedging.delay(*m.latency), hedgeSent, hedgeWon);
+	}
+	catch (const ErrorReply& e)
+	{
+		pt = e.pt;
+	}
+	if (hedgeSent)
+		m.hedges->inc();
+	if (hedgeWon)
+		m.hedgeWins->inc();
+}
 
-    // Declare a container to hold the response
-    http::response<http::string_body> res;
+void PoloniexTradeApi::countCoalesced(RequestMetrics& m, bool joined)
+{
+	if (joined)
+		m.coalesced->inc();
+	double coalesced = m.coalesced->value();
+	m.coalescing->set(coalesced / (coalesced + m.requests->value()));
+}
 
-    // Receive the HTTP response
-    http::read(stream, buffer, res);
+// Runs one request through the circuit breaker and records its outcome
+template<class Send>
+void PoloniexTradeApi::measured(RequestMetrics& m, Send send)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	try
+	{
+		m_breaker->call([&]()
+		{
+			send();
+			return true;
+		});
+	}
+	catch (...)
+	{
+		m.errors->inc();
+		throw;
+	}
+	m.requests->inc();
+	m.latency->observe(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+}
 
-    // Write the message to output stream
-    std::string reply(res.body());
+HttpsClient::Deadline PoloniexTradeApi::requestDeadline() const
+{
+	HttpsClient::Deadline deadline = chrono::steady_clock::now() + m_requestTimeout;
+	return std::min(deadline, m_deadline);
+}
 
-    // Gracefully close the stream
-    boost::system::error_code ec;
-    stream.shutdown(ec);
-/*    if (ec == boost::asio::error::eof)
-    {
-        // Rationale:
-        // http://stackoverflow.com/questions/25587403/boost-asio-ssl-async-shutdown-always-finishes-with-an-error
-        ec.assign(0, ec.category());
-    }
-    else if (ec)
-        throw boost::system::system_error{ ec };*/
-    // If we get here then the connection is closed gracefully
-    return reply;
+void PoloniexTradeApi::set_circuit_breaker(unsigned threshold, std::chrono::milliseconds cooldown)
+{
+	m_breaker.reset(new CircuitBreaker(m_host, threshold, cooldown));
+	m_breaker->set_clock(clock());
 }
 
-std::string PoloniexTradeApi::postBody(const std::map<std::string, std::string>& params)
+void PoloniexTradeApi::set_clock(Clock& clock)
 {
-	Log l("PoloniexTradeApi::postBody");
-	std::string res = (boost::format("nonce=%d") % m_nonce++).str();
-	for (auto param : params)
-		res += "&" + param.first + "=" + param.second;
-    Log::write(boost::str(boost::format("Result: %s") % res.c_str()));
-	return res;
+	TradeApi::set_clock(clock);
+	m_breaker->set_clock(clock);
 }
 
-std::string PoloniexTradeApi::signBody(const std::string& body)
+PoloniexTradeApi::RequestMetrics& PoloniexTradeApi::requestMetrics(const char* command)
 {
-	Log l("PoloniexTradeApi::signBody");
-    Log::write(boost::str(boost::format("Body: %s") % body.c_str()));
-	unsigned char* digest = HMAC(EVP_sha512(),
-		m_secret.c_str(), m_secret.length(),
-		(unsigned char*)body.c_str(), body.length(), NULL, NULL);
-	char mdString[129];
-	for (int i = 0; i < 64; i++)
-		sprintf(&mdString[i * 2], "%02x", (unsigned int)digest[i]);
-	mdString[128] = 0;
-    Log::write(boost::str(boost::format("Sign: %s") % mdString));
-	return mdString;
+	std::lock_guard<std::mutex> lock(m_metricsMutex);
+	for (RequestMetrics& m : m_requestMetrics)
+		if (m.command == command)
+			return m;
+	std::string label = Metrics::label("command", command);
+	RequestMetrics m;
+	m.command = command;
+	m.requests = &Metrics::instance().counter("poloniex_requests_total", label);
+	m.errors = &Metrics::instance().counter("poloniex_request_errors_total", label);
+	m.latency = &Metrics::instance().histogram("poloniex_request_duration_seconds", label);
+	m.hedges = &Metrics::instance().counter("poloniex_hedged_requests_total", label);
+	m.hedgeWins = &Metrics::instance().counter("poloniex_hedge_wins_total", label);
+	m.coalesced = &Metrics::instance().counter("poloniex_coalesced_requests_total", label);
+	m.coalescing = &Metrics::instance().gauge("poloniex_coalescing_ratio", label);
+	m_requestMetrics.push_back(m);
+	return m_requestMetrics.back();
 }
 
 map<std::string, double> PoloniexTradeApi::nonZeroBalancesInBTC()
 {
-	Log l("PoloniexTradeApi::nonZeroBalancesInBTC()");
-	if (m_balances.empty())
-		readBalances();
-	if (m_tickers.empty())
-		readTickers();
-	map<std::string, double> balances;
-	for (auto b : m_balances)
-	{
-		if (b.second == 0.0)
-			continue;
-		if (b.first == "BTC")
-		{
+	return snapshot()->balancesInBTC();
+}
+
+std::map<std::string, Decimal> PoloniexTradeApi::nonZeroBalances()
+{
+	std::shared_ptr<const MarketSnapshot> market = snapshot();
+	map<std::string, Decimal> balances;
+	for (const auto& b : market->balances)
+		if (b.second.units() != 0)
 			balances[b.first] = b.second;
-            Log::write(boost::str(boost::format("%s:%f") % b.first.c_str() % b.second));
-		}
-		else
-		{
-			TradeApi::CoinInfo ci = m_tickers[b.first];
-			double amount = b.second * (ci.buyPrice + ci.sellPrice) / 2;
-			balances[b.first] = amount;
-            Log::write(boost::str(boost::format("%s:%f") % b.first.c_str() % amount));
-		}
-	}
 	return balances;
 }
 
-std::map<std::string, double> PoloniexTradeApi::nonZeroBalances()
+std::shared_ptr<const MarketSnapshot> PoloniexTradeApi::snapshot()
 {
-	Log l("PoloniexTradeApi::nonZeroBalances()");
-	if (m_balances.empty())
-		readBalances();
-	if (m_tickers.empty())
-		readTickers();
-	map<std::string, double> balances;
-	for (auto b : m_balances)
+	ensureBalances();
+	ensureTickers();
+	if (!m_market)
 	{
-		if (b.second == 0.0)
-			continue;
-		balances[b.first] = b.second;
-        Log::write(boost::str(boost::format("%s:%f") % b.first.c_str() % b.second));
+		Log l("PoloniexTradeApi::snapshot()");
+		std::shared_ptr<MarketSnapshot> s = std::make_shared<MarketSnapshot>();
+		s->tickers = m_tickers;
+		s->balances = m_balances;
+		m_market = s;
 	}
-	return balances;
+	return m_market;
 }
 
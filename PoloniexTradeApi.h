@@ -2,25 +2,54 @@
 // Distributed under the Apache 2.0 software license, see the LICENSE file
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <future>
+#include <mutex>
+#include <ctime>
+#include <deque>
+#include <set>
+#include <boost/property_tree/ptree.hpp>
 #include "TradeApi.h"
+#include "SnapshotCache.h"
+#include "SharedTickerCache.h"
+#include "OrderState.h"
+#include "TickerHistory.h"
+#include "MarketRules.h"
+#include "MarketPipeline.h"
+#include "HttpsClient.h"
+#include "RequestBuilder.h"
+#include "Metrics.h"
+#include "Hedging.h"
+#include "CircuitBreaker.h"
+#include "SingleFlight.h"
+#include "ExecutionPlanner.h"
 
 class PoloniexTradeApi : public TradeApi
 {
 public:
-	PoloniexTradeApi(const std::string& key, const std::string& secret);
+	PoloniexTradeApi(const std::string& key, const std::string& secret,
+		const std::string& host = "poloniex.com", const std::string& port = "443");
 
-	virtual double balance(const std::string& coin);
+	virtual Decimal balance(const std::string& coin);
 	virtual CoinInfo info(const std::string& coin);
-	virtual std::map<std::string, double> nonZeroBalances();
+	virtual std::map<std::string, Decimal> nonZeroBalances();
 	virtual std::map<std::string, double> nonZeroBalancesInBTC();
+	// built once per change of tickers or balances
+	virtual std::shared_ptr<const MarketSnapshot> snapshot();
 
 	virtual bool execute(const std::vector<Order>& orders, unsigned timeout);
 	virtual long long createOrder(const Order& order);
     virtual void deleteOrder(long long id);
 	virtual bool checkOrder(long long id, const std::string& coin);
+	virtual bool execute(const std::vector<Order>& orders, unsigned timeout,
+		const OrderEvents& events);
+	virtual OrderStatus orderStatus(long long id, const std::string& coin);
+	virtual std::vector<OpenOrder> openOrders();
+	virtual long long moveOrder(long long id, const Order& order);
     virtual void cancelCurrentOrders();
 
     std::vector<long long> getCurrentOrders();
@@ -29,19 +58,187 @@ public:
 	void set_log(const std::string& logfile) {
 		m_log = logfile;
 	}
+
+	// Loads tickers and balances not older than maxAge seconds from the
+	// snapshot file and keeps it updated with every fresh download.
+	void set_snapshot(const std::string& path, unsigned maxAge);
+	// Starts the startup downloads at once: the public ticker next to the
+	// private chain of cancelling open orders (if asked) and reading
+	// balances, which must stay in nonce order. Data still fresh from the
+	// snapshot is not downloaded again, except balances once orders are
+	// cancelled. Each read waits only for the download it needs. With
+	// refresh, tickers taken from the snapshot are downloaded again in the
+	// background: reads keep the snapshot's, execute() takes the new ones
+	// and re-prices its orders from them.
+	void prefetch(bool cancelOrders, bool refresh = false);
+	// Takes tickers not older than maxAge seconds from the named shared
+	// memory segment instead of the network, and publishes every fresh
+	// download there for the other instances on this host.
+	void set_shared_tickers(const std::string& name, unsigned maxAge);
+	// Remembers the orders placed in the given file. execute() then keeps
+	// or moves the own orders still open that fit the new plan and cancels
+	// the rest, so prefetch() must not cancel them; balances include the
+	// funds the open orders hold.
+	void set_order_state(const std::string& path);
+	// Publishes every ticker and balance download to pipeline, from the
+	// thread calling this object; nullptr stops it
+	void set_pipeline(MarketPipeline* pipeline)
+	{
+		m_pipeline = pipeline;
+	}
+	// Appends every ticker download to the given history file
+	void set_ticker_history(const std::string& path);
+	// Keeps the market rules learned in the given file, dropping them
+	// after maxAge seconds to learn them anew
+	void set_rules(const std::string& path, unsigned maxAge);
+	const MarketRules& rules() const
+	{
+		return m_rules;
+	}
+
+	// Read-only requests are sent a second time on another connection
+	// when they are slower than the policy allows; orders never are.
+	// Identical reads made at the same time, by any thread, share one
+	// request and its parsed reply; the ticker is shared between all
+	// objects of the process talking to the same host.
+	void set_hedging(const HedgePolicy& policy)
+	{
+		m_hedging = policy;
+	}
+
+	// Every order carries a client order id. When its reply is lost the
+	// order is looked up by that id among the open orders and the trade
+	// history, and sent again up to retries times when it is not found;
+	// with an order state the id is kept until the order is found placed.
+	// 2 unless set.
+	void set_order_retries(unsigned retries)
+	{
+		m_orderRetries = retries;
+	}
+
+	// Every request, from DNS lookup to the last byte of the reply, must
+	// finish within timeout; within execute() also before its own timeout.
+	void set_timeout(std::chrono::milliseconds timeout)
+	{
+		m_requestTimeout = timeout;
+	}
+	// Asks for compressed replies, on by default
+	void set_compression(bool compression)
+	{
+		m_pool->set_compression(compression);
+	}
+	// Sends every request through transport instead of HTTPS, such as a
+	// RecordingTransport around transport() or a ReplayTransport
+	void set_transport(std::shared_ptr<Transport> transport)
+	{
+		m_pool = transport;
+	}
+	std::shared_ptr<Transport> transport() const
+	{
+		return m_pool;
+	}
+	// the breaker's cooldown and execute() follow clock
+	virtual void set_clock(Clock& clock);
+	// Requests fail fast after threshold transport failures in a row,
+	// until a probe succeeds once cooldown has passed.
+	void set_circuit_breaker(unsigned threshold, std::chrono::milliseconds cooldown);
 private:
 	void readTickers();
 	void readBalances();
+	void ensureTickers();
+	void ensureBalances();
+	void waitPrefetch();
+	void saveSnapshot();
+	void storeTickers(std::map<std::string, CoinInfo> tickers);
+	// the middle of the spread, keeping the value of every order
+	void reprice(std::vector<Order>& orders) const;
+	std::map<std::string, CoinInfo> loadTickers();
+	std::map<std::string, CoinInfo> fetchTickers();
+	// withOrders adds the funds held by open orders
+	std::map<std::string, Decimal> fetchBalances(bool withOrders);
+	void rememberOrder(long long id, long long replaced);
+	long long nextClientId();
+	long long submit(const RequestParams& params, const Order& order, long long clientId,
+		boost::property_tree::ptree& pt);
+	// the id of the order placed with clientId since the given time, 0 when none is found
+	long long findOrder(const Order& order, long long clientId, time_t since);
+	// Looks for a second order with clientId once a retry placed one; when
+	// there is, cancels the one still open and returns the id of the other
+	// if it is not placed, 0 otherwise. Both filled are only reported.
+	long long undoDuplicate(const Order& order, long long clientId, time_t since, long long placed);
+	// with the order state, pending keeps clientId there for a later run to find
+	void beginSubmission(long long clientId);
+	void endSubmission(long long clientId, bool pending);
+	void saveRules();
+
+	struct RequestMetrics
+	{
+		std::string command;
+		Counter* requests;
+		Counter* errors;
+		Histogram* latency;
+		Counter* hedges;
+		Counter* hedgeWins;
+		// callers served by the request of another, and their part of all
+		Counter* coalesced;
+		Gauge* coalescing;
+	};
 
-	std::string call(const std::map<std::string, std::string>& params);
-	std::string postBody(const std::map<std::string, std::string>& params);
-	std::string signBody(const std::string& body);
+	// building, signing and sending reuse their buffers; the reply tree,
+	// the log and the key of a merged read are allocated every call
+	void call(const RequestParams& params, boost::property_tree::ptree& pt);
+	void send(const RequestParams& params, RequestMetrics& m, boost::property_tree::ptree& pt);
+	void countCoalesced(RequestMetrics& m, bool joined);
+	void callHedged(const RequestParams& params, RequestMetrics& m,
+		boost::property_tree::ptree& pt);
+	RequestMetrics& requestMetrics(const char* command);
+	template<class Send>
+	void measured(RequestMetrics& m, Send send);
+	HttpsClient::Deadline requestDeadline() const;
 
 	std::string m_key;
 	std::string m_secret;
 	std::map<std::string, CoinInfo> m_tickers;
-	std::map<std::string, double> m_balances;
+	std::map<std::string, Decimal> m_balances;
+	std::shared_ptr<const MarketSnapshot> m_market;
+	time_t m_tickersTime;
+	time_t m_balancesTime;
 	unsigned  m_nonce;
+	std::mutex m_callMutex;
+	std::mutex m_metricsMutex;
+	std::string m_body;
+	std::shared_ptr<Transport> m_pool;
+	HedgePolicy m_hedging;
+	std::chrono::milliseconds m_requestTimeout;
+	HttpsClient::Deadline m_deadline;
+	std::string m_host;
+	std::unique_ptr<CircuitBreaker> m_breaker;
+	std::deque<RequestMetrics> m_requestMetrics;
+	SingleFlight<boost::property_tree::ptree> m_reads;
+	// state-changing commands sent so far; reads are only merged with
+	// reads sent after the same one
+	std::atomic<unsigned> m_writes;
+
+	std::unique_ptr<SnapshotCache> m_snapshot;
+	std::unique_ptr<SharedTickerCache> m_sharedTickers;
+	unsigned m_sharedTickersAge;
+	std::unique_ptr<OrderState> m_orderState;
+	std::unique_ptr<TickerRecorder> m_tickerHistory;
+	MarketRules m_rules;
+	MarketPipeline* m_pipeline;
+	std::string m_rulesPath;
+	unsigned m_orderRetries;
+	std::mutex m_submitMutex;
+	long long m_lastClientId;
+	// client ids of the orders being sent now
+	std::set<long long> m_submitting;
+	// after the members attempts use and before the downloads that hedge,
+	// so that it waits for the slower attempts in between
+	HedgeWorkers m_hedgeWorkers;
+	std::future<std::map<std::string, CoinInfo>> m_tickersFetch;
+	// newer tickers than the snapshot's, for execute()
+	std::future<std::map<std::string, CoinInfo>> m_tickersRefresh;
+	std::future<std::map<std::string, Decimal>> m_balancesFetch;
 
 	std::string m_log;
 };
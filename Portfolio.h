@@ -2,25 +2,272 @@
 // Distributed under the Apache 2.0 software license, see the LICENSE file
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include "TradeApi.h"
 
+struct MarketSnapshot;
+
 class Portfolio
 {
 public:
+	Portfolio();
+
 	void addCoin(const std::string& coinSymbol, double part);
+	// Value moved from one coin to another goes in one order on their
+	// direct market, such as ETH_XMR, when its spread is within maxSpread
+	// of the price; zero routes everything through BTC.
+	void set_max_pair_spread(double maxSpread)
+	{
+		m_maxPairSpread = maxSpread;
+	}
 
-	std::vector<TradeApi::Order> checkCurrentState(TradeApi& trade, 
+	std::vector<TradeApi::Order> checkCurrentState(TradeApi& trade,
 		double threshold);
+	// the same from market data at hand, such as a MarketPipeline passes
+	std::vector<TradeApi::Order> checkCurrentState(const MarketSnapshot& market,
+		double threshold);
+	// All orders needed to reach the target parts in one run, buys
+	// included that only the proceeds of the sells can pay for; meant for
+	// TradeApi::execute(), which places such buys once sells have filled.
+	std::vector<TradeApi::Order> plan(TradeApi& trade, double threshold);
+
+	// The evaluation behind the calls above, over any market type that has
+	//   template<class F> void forEachValue(F f) const;
+	//     calling f(coin, value in BTC) for every coin held, by name
+	//   const TradeApi::CoinInfo& info(const std::string& coin) const;
+	//   const TradeApi::CoinInfo* pair(const std::string& base, const std::string& coin) const;
+	// as MarketSnapshot does. A simulation passes its own type so that the
+	// calls inline; once orders and the buffers kept here have grown,
+	// evaluating allocates nothing. Nothing is printed or measured.
+	template<class Market>
+	void evaluate(const Market& market, double threshold, bool fundFromSells,
+		std::vector<TradeApi::Order>& orders);
 
 	bool completed() const
 	{
 		return m_completed;
 	}
 protected:
+	struct Position
+	{
+		std::string coin;
+		double part;
+		// value held, in BTC
+		double current;
+		double diff;
+		// BTC value to move into (positive) or out of the coin
+		double transfer;
+		double planned;
+		bool rebalance;
+	};
+
+	std::vector<TradeApi::Order> makeOrders(const MarketSnapshot& market, double threshold,
+		bool fundFromSells);
+	std::shared_ptr<const MarketSnapshot> market(TradeApi& trade) const;
+	// Nets the BTC values to move out of coins against those to move into
+	// others on direct markets, taking what the orders move off transfers
+	template<class Market>
+	void routeDirect(const Market& market, std::vector<TradeApi::Order>& orders);
+	template<class Market>
+	bool directOrder(const Market& market, const std::string& from,
+		const std::string& to, TradeApi::Order& order) const;
+
 	std::map<std::string, double> m_parts;
 	bool m_completed;
+	double m_maxPairSpread;
+	// by coin, reused from one evaluation to the next
+	std::vector<Position> m_positions;
+	std::vector<size_t> m_buys;
+	std::vector<size_t> m_sells;
 };
 
+template<class Market>
+void Portfolio::evaluate(const Market& market, double threshold, bool fundFromSells,
+	std::vector<TradeApi::Order>& orders)
+{
+	m_completed = true;
+	orders.clear();
+	// the target coins and every coin held, by name
+	m_positions.resize(m_parts.size());
+	size_t n = 0;
+	for (const auto& p : m_parts)
+	{
+		Position& pos = m_positions[n++];
+		pos.coin = p.first;
+		pos.part = p.second;
+		pos.current = 0.0;
+	}
+	double maxBuy = 0.0;
+	market.forEachValue([this, &maxBuy](const std::string& coin, double value)
+	{
+		auto it = std::lower_bound(m_positions.begin(), m_positions.end(), coin,
+			[](const Position& pos, const std::string& c) { return pos.coin < c; });
+		if (it == m_positions.end() || it->coin != coin)
+		{
+			it = m_positions.insert(it, Position());
+			it->coin = coin;
+			it->part = 0.0;
+		}
+		it->current = value;
+		if (coin == "BTC")
+			maxBuy = value;
+	});
+	double sum = 0.0;
+	double current_sum = 0.0;
+	for (const Position& pos : m_positions)
+	{
+		sum += pos.part;
+		current_sum += pos.current;
+	}
+    double btcDiff = 0.0;
+    double maxPart = 0.0;
+    const Position* maxCoin = nullptr;
+	for (Position& pos : m_positions)
+	{
+		pos.diff = (pos.current / current_sum) / (pos.part / sum) - 1.0;
+		pos.rebalance = false;
+        if (pos.coin == "BTC")
+        {
+            btcDiff = pos.diff;
+            continue;
+        }
+        if(std::abs(pos.diff) > std::abs(maxPart))
+        {
+            maxPart = pos.diff;
+            maxCoin = &pos;
+        }
+        if (std::abs(pos.diff) < threshold)
+			continue;
+		pos.rebalance = true;
+		pos.transfer = pos.planned = current_sum * (pos.part / sum) - pos.current;
+	}
+	routeDirect(market, orders);
+	for (const Position& pos : m_positions)
+	{
+		if (!pos.rebalance)
+			continue;
+		// what direct orders left of a transfer is not worth one more order
+		double target = current_sum * (pos.part / sum);
+		if (pos.transfer != pos.planned && std::abs(pos.transfer) <= threshold * target)
+			continue;
+		const TradeApi::CoinInfo& ci = market.info(pos.coin);
+		TradeApi::Order o;
+		o.coin = pos.coin;
+		o.action = (pos.transfer < 0) ? TradeApi::SELL : TradeApi::BUY;
+		o.price = (ci.buyPrice + ci.sellPrice) / 2;
+		//o.price = (o.action == TradeApi::SELL) ? ci.buyPrice : ci.sellPrice;
+		// a market with no quotes cannot be traded on
+		if (o.price.units() <= 0)
+		{
+			m_completed = false;
+			continue;
+		}
+		o.rate = ci.rate;
+		o.amount = std::abs(pos.transfer) / o.price;
+		if (o.action == TradeApi::BUY && !fundFromSells)
+		{
+			double order_sum = o.price * o.amount;
+			if (order_sum > maxBuy)
+			{
+				m_completed = false;
+				continue;
+			}
+			maxBuy -= order_sum;
+		}
+		orders.push_back(o);
+	}
+    if(orders.empty() && std::abs(btcDiff) > threshold)
+    {
+        if (!maxCoin)
+            throw std::runtime_error("Invalid coin ");
+        const TradeApi::CoinInfo& ci = market.info(maxCoin->coin);
+        TradeApi::Order o;
+        o.coin = maxCoin->coin;
+        o.action = (maxPart > 0) ? TradeApi::SELL : TradeApi::BUY;
+        o.price = (ci.buyPrice + ci.sellPrice) / 2;
+        //o.price = (o.action == TradeApi::SELL) ? ci.buyPrice : ci.sellPrice;
+        if (o.price.units() <= 0)
+        {
+            m_completed = false;
+            return;
+        }
+        o.rate = ci.rate;
+        o.amount = std::abs(current_sum * (maxCoin->part / sum) - maxCoin->current) / o.price;
+
+        orders.push_back(o);
+    }
+}
+
+template<class Market>
+void Portfolio::routeDirect(const Market& market, std::vector<TradeApi::Order>& orders)
+{
+	if (m_maxPairSpread <= 0.0)
+		return;
+	m_buys.clear();
+	m_sells.clear();
+	for (size_t i = 0; i < m_positions.size(); ++i)
+	{
+		if (!m_positions[i].rebalance)
+			continue;
+		if (m_positions[i].transfer > 0)
+			m_buys.push_back(i);
+		else if (m_positions[i].transfer < 0)
+			m_sells.push_back(i);
+	}
+	// the largest transfers first, so that they take the fewest orders
+	auto larger = [this](size_t a, size_t b)
+	{
+		double va = std::abs(m_positions[a].transfer), vb = std::abs(m_positions[b].transfer);
+		return va > vb || (va == vb && a > b);
+	};
+	std::sort(m_buys.begin(), m_buys.end(), larger);
+	std::sort(m_sells.begin(), m_sells.end(), larger);
+	TradeApi::Order o;
+	for (size_t b : m_buys)
+	{
+		Position& buy = m_positions[b];
+		for (size_t s : m_sells)
+		{
+			Position& sell = m_positions[s];
+			if (buy.transfer <= 0.0)
+				break;
+			if (-sell.transfer <= 0.0 || !directOrder(market, sell.coin, buy.coin, o))
+				continue;
+			double value = std::min(buy.transfer, -sell.transfer);
+			const TradeApi::CoinInfo& ci = market.info(o.coin);
+			o.amount = value / ((ci.buyPrice + ci.sellPrice) / 2);
+			buy.transfer -= value;
+			sell.transfer += value;
+			orders.push_back(o);
+		}
+	}
+}
+
+template<class Market>
+bool Portfolio::directOrder(const Market& market, const std::string& from,
+	const std::string& to, TradeApi::Order& order) const
+{
+	if (from == "BTC" || to == "BTC")
+		return false;
+	// from pays for to on the from_to market, or is sold on the to_from one
+	const TradeApi::CoinInfo* ci = market.pair(from, to);
+	bool buy = ci != nullptr;
+	if (!buy)
+		ci = market.pair(to, from);
+	if (!ci || ci->buyPrice.units() <= 0 || ci->sellPrice.units() <= 0)
+		return false;
+	double middle = (ci->buyPrice + ci->sellPrice) / 2;
+	if ((ci->sellPrice - ci->buyPrice) / middle > m_maxPairSpread)
+		return false;
+	order.action = buy ? TradeApi::BUY : TradeApi::SELL;
+	order.coin = buy ? to : from;
+	order.base = buy ? from : to;
+	order.price = middle;
+	return true;
+}
@@ -0,0 +1,92 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "Reconciler.h"
+#include "Log.h"
+#include "Metrics.h"
+#include <cmath>
+#include <exception>
+
+using namespace std;
+
+Reconciler::Reconciler(TradeApi& api):
+	m_api(api),
+	m_priceBand(0.005),
+	m_amountTolerance(0.05)
+{
+}
+
+std::map<size_t, TradeApi::OpenOrder> Reconciler::run(const std::vector<TradeApi::Order>& orders)
+{
+	Log l("Reconciler::run");
+	Metrics& metrics = Metrics::instance();
+	vector<TradeApi::OpenOrder> open = m_api.openOrders();
+	vector<bool> taken(open.size(), false);
+	map<size_t, TradeApi::OpenOrder> placed;
+	for (size_t i = 0; i < orders.size(); ++i)
+	{
+		const TradeApi::Order& planned = orders[i];
+		// the own order of the same market and side nearest in price
+		size_t best = open.size();
+		for (size_t j = 0; j < open.size(); ++j)
+		{
+			const TradeApi::Order& o = open[j].order;
+			if (taken[j] || !open[j].own || o.market() != planned.market() || o.action != planned.action)
+				continue;
+			if (best == open.size() || fabs(o.price - planned.price) <
+				fabs(open[best].order.price - planned.price))
+				best = j;
+		}
+		if (best == open.size())
+			continue;
+		taken[best] = true;
+		TradeApi::OpenOrder o = open[best];
+		if (fits(o.order, planned))
+		{
+			placed[i] = o;
+			metrics.counter("orders_reconciled_total", Metrics::label("action", "keep")).inc();
+			continue;
+		}
+		try
+		{
+			o.id = m_api.moveOrder(o.id, planned);
+		}
+		catch (const std::exception& e)
+		{
+			// the planner places it anew once funds allow
+			Log::write(string("move failed: ") + e.what());
+			cancel(o.id);
+			continue;
+		}
+		o.order = planned;
+		o.filled = 0.0;
+		placed[i] = o;
+		metrics.counter("orders_reconciled_total", Metrics::label("action", "move")).inc();
+	}
+	for (size_t j = 0; j < open.size(); ++j)
+	{
+		if (taken[j])
+			continue;
+		cancel(open[j].id);
+		metrics.counter("orders_reconciled_total", Metrics::label("action", "cancel")).inc();
+	}
+	return placed;
+}
+
+bool Reconciler::fits(const TradeApi::Order& open, const TradeApi::Order& planned) const
+{
+	return fabs(open.price - planned.price) <= m_priceBand * planned.price &&
+		fabs(open.amount - planned.amount) <= m_amountTolerance * planned.amount;
+}
+
+void Reconciler::cancel(long long id)
+{
+	try
+	{
+		m_api.deleteOrder(id);
+	}
+	catch (const std::exception& e)
+	{
+		// most likely filled meanwhile; if not, its funds stay held
+		Log::write(string("cancel failed: ") + e.what());
+	}
+}
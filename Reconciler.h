@@ -0,0 +1,40 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <map>
+#include <vector>
+#include "TradeApi.h"
+
+// Lines up the orders left open by an earlier run with the orders planned
+// now, instead of cancelling them all: an own order of the same coin and
+// side is kept while its price and amount are close enough to the planned
+// ones, moved to them otherwise, and every other open order is cancelled.
+// Kept orders keep their place in the exchange's queue.
+class Reconciler
+{
+public:
+	Reconciler(TradeApi& api);
+
+	// relative distance from the planned price an order may keep
+	void set_price_band(double band)
+	{
+		m_priceBand = band;
+	}
+	// relative distance from the planned amount an order may keep
+	void set_amount_tolerance(double tolerance)
+	{
+		m_amountTolerance = tolerance;
+	}
+
+	// Returns the orders open now for the planned orders by their index,
+	// with the price and amount actually open, for ExecutionPlanner::start()
+	std::map<size_t, TradeApi::OpenOrder> run(const std::vector<TradeApi::Order>& orders);
+private:
+	bool fits(const TradeApi::Order& open, const TradeApi::Order& planned) const;
+	void cancel(long long id);
+
+	TradeApi& m_api;
+	double m_priceBand;
+	double m_amountTolerance;
+};
@@ -0,0 +1,304 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "RecordedTransport.h"
+#include <boost/asio/error.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/error.hpp>
+#include <boost/system/system_error.hpp>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+	const char recording_magic[4] = { 'P', 'R', 'E', 'C' };
+	const unsigned char recording_version = 2;
+
+	void putInt(string& out, uint64_t value, int bytes)
+	{
+		for (int i = 0; i < bytes; ++i)
+			out += static_cast<char>((value >> (8 * i)) & 0xFF);
+	}
+
+	void putString(string& out, const char* data, size_t size)
+	{
+		putInt(out, size, 4);
+		out.append(data, size);
+	}
+
+	uint64_t getInt(const char*& p, const char* end, int bytes)
+	{
+		if (end - p < bytes)
+			throw runtime_error("Damaged recording");
+		uint64_t value = 0;
+		for (int i = 0; i < bytes; ++i)
+			value |= static_cast<uint64_t>(static_cast<unsigned char>(*p++)) << (8 * i);
+		return value;
+	}
+
+	string getString(const char*& p, const char* end)
+	{
+		size_t size = static_cast<size_t>(getInt(p, end, 4));
+		if (static_cast<size_t>(end - p) < size)
+			throw runtime_error("Damaged recording");
+		string s(p, size);
+		p += size;
+		return s;
+	}
+
+	// the categories of the transport errors, found again by name
+	const boost::system::error_category* errorCategory(const string& name)
+	{
+		const boost::system::error_category* categories[] = {
+			&boost::system::system_category(),
+			&boost::system::generic_category(),
+			&boost::asio::error::get_netdb_category(),
+			&boost::asio::error::get_addrinfo_category(),
+			&boost::asio::error::get_misc_category(),
+			&boost::asio::error::get_ssl_category(),
+			&boost::asio::ssl::error::get_stream_category(),
+			&make_error_code(boost::beast::error::timeout).category(),
+			&make_error_code(boost::beast::http::error::end_of_stream).category() };
+		for (const boost::system::error_category* c : categories)
+			if (name == c->name())
+				return c;
+		return nullptr;
+	}
+
+	// records what another transport answers
+	class RecordingConnection : public HttpConnection
+	{
+	public:
+		RecordingConnection(RecordingTransport& recording, Transport::Lease inner):
+			m_recording(recording),
+			m_inner(std::move(inner))
+		{
+		}
+
+		virtual const std::string& get(const char* target, Deadline deadline)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			try
+			{
+				const string& reply = m_inner->get(target, deadline);
+				m_recording.write('G', target, string(), false, reply, m_inner->encoding(), start);
+				return reply;
+			}
+			catch (const boost::system::system_error& e)
+			{
+				m_recording.write('G', target, string(), true, e.what(), IDENTITY, start, e.code());
+				throw;
+			}
+			catch (const exception& e)
+			{
+				m_recording.write('G', target, string(), true, e.what(), IDENTITY, start);
+				throw;
+			}
+		}
+		virtual const std::string& post(const char* target, const std::string& body,
+			std::initializer_list<Header> headers, Deadline deadline, bool idempotent)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			try
+			{
+				const string& reply = m_inner->post(target, body, headers, deadline, idempotent);
+				m_recording.write('P', target, body, false, reply, m_inner->encoding(), start);
+				return reply;
+			}
+			catch (const boost::system::system_error& e)
+			{
+				m_recording.write('P', target, body, true, e.what(), IDENTITY, start, e.code());
+				throw;
+			}
+			catch (const exception& e)
+			{
+				m_recording.write('P', target, body, true, e.what(), IDENTITY, start);
+				throw;
+			}
+		}
+		virtual Encoding encoding() const
+		{
+			return m_inner->encoding();
+		}
+	private:
+		RecordingTransport& m_recording;
+		Transport::Lease m_inner;
+	};
+
+	// answers from the recording
+	class ReplayConnection : public HttpConnection
+	{
+	public:
+		explicit ReplayConnection(ReplayTransport& replay):
+			m_replay(replay),
+			m_encoding(IDENTITY)
+		{
+		}
+
+		virtual const std::string& get(const char* target, Deadline deadline)
+		{
+			return answer(m_replay.next('G', target, string()), deadline);
+		}
+		virtual const std::string& post(const char* target, const std::string& body,
+			std::initializer_list<Header> /*headers*/, Deadline deadline, bool /*idempotent*/)
+		{
+			return answer(m_replay.next('P', target, body), deadline);
+		}
+		virtual Encoding encoding() const
+		{
+			return m_encoding;
+		}
+	private:
+		const std::string& answer(ReplayTransport::Exchange e, Deadline deadline)
+		{
+			if (m_replay.timed())
+			{
+				// a reply later than the deadline times out as it would have
+				chrono::steady_clock::time_point ready = chrono::steady_clock::now() + e.latency;
+				this_thread::sleep_until(min(ready, deadline));
+				if (ready > deadline)
+					throw boost::system::system_error(boost::asio::error::timed_out);
+			}
+			if (e.failed)
+			{
+				if (const boost::system::error_category* c = errorCategory(e.category))
+					throw boost::system::system_error(e.value, *c);
+				throw runtime_error(e.reply);
+			}
+			m_reply.swap(e.reply);
+			m_encoding = e.encoding;
+			return m_reply;
+		}
+
+		ReplayTransport& m_replay;
+		string m_reply;
+		Encoding m_encoding;
+	};
+}
+
+RecordingTransport::RecordingTransport(std::shared_ptr<Transport> transport, const std::string& path):
+	m_transport(transport),
+	m_start(chrono::steady_clock::now()),
+	m_file(path, ios_base::binary | ios_base::trunc)
+{
+	if (!m_file.is_open())
+		throw runtime_error("Failed to open file " + path);
+	m_file.write(recording_magic, sizeof(recording_magic));
+	m_file.put(static_cast<char>(recording_version));
+	m_file.flush();
+}
+
+Transport::Lease RecordingTransport::acquire()
+{
+	return Lease(*this, unique_ptr<HttpConnection>(new RecordingConnection(*this, m_transport->acquire())));
+}
+
+void RecordingTransport::set_compression(bool compression)
+{
+	m_transport->set_compression(compression);
+}
+
+void RecordingTransport::release(std::unique_ptr<HttpConnection> connection)
+{
+	// the inner connection goes back to its own transport
+	connection.reset();
+}
+
+void RecordingTransport::write(char method, const char* target, const std::string& body, bool failed,
+	const std::string& reply, HttpConnection::Encoding encoding,
+	std::chrono::steady_clock::time_point start, const boost::system::error_code& error)
+{
+	chrono::steady_clock::time_point end = chrono::steady_clock::now();
+	string record;
+	record += method;
+	record += static_cast<char>(failed ? 1 : 0);
+	record += static_cast<char>(encoding);
+	putInt(record, chrono::duration_cast<chrono::microseconds>(start - m_start).count(), 8);
+	putInt(record, chrono::duration_cast<chrono::microseconds>(end - start).count(), 8);
+	putString(record, target, strlen(target));
+	putString(record, body.data(), body.size());
+	putString(record, reply.data(), reply.size());
+	const char* category = error ? error.category().name() : "";
+	putString(record, category, strlen(category));
+	putInt(record, static_cast<uint32_t>(error.value()), 4);
+	lock_guard<mutex> lock(m_mutex);
+	m_file.write(record.data(), record.size());
+	// a run that crashes keeps what it recorded
+	m_file.flush();
+}
+
+ReplayTransport::ReplayTransport(const std::string& path, bool timed):
+	m_timed(timed),
+	m_remaining(0)
+{
+	ifstream f(path, ios_base::binary);
+	if (!f.is_open())
+		throw runtime_error("Failed to open file " + path);
+	string data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+	if (data.size() < sizeof(recording_magic) + 1 ||
+		memcmp(data.data(), recording_magic, sizeof(recording_magic)) != 0 ||
+		static_cast<unsigned char>(data[sizeof(recording_magic)]) != recording_version)
+		throw runtime_error("Not a recording " + path);
+	const char* p = data.data() + sizeof(recording_magic) + 1;
+	const char* end = data.data() + data.size();
+	while (p != end)
+	{
+		Exchange e;
+		e.method = static_cast<char>(getInt(p, end, 1));
+		e.failed = getInt(p, end, 1) != 0;
+		e.encoding = static_cast<HttpConnection::Encoding>(getInt(p, end, 1));
+		e.start = chrono::microseconds(getInt(p, end, 8));
+		e.latency = chrono::microseconds(getInt(p, end, 8));
+		e.target = getString(p, end);
+		e.body = getString(p, end);
+		e.reply = getString(p, end);
+		e.category = getString(p, end);
+		e.value = static_cast<int32_t>(getInt(p, end, 4));
+		m_queues[key(e.method, e.target, e.body)].push_back(m_exchanges.size());
+		m_exchanges.push_back(std::move(e));
+	}
+	m_remaining = m_exchanges.size();
+}
+
+Transport::Lease ReplayTransport::acquire()
+{
+	return Lease(*this, unique_ptr<HttpConnection>(new ReplayConnection(*this)));
+}
+
+void ReplayTransport::release(std::unique_ptr<HttpConnection> connection)
+{
+	connection.reset();
+}
+
+ReplayTransport::Exchange ReplayTransport::next(char method, const char* target, const std::string& body)
+{
+	string k = key(method, target, body);
+	lock_guard<mutex> lock(m_mutex);
+	auto it = m_queues.find(k);
+	if (it == m_queues.end() || it->second.empty())
+		throw runtime_error("No recorded reply to " + k);
+	Exchange e = m_exchanges[it->second.front()];
+	it->second.pop_front();
+	--m_remaining;
+	return e;
+}
+
+size_t ReplayTransport::remaining() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_remaining;
+}
+
+std::string ReplayTransport::key(char method, const std::string& target, const std::string& body)
+{
+	// the command names a private request, its nonce changes every run
+	string k = string(1, method) + " " + target;
+	size_t pos = body.find("command=");
+	if (pos != string::npos && (pos == 0 || body[pos - 1] == '&'))
+		k += " " + body.substr(pos, body.find('&', pos) - pos);
+	return k;
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/system/error_code.hpp>
+#include "Transport.h"
+
+// Passes requests on to another transport and appends every request and
+// reply, or the error instead, to one file with its start and latency.
+// The API key and signature headers are left out of the file.
+class RecordingTransport : public Transport
+{
+public:
+	// throws std::runtime_error when the file cannot be created
+	RecordingTransport(std::shared_ptr<Transport> transport, const std::string& path);
+
+	virtual Lease acquire();
+	virtual void set_compression(bool compression);
+
+	// one exchange of a request and its reply, or of the error and its
+	// code for a transport error; called by the connections
+	void write(char method, const char* target, const std::string& body, bool failed,
+		const std::string& reply, HttpConnection::Encoding encoding,
+		std::chrono::steady_clock::time_point start,
+		const boost::system::error_code& error = boost::system::error_code());
+protected:
+	virtual void release(std::unique_ptr<HttpConnection> connection);
+private:
+	std::shared_ptr<Transport> m_transport;
+	std::chrono::steady_clock::time_point m_start;
+	std::mutex m_mutex;
+	std::ofstream m_file;
+};
+
+// Answers requests from a recording instead of the network, so a run can
+// be repeated offline. Requests are matched by target and command in the
+// order they were recorded; nonces and signatures may differ. Replies come
+// at once or, when timed, after their recorded latency; recorded errors
+// are thrown again, transport errors as boost::system::system_error with
+// their code.
+class ReplayTransport : public Transport
+{
+public:
+	struct Exchange
+	{
+		char method;
+		bool failed;
+		HttpConnection::Encoding encoding;
+		// since the recording started
+		std::chrono::microseconds start;
+		std::chrono::microseconds latency;
+		std::string target;
+		std::string body;
+		std::string reply;
+		// the error code of a transport error, empty category otherwise
+		std::string category;
+		int value;
+	};
+
+	// throws std::runtime_error for a missing or damaged file
+	ReplayTransport(const std::string& path, bool timed);
+
+	virtual Lease acquire();
+	virtual void set_compression(bool /*compression*/) {}
+
+	// the next recorded exchange for the request; throws
+	// std::runtime_error when none is left
+	Exchange next(char method, const char* target, const std::string& body);
+	// exchanges recorded but not replayed yet
+	size_t remaining() const;
+	bool timed() const
+	{
+		return m_timed;
+	}
+protected:
+	virtual void release(std::unique_ptr<HttpConnection> connection);
+private:
+	static std::string key(char method, const std::string& target, const std::string& body);
+
+	bool m_timed;
+	mutable std::mutex m_mutex;
+	std::vector<Exchange> m_exchanges;
+	std::map<std::string, std::deque<size_t>> m_queues;
+	size_t m_remaining;
+};
@@ -0,0 +1,123 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "RequestBuilder.h"
+#include <openssl/hmac.h>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+RequestArena::RequestArena(size_t capacity):
+	m_data(new char[capacity]),
+	m_capacity(capacity),
+	m_used(0)
+{
+}
+
+void* RequestArena::allocate(size_t size, size_t align)
+{
+	size_t offset = (m_used + align - 1) & ~(align - 1);
+	if (offset + size > m_capacity)
+		throw std::bad_alloc();
+	m_used = offset + size;
+	return m_data.get() + offset;
+}
+
+RequestArena& RequestArena::local()
+{
+	static thread_local RequestArena arena;
+	return arena;
+}
+
+RequestParams::RequestParams():
+	m_arena(RequestArena::local()),
+	m_mark(m_arena.mark()),
+	m_count(0)
+{
+}
+
+RequestParams::~RequestParams()
+{
+	m_arena.rewind(m_mark);
+}
+
+void RequestParams::add(const char* name, const char* value, size_t size)
+{
+	if (m_count == max_params)
+		throw runtime_error("Too many request parameters");
+	char* copy = static_cast<char*>(m_arena.allocate(size + 1, 1));
+	memcpy(copy, value, size);
+	copy[size] = 0;
+	Param& p = m_params[m_count++];
+	p.name = name;
+	p.value = copy;
+	p.size = size;
+}
+
+void RequestParams::add(const char* name, const char* value)
+{
+	add(name, value, strlen(value));
+}
+
+void RequestParams::add(const char* name, const string& value)
+{
+	add(name, value.data(), value.size());
+}
+
+void RequestParams::add(const char* name, double value)
+{
+	add(name, Decimal(value));
+}
+
+void RequestParams::add(const char* name, Decimal value)
+{
+	char buf[Decimal::maxLength];
+	add(name, buf, value.format(buf));
+}
+
+void RequestParams::add(const char* name, long long value)
+{
+	char buf[24];
+	int n = snprintf(buf, sizeof(buf), "%lld", value);
+	add(name, buf, n);
+}
+
+const char* RequestParams::get(const char* name) const
+{
+	for (size_t i = 0; i < m_count; ++i)
+		if (!strcmp(m_params[i].name, name))
+			return m_params[i].value;
+	return "";
+}
+
+void RequestParams::write(string& body, unsigned long long nonce) const
+{
+	char buf[24];
+	int n = snprintf(buf, sizeof(buf), "%llu", nonce);
+	body.assign("nonce=", 6);
+	body.append(buf, n);
+	for (size_t i = 0; i < m_count; ++i)
+	{
+		body += '&';
+		body.append(m_params[i].name);
+		body += '=';
+		body.append(m_params[i].value, m_params[i].size);
+	}
+}
+
+void signRequest(const string& secret, const string& body, char (&sign)[129])
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	HMAC(EVP_sha512(),
+		secret.c_str(), secret.length(),
+		(const unsigned char*)body.c_str(), body.length(), digest, &length);
+	static const char hex[] = "0123456789abcdef";
+	for (int i = 0; i < 64; i++)
+	{
+		sign[i * 2] = hex[digest[i] >> 4];
+		sign[i * 2 + 1] = hex[digest[i] & 0xf];
+	}
+	sign[128] = 0;
+}
@@ -0,0 +1,120 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include "Decimal.h"
+
+// Bump allocator for the short-lived data of one request. Memory is
+// handed back all at once by rewinding, so steady-state requests reuse
+// the same block instead of going to the heap.
+class RequestArena
+{
+public:
+	explicit RequestArena(size_t capacity = 16384);
+
+	void* allocate(size_t size, size_t align);
+	size_t mark() const
+	{
+		return m_used;
+	}
+	void rewind(size_t mark)
+	{
+		m_used = mark;
+	}
+	void reset()
+	{
+		m_used = 0;
+	}
+
+	// arena of the calling thread, used to build request parameters
+	static RequestArena& local();
+private:
+	std::unique_ptr<char[]> m_data;
+	size_t m_capacity;
+	size_t m_used;
+};
+
+template<class T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	explicit ArenaAllocator(RequestArena& arena) : m_arena(&arena) {}
+	template<class U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : m_arena(other.arena()) {}
+
+	T* allocate(size_t n)
+	{
+		return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+	}
+	void deallocate(T*, size_t)
+	{
+	}
+
+	RequestArena* arena() const
+	{
+		return m_arena;
+	}
+private:
+	RequestArena* m_arena;
+};
+
+template<class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+	return a.arena() == b.arena();
+}
+
+template<class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b)
+{
+	return a.arena() != b.arena();
+}
+
+// Parameters of a private API call. Values are copied into the thread's
+// arena and released when the object goes out of scope.
+class RequestParams
+{
+public:
+	RequestParams();
+	~RequestParams();
+
+	void add(const char* name, const char* value);
+	void add(const char* name, const std::string& value);
+	// prices and amounts are rounded to the exchange's eight decimals
+	void add(const char* name, double value);
+	void add(const char* name, Decimal value);
+	void add(const char* name, long long value);
+
+	const char* get(const char* name) const;
+
+	// Writes "nonce=N&name=value..." into body, reusing its capacity
+	void write(std::string& body, unsigned long long nonce) const;
+private:
+	RequestParams(const RequestParams&);
+	RequestParams& operator=(const RequestParams&);
+
+	void add(const char* name, const char* value, size_t size);
+
+	struct Param
+	{
+		const char* name;
+		const char* value;
+		size_t size;
+	};
+
+	static const size_t max_params = 8;
+
+	RequestArena& m_arena;
+	size_t m_mark;
+	Param m_params[max_params];
+	size_t m_count;
+};
+
+// Hex encoded HMAC-SHA512 of body, as expected in the "Sign" header
+void signRequest(const std::string& secret, const std::string& body, char (&sign)[129]);
@@ -0,0 +1,153 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "SharedTickerCache.h"
+#include "Log.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace bip = boost::interprocess;
+using namespace std;
+
+namespace
+{
+	const uint32_t segment_version = 4;
+	const size_t coin_length = 16;
+	const size_t max_tickers = 1024;
+	const unsigned read_attempts = 1000;
+	// a publisher that held the lock this long is taken to have died
+	const int64_t stale_writer_seconds = 10;
+
+	struct Record
+	{
+		char coin[coin_length];
+		// satoshis, see Decimal
+		int64_t buyPrice;
+		int64_t sellPrice;
+		int64_t lastPrice;
+		int64_t volume;
+		// USDT only, see TradeApi::CoinInfo::rate
+		int64_t rate;
+	};
+}
+
+// Zero filled when the segment is created, which reads as never published
+struct SharedTickerCache::Segment
+{
+	// the low half counts publishes and is odd while one is under way; the
+	// high half is the time the last publish started, so that a publisher
+	// never sees a new lock with the time of the one before
+	std::atomic<uint64_t> sequence;
+	uint32_t version;
+	uint32_t count;
+	int64_t publishedAt;
+	Record records[max_tickers];
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory needs lock-free 64-bit atomics");
+
+SharedTickerCache::SharedTickerCache(const std::string& name):
+	m_shm(bip::open_or_create, name.c_str(), bip::read_write)
+{
+	Log l("SharedTickerCache::SharedTickerCache");
+	bip::offset_t size = 0;
+	if (!m_shm.get_size(size) || size < static_cast<bip::offset_t>(sizeof(Segment)))
+		m_shm.truncate(sizeof(Segment));
+	bip::mapped_region region(m_shm, bip::read_write, 0, sizeof(Segment));
+	m_region.swap(region);
+	m_segment = static_cast<Segment*>(m_region.get_address());
+}
+
+bool SharedTickerCache::read(std::map<std::string, TradeApi::CoinInfo>& tickers, unsigned maxAge) const
+{
+	Log l("SharedTickerCache::read");
+	Segment& s = *m_segment;
+	vector<Record> records;
+	for (unsigned attempt = 0; attempt < read_attempts; ++attempt)
+	{
+		uint64_t before = s.sequence.load(memory_order_acquire);
+		if (before & 1)
+		{
+			this_thread::yield();
+			continue;
+		}
+		uint32_t version = s.version;
+		uint32_t count = s.count;
+		int64_t publishedAt = s.publishedAt;
+		if (count > max_tickers)
+			count = 0;
+		records.resize(count);
+		if (count)
+			memcpy(&records[0], s.records, count * sizeof(Record));
+		atomic_thread_fence(memory_order_acquire);
+		if (s.sequence.load(memory_order_relaxed) != before)
+			continue;
+
+		if (version != segment_version || !count ||
+			time(0) - publishedAt > static_cast<int64_t>(maxAge))
+			return false;
+		tickers.clear();
+		for (const Record& r : records)
+		{
+			string coin(r.coin, strnlen(r.coin, coin_length));
+			TradeApi::CoinInfo& ci = tickers[coin];
+			ci.coin = coin;
+			ci.buyPrice = Decimal::fromUnits(r.buyPrice);
+			ci.sellPrice = Decimal::fromUnits(r.sellPrice);
+			ci.lastPrice = Decimal::fromUnits(r.lastPrice);
+			ci.volume = Decimal::fromUnits(r.volume);
+			ci.rate = Decimal::fromUnits(r.rate);
+		}
+		return true;
+	}
+	return false;
+}
+
+bool SharedTickerCache::publish(const std::map<std::string, TradeApi::CoinInfo>& tickers)
+{
+	Log l("SharedTickerCache::publish");
+	Segment& s = *m_segment;
+	int64_t now = time(0);
+	uint64_t seq = s.sequence.load(memory_order_relaxed);
+	uint32_t next = static_cast<uint32_t>(seq) + 1;
+	if (seq & 1)
+	{
+		// take over from a publisher that never finished
+		if (now - static_cast<int64_t>(seq >> 32) < stale_writer_seconds)
+			return false;
+		++next;
+	}
+	uint64_t started = static_cast<uint64_t>(static_cast<uint32_t>(now)) << 32;
+	if (!s.sequence.compare_exchange_strong(seq, started | next, memory_order_acq_rel))
+		return false;
+	atomic_thread_fence(memory_order_release);
+
+	uint32_t count = 0;
+	for (const auto& t : tickers)
+	{
+		if (count == max_tickers || t.first.size() >= coin_length)
+			continue;
+		Record& r = s.records[count++];
+		memset(r.coin, 0, coin_length);
+		memcpy(r.coin, t.first.data(), t.first.size());
+		r.buyPrice = t.second.buyPrice.units();
+		r.sellPrice = t.second.sellPrice.units();
+		r.lastPrice = t.second.lastPrice.units();
+		r.volume = t.second.volume.units();
+		r.rate = t.second.rate.units();
+	}
+	s.count = count;
+	s.version = segment_version;
+	s.publishedAt = now;
+	s.sequence.store(started | (next + 1), memory_order_release);
+	return true;
+}
+
+void SharedTickerCache::remove(const std::string& name)
+{
+	bip::shared_memory_object::remove(name.c_str());
+}
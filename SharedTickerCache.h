@@ -0,0 +1,33 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <map>
+#include <string>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include "TradeApi.h"
+
+// Parsed tickers in a POSIX shared memory segment, so that instances on
+// one host share a single download. A seqlock guards the table: readers
+// take no lock and retry while a publish is under way, and a publisher
+// that finds another one at work simply skips its own copy.
+class SharedTickerCache
+{
+public:
+	// opens the segment, creating it empty if needed
+	explicit SharedTickerCache(const std::string& name);
+
+	// false when no tickers were published within maxAge seconds
+	bool read(std::map<std::string, TradeApi::CoinInfo>& tickers, unsigned maxAge) const;
+	// false when another process is publishing at the same time
+	bool publish(const std::map<std::string, TradeApi::CoinInfo>& tickers);
+
+	static void remove(const std::string& name);
+private:
+	struct Segment;
+
+	boost::interprocess::shared_memory_object m_shm;
+	boost::interprocess::mapped_region m_region;
+	Segment* m_segment;
+};
@@ -0,0 +1,90 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "TradeApi.h"
+
+// Market data of a simulation, by coin index. A step changes prices and
+// balances in place and hands the market to Portfolio::evaluate(), which
+// then values it without virtual calls or maps built on the way. Only the
+// BTC markets are simulated.
+class SimulatedMarket
+{
+public:
+	// throws std::runtime_error when a coin repeats
+	explicit SimulatedMarket(std::vector<std::string> coins):
+		m_coins(coins)
+	{
+		std::sort(m_coins.begin(), m_coins.end());
+		if (std::adjacent_find(m_coins.begin(), m_coins.end()) != m_coins.end())
+			throw std::runtime_error("Coins repeat");
+		m_tickers.resize(m_coins.size());
+		m_priced.resize(m_coins.size(), false);
+		m_balances.resize(m_coins.size());
+		for (size_t i = 0; i < m_coins.size(); ++i)
+			m_tickers[i].coin = m_coins[i];
+	}
+
+	// coins are indexed by name; throws std::runtime_error for others
+	size_t index(const std::string& coin) const
+	{
+		auto it = std::lower_bound(m_coins.begin(), m_coins.end(), coin);
+		if (it == m_coins.end() || *it != coin)
+			throw std::runtime_error("Invalid coin " + coin);
+		return it - m_coins.begin();
+	}
+	void set_ticker(size_t i, Decimal buyPrice, Decimal sellPrice)
+	{
+		m_tickers[i].buyPrice = buyPrice;
+		m_tickers[i].sellPrice = sellPrice;
+		m_tickers[i].lastPrice = buyPrice;
+		m_priced[i] = true;
+	}
+	void set_balance(size_t i, Decimal amount)
+	{
+		m_balances[i] = amount;
+	}
+
+	// what Portfolio::evaluate() asks, valued as MarketSnapshot does
+	template<class F>
+	void forEachValue(F f) const
+	{
+		for (size_t i = 0; i < m_coins.size(); ++i)
+		{
+			Decimal b = m_balances[i];
+			if (b.units() == 0)
+				continue;
+			if (m_coins[i] == "BTC")
+				f(m_coins[i], static_cast<double>(b));
+			else if (m_priced[i])
+				f(m_coins[i], b * (m_tickers[i].buyPrice + m_tickers[i].sellPrice) / 2);
+			else
+				f(m_coins[i], 0.0);
+		}
+	}
+	const TradeApi::CoinInfo& info(const std::string& coin) const
+	{
+		size_t i = index(coin);
+		if (!m_priced[i])
+			throw std::runtime_error("Invalid coin " + coin);
+		return m_tickers[i];
+	}
+	const TradeApi::CoinInfo* pair(const std::string& base, const std::string& coin) const
+	{
+		if (base != "BTC")
+			return nullptr;
+		auto it = std::lower_bound(m_coins.begin(), m_coins.end(), coin);
+		if (it == m_coins.end() || *it != coin || !m_priced[it - m_coins.begin()])
+			return nullptr;
+		return &m_tickers[it - m_coins.begin()];
+	}
+private:
+	std::vector<std::string> m_coins;
+	std::vector<TradeApi::CoinInfo> m_tickers;
+	std::vector<bool> m_priced;
+	std::vector<Decimal> m_balances;
+};
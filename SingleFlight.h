@@ -0,0 +1,69 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Merges concurrent calls for the same key into one: the first caller
+// runs the work, and callers arriving while it runs wait for it and get
+// the same result, or the same exception. Nothing is kept once the call
+// is over, so only calls that overlap are ever merged; callers must only
+// merge work that is safe to share, such as reads.
+template<class Result>
+class SingleFlight
+{
+public:
+	typedef std::shared_ptr<const Result> Shared;
+
+	// joined is set for callers that waited for the work of another
+	template<class Work>
+	Shared run(const std::string& key, Work work, bool& joined)
+	{
+		std::shared_future<Shared> flight;
+		std::promise<Shared> promise;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_flights.find(key);
+			joined = it != m_flights.end();
+			if (joined)
+				flight = it->second;
+			else
+				m_flights[key] = promise.get_future().share();
+		}
+		if (joined)
+			return flight.get();
+		try
+		{
+			Shared result = std::make_shared<const Result>(work());
+			land(key);
+			promise.set_value(result);
+			return result;
+		}
+		catch (...)
+		{
+			land(key);
+			promise.set_exception(std::current_exception());
+			throw;
+		}
+	}
+
+	// calls running now
+	size_t inFlight() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_flights.size();
+	}
+private:
+	void land(const std::string& key)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_flights.erase(key);
+	}
+
+	mutable std::mutex m_mutex;
+	std::map<std::string, std::shared_future<Shared>> m_flights;
+};
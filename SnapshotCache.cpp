@@ -0,0 +1,176 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "SnapshotCache.h"
+#include "Log.h"
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+
+namespace bip = boost::interprocess;
+using namespace std;
+
+namespace
+{
+	const char snapshot_magic[8] = { 'P', 'O', 'L', 'O', 'S', 'N', 'A', 'P' };
+	const uint32_t snapshot_version = 4;
+	const size_t coin_length = 16;
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t tickerCount;
+		uint32_t balanceCount;
+		uint32_t reserved;
+		uint64_t account;
+		int64_t tickersTime;
+		int64_t balancesTime;
+	};
+
+	struct TickerRecord
+	{
+		char coin[coin_length];
+		// prices and amounts in satoshis, see Decimal
+		int64_t buyPrice;
+		int64_t sellPrice;
+		int64_t lastPrice;
+		int64_t volume;
+		// USDT only, see TradeApi::CoinInfo::rate
+		int64_t rate;
+	};
+
+	struct BalanceRecord
+	{
+		char coin[coin_length];
+		int64_t amount;
+	};
+
+	void copyCoin(char (&dst)[coin_length], const string& coin)
+	{
+		if (coin.size() >= coin_length)
+			throw runtime_error("Coin symbol too long for snapshot: " + coin);
+		memset(dst, 0, coin_length);
+		memcpy(dst, coin.data(), coin.size());
+	}
+
+	string readCoin(const char (&src)[coin_length])
+	{
+		return string(src, strnlen(src, coin_length));
+	}
+}
+
+SnapshotCache::SnapshotCache(const string& path, const string& account):
+	m_path(path),
+	m_account(std::hash<string>()(account))
+{
+}
+
+bool SnapshotCache::load(Snapshot& snapshot) const
+{
+	Log l("SnapshotCache::load");
+	try
+	{
+		bip::file_mapping file(m_path.c_str(), bip::read_only);
+		bip::mapped_region region(file, bip::read_only);
+		const char* data = static_cast<const char*>(region.get_address());
+		size_t size = region.get_size();
+		if (size < sizeof(Header))
+			return false;
+		Header h;
+		memcpy(&h, data, sizeof(h));
+		if (memcmp(h.magic, snapshot_magic, sizeof(snapshot_magic)) ||
+			h.version != snapshot_version)
+			return false;
+		if (size != sizeof(Header) + h.tickerCount * sizeof(TickerRecord) +
+			h.balanceCount * sizeof(BalanceRecord))
+			return false;
+
+		const char* p = data + sizeof(Header);
+		snapshot.tickers.clear();
+		for (uint32_t i = 0; i < h.tickerCount; ++i, p += sizeof(TickerRecord))
+		{
+			TickerRecord r;
+			memcpy(&r, p, sizeof(r));
+			TradeApi::CoinInfo& ci = snapshot.tickers[readCoin(r.coin)];
+			ci.coin = readCoin(r.coin);
+			ci.buyPrice = Decimal::fromUnits(r.buyPrice);
+			ci.sellPrice = Decimal::fromUnits(r.sellPrice);
+			ci.lastPrice = Decimal::fromUnits(r.lastPrice);
+			ci.volume = Decimal::fromUnits(r.volume);
+			ci.rate = Decimal::fromUnits(r.rate);
+		}
+		snapshot.tickersTime = static_cast<time_t>(h.tickersTime);
+
+		snapshot.balances.clear();
+		snapshot.balancesTime = 0;
+		if (h.account != m_account)
+			return true;
+		for (uint32_t i = 0; i < h.balanceCount; ++i, p += sizeof(BalanceRecord))
+		{
+			BalanceRecord r;
+			memcpy(&r, p, sizeof(r));
+			snapshot.balances[readCoin(r.coin)] = Decimal::fromUnits(r.amount);
+		}
+		snapshot.balancesTime = static_cast<time_t>(h.balancesTime);
+		return true;
+	}
+	catch (const bip::interprocess_exception&)
+	{
+		// missing or unreadable snapshot just means a cold start
+		return false;
+	}
+}
+
+void SnapshotCache::save(const Snapshot& snapshot) const
+{
+	Log l("SnapshotCache::save");
+	Header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, snapshot_magic, sizeof(snapshot_magic));
+	h.version = snapshot_version;
+	h.tickerCount = static_cast<uint32_t>(snapshot.tickers.size());
+	h.balanceCount = static_cast<uint32_t>(snapshot.balances.size());
+	h.account = m_account;
+	h.tickersTime = snapshot.tickersTime;
+	h.balancesTime = snapshot.balancesTime;
+
+	// write aside and rename, so a concurrent reader never maps a torn file
+	string tmp = m_path + ".tmp";
+	{
+		ofstream f(tmp, ios_base::binary | ios_base::trunc);
+		if (!f.is_open())
+			throw runtime_error("Failed to open file " + tmp);
+		f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		for (const auto& t : snapshot.tickers)
+		{
+			TickerRecord r;
+			copyCoin(r.coin, t.first);
+			r.buyPrice = t.second.buyPrice.units();
+			r.sellPrice = t.second.sellPrice.units();
+			r.lastPrice = t.second.lastPrice.units();
+				r.volume = t.second.volume.units();
+			r.rate = t.second.rate.units();
+			f.write(reinterpret_cast<const char*>(&r), sizeof(r));
+		}
+		for (const auto& b : snapshot.balances)
+		{
+			BalanceRecord r;
+			copyCoin(r.coin, b.first);
+			r.amount = b.second.units();
+			f.write(reinterpret_cast<const char*>(&r), sizeof(r));
+		}
+		if (!f)
+			throw runtime_error("Failed to write file " + tmp);
+	}
+	if (std::rename(tmp.c_str(), m_path.c_str()) != 0)
+	{
+		std::remove(m_path.c_str());
+		if (std::rename(tmp.c_str(), m_path.c_str()) != 0)
+			throw runtime_error("Failed to replace file " + m_path);
+	}
+}
@@ -0,0 +1,38 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <string>
+#include <map>
+#include <ctime>
+#include "TradeApi.h"
+
+// Binary on-disk copy of the last downloaded tickers and balances, so that
+// a run started shortly after the previous one can skip the network.
+class SnapshotCache
+{
+public:
+	struct Snapshot
+	{
+		std::map<std::string, TradeApi::CoinInfo> tickers;
+		std::map<std::string, Decimal> balances;
+		time_t tickersTime;
+		time_t balancesTime;
+
+		Snapshot() : tickersTime(0), balancesTime(0) {}
+	};
+
+	// account tags the balances so that one file is never read for another key
+	SnapshotCache(const std::string& path, const std::string& account);
+
+	bool load(Snapshot& snapshot) const;
+	void save(const Snapshot& snapshot) const;
+
+	const std::string& path() const
+	{
+		return m_path;
+	}
+private:
+	std::string m_path;
+	unsigned long long m_account;
+};
@@ -0,0 +1,292 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "TickerHistory.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+namespace bip = boost::interprocess;
+
+namespace
+{
+	const char history_magic[4] = { 'P', 'T', 'K', 'H' };
+	const unsigned char history_version = 1;
+	const size_t header_size = sizeof(history_magic) + 1;
+	const unsigned char keyframe_type = 'K';
+	const unsigned char delta_type = 'D';
+
+	void putVarint(std::string& out, uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			out.push_back(static_cast<char>(v | 0x80));
+			v >>= 7;
+		}
+		out.push_back(static_cast<char>(v));
+	}
+
+	// small changes of either sign take small varints
+	void putSigned(std::string& out, int64_t v)
+	{
+		putVarint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+	}
+
+	bool getVarint(const unsigned char*& p, const unsigned char* end, uint64_t& v)
+	{
+		v = 0;
+		for (unsigned shift = 0; p < end && shift < 64; shift += 7)
+		{
+			unsigned char b = *p++;
+			v |= static_cast<uint64_t>(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+		return false;
+	}
+
+	bool getSigned(const unsigned char*& p, const unsigned char* end, int64_t& v)
+	{
+		uint64_t u;
+		if (!getVarint(p, end, u))
+			return false;
+		v = static_cast<int64_t>(u >> 1) ^ -static_cast<int64_t>(u & 1);
+		return true;
+	}
+
+	void corrupt(const char* what)
+	{
+		throw runtime_error(string("Corrupt ticker history: ") + what);
+	}
+
+	// the size of a history file up to the end of its last whole frame,
+	// skipping frames by their length as the reader does
+	uint64_t wholeFrames(istream& f, uint64_t size)
+	{
+		uint64_t pos = header_size;
+		while (pos < size)
+		{
+			unsigned char head[11];
+			f.clear();
+			f.seekg(pos);
+			f.read(reinterpret_cast<char*>(head), sizeof(head));
+			const unsigned char* p = head + 1;
+			const unsigned char* end = head + f.gcount();
+			uint64_t length;
+			if ((head[0] != keyframe_type && head[0] != delta_type) || p > end ||
+				!getVarint(p, end, length))
+				break;
+			uint64_t next = pos + (p - head) + length;
+			if (next > size)
+				break;
+			pos = next;
+		}
+		return pos;
+	}
+}
+
+TickerRecorder::TickerRecorder(const std::string& path, unsigned keyframeInterval):
+	m_path(path),
+	m_keyframeInterval(std::max(keyframeInterval, 1u)),
+	m_sinceKeyframe(0),
+	m_time(0)
+{
+	char header[header_size] = {};
+	{
+		ifstream f(m_path, ios_base::binary);
+		f.read(header, header_size);
+		if (f.gcount() > 0 && (f.gcount() != static_cast<streamsize>(header_size) ||
+			memcmp(header, history_magic, sizeof(history_magic)) ||
+			static_cast<unsigned char>(header[sizeof(history_magic)]) != history_version))
+			throw runtime_error("Not a ticker history file: " + m_path);
+		// a frame torn by a crash is cut off, or it would hide every frame after it
+		if (header[0])
+		{
+			f.clear();
+			f.seekg(0, ios_base::end);
+			uint64_t size = f.tellg();
+			uint64_t whole = wholeFrames(f, size);
+			if (whole < size && ::truncate(m_path.c_str(), whole) != 0)
+				throw runtime_error("Failed to truncate file " + m_path);
+		}
+	}
+	m_file.open(m_path, ios_base::binary | ios_base::app);
+	if (!m_file.is_open())
+		throw runtime_error("Failed to open file " + m_path);
+	if (!header[0])
+	{
+		m_file.write(history_magic, sizeof(history_magic));
+		m_file.put(static_cast<char>(history_version));
+	}
+}
+
+void TickerRecorder::append(time_t time, const std::map<std::string, TradeApi::CoinInfo>& tickers)
+{
+	if (tickers.empty())
+		return;
+	bool keyframe = m_coins.empty() || m_sinceKeyframe >= m_keyframeInterval ||
+		m_coins.size() != tickers.size();
+	if (!keyframe)
+	{
+		auto coin = m_coins.begin();
+		for (auto it = tickers.begin(); it != tickers.end() && !keyframe; ++it, ++coin)
+			keyframe = it->first != *coin;
+	}
+
+	m_frame.clear();
+	if (keyframe)
+	{
+		m_coins.clear();
+		m_prices.clear();
+		putSigned(m_frame, time);
+		putVarint(m_frame, tickers.size());
+		for (const auto& t : tickers)
+		{
+			m_coins.push_back(t.first);
+			putVarint(m_frame, t.first.size());
+			m_frame.append(t.first);
+			for (const Decimal* price : { &t.second.buyPrice, &t.second.sellPrice, &t.second.lastPrice })
+			{
+				m_prices.push_back(price->units());
+				putSigned(m_frame, price->units());
+			}
+		}
+		m_sinceKeyframe = 0;
+	}
+	else
+	{
+		putSigned(m_frame, time - m_time);
+		putVarint(m_frame, tickers.size());
+		auto last = m_prices.begin();
+		for (const auto& t : tickers)
+			for (const Decimal* price : { &t.second.buyPrice, &t.second.sellPrice, &t.second.lastPrice })
+			{
+				putSigned(m_frame, price->units() - *last);
+				*last++ = price->units();
+			}
+	}
+	m_time = time;
+	++m_sinceKeyframe;
+
+	char head[11];
+	head[0] = static_cast<char>(keyframe ? keyframe_type : delta_type);
+	std::string length;
+	putVarint(length, m_frame.size());
+	memcpy(head + 1, length.data(), length.size());
+	m_file.write(head, 1 + length.size());
+	m_file.write(m_frame.data(), m_frame.size());
+	// a crash leaves at most the last frame torn
+	m_file.flush();
+	if (!m_file)
+		throw runtime_error("Failed to write file " + m_path);
+}
+
+TickerHistoryReader::TickerHistoryReader(const std::string& path):
+	m_mapping(path.c_str(), bip::read_only),
+	m_region(m_mapping, bip::read_only),
+	m_data(static_cast<const unsigned char*>(m_region.get_address())),
+	m_size(m_region.get_size()),
+	m_pos(header_size),
+	m_from(numeric_limits<time_t>::min()),
+	m_started(false)
+{
+	if (m_size < header_size || memcmp(m_data, history_magic, sizeof(history_magic)) ||
+		m_data[sizeof(history_magic)] != history_version)
+		throw runtime_error("Not a ticker history file: " + path);
+	// index the keyframes, skipping the other frames by their length
+	size_t pos = header_size;
+	while (pos < m_size)
+	{
+		const unsigned char* p = m_data + pos + 1;
+		const unsigned char* end = m_data + m_size;
+		uint64_t length;
+		if (!getVarint(p, end, length) || length > static_cast<uint64_t>(end - p))
+			break;
+		if (m_data[pos] == keyframe_type)
+		{
+			int64_t time;
+			const unsigned char* q = p;
+			if (!getSigned(q, p + length, time))
+				break;
+			Keyframe k;
+			k.time = time;
+			k.offset = pos;
+			m_keyframes.push_back(k);
+		}
+		pos = (p - m_data) + length;
+	}
+	m_size = pos;
+}
+
+void TickerHistoryReader::seek(time_t time)
+{
+	m_from = time;
+	m_started = false;
+	auto it = upper_bound(m_keyframes.begin(), m_keyframes.end(), time,
+		[](time_t t, const Keyframe& k) { return t < k.time; });
+	if (it != m_keyframes.begin())
+		--it;
+	m_pos = (it != m_keyframes.end()) ? it->offset : m_size;
+}
+
+bool TickerHistoryReader::next()
+{
+	while (m_pos < m_size)
+	{
+		unsigned char type = m_data[m_pos];
+		const unsigned char* p = m_data + m_pos + 1;
+		uint64_t length;
+		getVarint(p, m_data + m_size, length);
+		const unsigned char* end = p + length;
+		m_pos = end - m_data;
+
+		int64_t value;
+		uint64_t count;
+		if (type == keyframe_type)
+		{
+			if (!getSigned(p, end, value) || !getVarint(p, end, count))
+				corrupt("keyframe header");
+			m_snapshot.time = value;
+			m_snapshot.tickers.resize(count);
+			for (TradeApi::CoinInfo& ci : m_snapshot.tickers)
+			{
+				uint64_t size;
+				if (!getVarint(p, end, size) || size > static_cast<uint64_t>(end - p))
+					corrupt("coin name");
+				ci.coin.assign(reinterpret_cast<const char*>(p), size);
+				p += size;
+				for (Decimal* price : { &ci.buyPrice, &ci.sellPrice, &ci.lastPrice })
+				{
+					if (!getSigned(p, end, value))
+						corrupt("keyframe price");
+					*price = Decimal::fromUnits(value);
+				}
+			}
+			m_started = true;
+		}
+		else if (type == delta_type)
+		{
+			// deltas only make sense after the keyframe they build on
+			if (!m_started)
+				continue;
+			if (!getSigned(p, end, value) || !getVarint(p, end, count) ||
+				count != m_snapshot.tickers.size())
+				corrupt("delta header");
+			m_snapshot.time += value;
+			for (TradeApi::CoinInfo& ci : m_snapshot.tickers)
+				for (Decimal* price : { &ci.buyPrice, &ci.sellPrice, &ci.lastPrice })
+				{
+					if (!getSigned(p, end, value))
+						corrupt("delta price");
+					*price = Decimal::fromUnits(price->units() + value);
+				}
+		}
+		else
+			corrupt("frame type");
+		if (m_snapshot.time >= m_from)
+			return true;
+	}
+	return false;
+}
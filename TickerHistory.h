@@ -0,0 +1,89 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "TradeApi.h"
+
+// Ticker downloads appended to a file as frames. A keyframe holds the
+// market list and every price in satoshis; the frames after it hold only
+// the change of every price since the frame before, as zigzag varints,
+// which is a byte or two for a quiet market. A new keyframe starts every
+// keyframeInterval frames, whenever the market list changes and on the
+// first append of a run, so a reader can start from any keyframe. A frame
+// left torn by a crash is cut off when the file is opened again.
+class TickerRecorder
+{
+public:
+	TickerRecorder(const std::string& path, unsigned keyframeInterval = 64);
+
+	void append(time_t time, const std::map<std::string, TradeApi::CoinInfo>& tickers);
+
+	const std::string& path() const
+	{
+		return m_path;
+	}
+private:
+	std::string m_path;
+	std::ofstream m_file;
+	unsigned m_keyframeInterval;
+	unsigned m_sinceKeyframe;
+	time_t m_time;
+	std::vector<std::string> m_coins;
+	std::vector<int64_t> m_prices;
+	std::string m_frame;
+};
+
+// Reads a TickerRecorder file through a read-only memory map. The
+// keyframes are indexed on opening, so seek() jumps to any time at once;
+// a frame torn by an interrupted append ends the file.
+class TickerHistoryReader
+{
+public:
+	struct Snapshot
+	{
+		time_t time;
+		std::vector<TradeApi::CoinInfo> tickers;
+
+		Snapshot() : time(0) {}
+	};
+
+	explicit TickerHistoryReader(const std::string& path);
+
+	// the next call of next() returns the first snapshot not older than time
+	void seek(time_t time);
+	// false at the end of the file
+	bool next();
+	const Snapshot& snapshot() const
+	{
+		return m_snapshot;
+	}
+
+	size_t keyframes() const
+	{
+		return m_keyframes.size();
+	}
+private:
+	struct Keyframe
+	{
+		time_t time;
+		size_t offset;
+	};
+
+	boost::interprocess::file_mapping m_mapping;
+	boost::interprocess::mapped_region m_region;
+	const unsigned char* m_data;
+	size_t m_size;
+	size_t m_pos;
+	time_t m_from;
+	bool m_started;
+	std::vector<Keyframe> m_keyframes;
+	Snapshot m_snapshot;
+};
@@ -0,0 +1,44 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "TradeApi.h"
+#include "ExecutionPlanner.h"
+#include "MarketSnapshot.h"
+#include <chrono>
+#include <stdexcept>
+
+bool TradeApi::execute(const std::vector<Order>& orders, unsigned timeout,
+	const OrderEvents& events)
+{
+	ExecutionPlanner planner(*this, events);
+	planner.set_clock(clock());
+	return planner.run(orders, balance("BTC"), std::chrono::minutes(timeout));
+}
+
+TradeApi::OrderStatus TradeApi::orderStatus(long long id, const std::string& coin)
+{
+	OrderStatus status;
+	status.open = checkOrder(id, coin);
+	status.filled = status.open ? 0.0 : 1.0;
+	return status;
+}
+
+std::shared_ptr<const MarketSnapshot> TradeApi::snapshot()
+{
+	std::shared_ptr<MarketSnapshot> s = std::make_shared<MarketSnapshot>();
+	s->balances = nonZeroBalances();
+	for (const auto& b : s->balances)
+		if (b.first != "BTC")
+			s->tickers[b.first] = info(b.first);
+	return s;
+}
+
+std::vector<TradeApi::OpenOrder> TradeApi::openOrders()
+{
+	throw std::runtime_error("Open orders are not available");
+}
+
+long long TradeApi::moveOrder(long long id, const Order& order)
+{
+	deleteOrder(id);
+	return createOrder(order);
+}
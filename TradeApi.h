@@ -2,8 +2,15 @@
 // Distributed under the Apache 2.0 software license, see the LICENSE file
 #pragma once
 
+#include <functional>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
+#include "Decimal.h"
+#include "Clock.h"
+
+struct MarketSnapshot;
 
 class TradeApi
 {
@@ -17,32 +24,129 @@ public:
 	struct Order
 	{
 		std::string coin;
-		double amount;
-		double price;
+		Decimal amount;
+		// in BTC, or in base on a direct market
+		Decimal price;
 		Operation action;
+		// coin paid or received when it is not BTC, as in the ETH_XMR market
+		std::string base;
+		// the price as quoted on an inverted market, see CoinInfo::rate
+		Decimal rate;
+
+		Order() : amount(0.0), price(0.0), action(BUY), rate(0.0) {}
 
-		Order() : amount(0.0), price(0.0), action(BUY) {}
+		// the coin itself on the BTC markets, BASE_COIN on the others
+		std::string market() const
+		{
+			return base.empty() ? coin : base + "_" + coin;
+		}
 	};
 
 	struct CoinInfo
 	{
 		std::string coin;
-		double buyPrice;
-		double sellPrice;
-		double lastPrice;
+		Decimal buyPrice;
+		Decimal sellPrice;
+		Decimal lastPrice;
+		// traded over the last 24 hours, in BTC or in base on a direct market
+		Decimal volume;
+		// USDT only, zero otherwise: the middle of the spread in USDT as the
+		// USDT_BTC market quotes it; the prices above are its inverse, which
+		// keeps only a few digits
+		Decimal rate;
+
+		CoinInfo() : buyPrice(0.0), sellPrice(0.0), lastPrice(0.0), volume(0.0), rate(0.0) {}
+	};
+
+	struct OrderStatus
+	{
+		bool open;
+		// executed part of the order, from 0 to 1
+		double filled;
+
+		OrderStatus() : open(false), filled(0.0) {}
+	};
+
+	struct OrderEvent
+	{
+		enum Type
+		{
+			PLACED,
+			PARTIALLY_FILLED,
+			FILLED,
+			CANCELLED,
+			// a request for the order failed, see error
+			FAILED
+		};
 
-		CoinInfo() : buyPrice(0.0), sellPrice(0.0), lastPrice(0.0) {}
+		Type type;
+		// position of the order in the executed list
+		size_t index;
+		Order order;
+		long long id;
+		double filled;
+		std::string error;
+
+		OrderEvent() : type(PLACED), index(0), id(0), filled(0.0) {}
+	};
+	typedef std::function<void(const OrderEvent&)> OrderEvents;
+
+	struct OpenOrder
+	{
+		long long id;
+		// amount is what is left open
+		Order order;
+		// part executed before, from 0 to 1
+		double filled;
+		// placed by this tool, as far as it remembers
+		bool own;
+		// given by the tool that placed the order, 0 when none was
+		long long clientId;
+
+		OpenOrder() : id(0), filled(0.0), own(false), clientId(0) {}
 	};
 
-	virtual double balance(const std::string& coin) = 0;
+	virtual ~TradeApi() {}
+
+	// Time source of execute(), the system clock unless set
+	virtual void set_clock(Clock& clock)
+	{
+		m_clock = &clock;
+	}
+	Clock& clock() const
+	{
+		return *m_clock;
+	}
+
+	virtual Decimal balance(const std::string& coin) = 0;
 	virtual CoinInfo info(const std::string& coin) = 0;
-	virtual std::map<std::string, double> nonZeroBalances() = 0;
+	virtual std::map<std::string, Decimal> nonZeroBalances() = 0;
 	virtual std::map<std::string, double> nonZeroBalancesInBTC() = 0;
 
 	virtual bool execute(const std::vector<Order>& orders, unsigned timeout) = 0;
 	virtual long long createOrder(const Order& order) = 0;
         virtual void deleteOrder(long long id) = 0;
+	// coin is the market() of the order
 	virtual bool checkOrder(long long id, const std::string& coin) = 0;
         virtual void cancelCurrentOrders() = 0;
+
+	// Same as execute() above, reporting every step of every order to
+	// events as it happens; the default runs an ExecutionPlanner.
+	virtual bool execute(const std::vector<Order>& orders, unsigned timeout,
+		const OrderEvents& events);
+	// The default only knows what checkOrder() tells, no partial fills
+	virtual OrderStatus orderStatus(long long id, const std::string& coin);
+	// Tickers and balances from one moment, shared until they change. The
+	// default asks info() for every coin held, so it knows no other prices.
+	virtual std::shared_ptr<const MarketSnapshot> snapshot();
+	// All open orders of the account; the default cannot list them
+	virtual std::vector<OpenOrder> openOrders();
+	// Gives an open order the price and amount of order and returns its
+	// new id; the default cancels it and places order anew.
+	virtual long long moveOrder(long long id, const Order& order);
+protected:
+	TradeApi() : m_clock(&Clock::system()) {}
+private:
+	Clock* m_clock;
 };
 
@@ -0,0 +1,87 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#pragma once
+
+#include <chrono>
+#include <initializer_list>
+#include <memory>
+#include <string>
+
+// One connection requests are sent over: HTTPS, or a recording of it
+class HttpConnection
+{
+public:
+	struct Header
+	{
+		const char* name;
+		const char* value;
+	};
+
+	// how the body of the last response is compressed
+	enum Encoding
+	{
+		IDENTITY,
+		GZIP,
+		DEFLATE
+	};
+
+	typedef std::chrono::steady_clock::time_point Deadline;
+
+	virtual ~HttpConnection() {}
+
+	// The returned body stays valid until the next request on this connection.
+	// A GET, or a POST marked idempotent, is sent again when a kept-alive
+	// connection turns out closed before any reply; any other POST fails
+	// then, since the server may have acted on it already.
+	virtual const std::string& get(const char* target, Deadline deadline = Deadline::max()) = 0;
+	virtual const std::string& post(const char* target, const std::string& body,
+		std::initializer_list<Header> headers, Deadline deadline = Deadline::max(),
+		bool idempotent = false) = 0;
+	virtual Encoding encoding() const = 0;
+};
+
+// Where PoloniexTradeApi gets its connections. A request leases one and
+// hands it back when done, so concurrent requests each get their own.
+class Transport
+{
+public:
+	class Lease
+	{
+	public:
+		Lease(Transport& transport, std::unique_ptr<HttpConnection> connection):
+			m_transport(&transport),
+			m_connection(std::move(connection))
+		{
+		}
+		Lease(Lease&& other):
+			m_transport(other.m_transport),
+			m_connection(std::move(other.m_connection))
+		{
+		}
+		~Lease()
+		{
+			if (m_connection)
+				m_transport->release(std::move(m_connection));
+		}
+
+		HttpConnection* operator->() const
+		{
+			return m_connection.get();
+		}
+	private:
+		Lease(const Lease&);
+		Lease& operator=(const Lease&);
+
+		Transport* m_transport;
+		std::unique_ptr<HttpConnection> m_connection;
+	};
+
+	virtual ~Transport() {}
+
+	virtual Lease acquire() = 0;
+	// see HttpsClient::set_compression()
+	virtual void set_compression(bool compression) = 0;
+protected:
+	// takes back a connection this transport leased
+	virtual void release(std::unique_ptr<HttpConnection> connection) = 0;
+};
@@ -0,0 +1,368 @@
+// Copyright (c) 2015 Scruffy Scruffington
+// Distributed under the Apache 2.0 software license, see the LICENSE file
+#include "Decimal.h"
+#include "TickerHistory.h"
+#include "HttpsClient.h"
+#include "InflateBuf.h"
+#include "Metrics.h"
+#include "MemoryProfile.h"
+#include "MarketSnapshot.h"
+#include "Portfolio.h"
+#include "SimulatedMarket.h"
+#include "IndexTargets.h"
+#include "TestServer.h"
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// keeps the optimizer from dropping the measured work
+static volatile double sink;
+
+// returns the heap allocations the work made
+template<class Work>
+static uint64_t measure(const char* name, size_t count, Work work)
+{
+	AllocationCounter counter;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	work();
+	double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+	printf("%-28s %8.1f ns/op %8.1f allocs/op\n", name, ns / count,
+		static_cast<double>(counter.allocations()) / count);
+	return counter.allocations();
+}
+
+static void decimal_bench()
+{
+	const size_t rounds = 200;
+	vector<string> texts;
+	for (int i = 0; i < 5000; ++i)
+		texts.push_back(Decimal::fromUnits(i * 7919LL + 1).str());
+	size_t count = rounds * texts.size();
+
+	measure("parse lexical_cast<double>", count, [&]()
+	{
+		double sum = 0;
+		for (size_t r = 0; r < rounds; ++r)
+			for (const string& t : texts)
+				sum += boost::lexical_cast<double>(t);
+		sink = sum;
+	});
+	measure("parse Decimal", count, [&]()
+	{
+		double sum = 0;
+		for (size_t r = 0; r < rounds; ++r)
+			for (const string& t : texts)
+				sum += Decimal::parse(t);
+		sink = sum;
+	});
+
+	vector<double> values;
+	for (const string& t : texts)
+		values.push_back(Decimal::parse(t));
+	measure("format lexical_cast<string>", count, [&]()
+	{
+		size_t length = 0;
+		for (size_t r = 0; r < rounds; ++r)
+			for (double v : values)
+				length += boost::lexical_cast<string>(v).size();
+		sink = static_cast<double>(length);
+	});
+	measure("format Decimal", count, [&]()
+	{
+		size_t length = 0;
+		char buffer[Decimal::maxLength];
+		for (size_t r = 0; r < rounds; ++r)
+			for (double v : values)
+				length += Decimal(v).format(buffer);
+		sink = static_cast<double>(length);
+	});
+}
+
+static void ticker_history_bench()
+{
+	const char* path = "bench_tickers.bin";
+	const size_t snapshots = 20000;
+	std::remove(path);
+	// a random walk of a few satoshis per download on 100 markets
+	mt19937 random(1);
+	uniform_int_distribution<int> step(-3, 3);
+	map<string, TradeApi::CoinInfo> tickers;
+	for (int i = 0; i < 100; ++i)
+	{
+		char coin[8];
+		snprintf(coin, sizeof(coin), "C%02d", i);
+		TradeApi::CoinInfo& ci = tickers[coin];
+		ci.coin = coin;
+		ci.buyPrice = Decimal::fromUnits(100000 + i * 1000);
+		ci.sellPrice = Decimal::fromUnits(100100 + i * 1000);
+		ci.lastPrice = Decimal::fromUnits(100050 + i * 1000);
+	}
+	vector<map<string, TradeApi::CoinInfo>> downloads;
+	for (size_t n = 0; n < 100; ++n)
+	{
+		for (auto& t : tickers)
+			for (Decimal* price : { &t.second.buyPrice, &t.second.sellPrice, &t.second.lastPrice })
+				*price = Decimal::fromUnits(price->units() + step(random));
+		downloads.push_back(tickers);
+	}
+
+	{
+		TickerRecorder recorder(path);
+		measure("record ticker snapshot", snapshots, [&]()
+		{
+			for (size_t n = 0; n < snapshots; ++n)
+				recorder.append(static_cast<time_t>(n * 60), downloads[n % downloads.size()]);
+		});
+	}
+	TickerHistoryReader reader(path);
+	measure("read ticker snapshot", snapshots, [&]()
+	{
+		int64_t sum = 0;
+		while (reader.next())
+			sum += reader.snapshot().tickers[0].lastPrice.units();
+		sink = static_cast<double>(sum);
+	});
+	measure("seek ticker history", 1000, [&]()
+	{
+		int64_t sum = 0;
+		for (int i = 0; i < 1000; ++i)
+		{
+			reader.seek(static_cast<time_t>((i * 7919 % snapshots) * 60));
+			if (reader.next())
+				sum += reader.snapshot().time;
+		}
+		sink = static_cast<double>(sum);
+	});
+	ifstream f(path, ios_base::binary | ios_base::ate);
+	printf("%-28s %8.1f bytes/snapshot (%u raw)\n", "ticker history size",
+		static_cast<double>(f.tellg()) / snapshots, 100 * (16 + 3 * 8));
+	std::remove(path);
+}
+
+// JSON read straight from a memory block
+struct MemoryBuf : std::streambuf
+{
+	MemoryBuf(const string& data)
+	{
+		char* p = const_cast<char*>(data.data());
+		setg(p, p, p + data.size());
+	}
+};
+
+static void compression_bench()
+{
+	const size_t rounds = 50;
+	string ticker = "{";
+	for (int i = 0; i < 2000; ++i)
+	{
+		char market[160];
+		snprintf(market, sizeof(market), "%s\"BTC_C%04d\":{\"last\":\"0.00%06d\",\"highestBid\":\"0.00%06d\","
+			"\"lowestAsk\":\"0.00%06d\"}", i ? "," : "", i, 1000 + i * 7, 990 + i * 7, 1010 + i * 7);
+		ticker += market;
+	}
+	ticker += "}";
+	const string gzipped = TestServer::compress(ticker, true);
+	TestServer server([&](const TestServer::Request& req, TestServer::Response& res)
+	{
+		if (req[boost::beast::http::field::accept_encoding].empty())
+			res.body() = ticker;
+		else
+		{
+			res.set(boost::beast::http::field::content_encoding, "gzip");
+			res.body() = gzipped;
+		}
+	});
+	Counter& received = Metrics::instance().counter("https_bytes_received_total",
+		Metrics::label("host", "127.0.0.1"));
+	for (bool compression : { false, true })
+	{
+		HttpsClient client("127.0.0.1", server.port());
+		client.set_compression(compression);
+		uint64_t before = received.value();
+		measure(compression ? "fetch ticker gzip" : "fetch ticker plain", rounds, [&]()
+		{
+			size_t markets = 0;
+			for (size_t r = 0; r < rounds; ++r)
+			{
+				const string& reply = client.get("/public?command=returnTicker");
+				boost::property_tree::ptree pt;
+				if (client.encoding() == HttpsClient::IDENTITY)
+				{
+					MemoryBuf buf(reply);
+					istream is(&buf);
+					read_json(is, pt);
+				}
+				else
+				{
+					InflateBuf buf(reply.data(), reply.size());
+					istream is(&buf);
+					read_json(is, pt);
+				}
+				markets += pt.size();
+			}
+			sink = static_cast<double>(markets);
+		});
+		printf("%-28s %8.1f bytes/fetch\n", "  on the wire",
+			static_cast<double>(received.value() - before) / rounds);
+	}
+	measure("inflate ticker", rounds, [&]()
+	{
+		size_t length = 0;
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			InflateBuf buf(gzipped.data(), gzipped.size());
+			istream is(&buf);
+			length += is.ignore(numeric_limits<streamsize>::max()).gcount();
+		}
+		sink = static_cast<double>(length);
+	});
+}
+
+static void portfolio_bench()
+{
+	const size_t steps = 20000;
+	vector<string> coins = { "BTC" };
+	for (int i = 0; i < 30; ++i)
+	{
+		char coin[8];
+		snprintf(coin, sizeof(coin), "C%02d", i);
+		coins.push_back(coin);
+	}
+	Portfolio p;
+	for (const string& coin : coins)
+		p.addCoin(coin, 1);
+	SimulatedMarket market(coins);
+	mt19937 random(1);
+	uniform_int_distribution<int64_t> units(90000, 110000);
+	// the prices of every step, the same for both runs
+	vector<int64_t> prices(steps * coins.size());
+	for (int64_t& price : prices)
+		price = units(random);
+	for (size_t i = 0; i < coins.size(); ++i)
+		market.set_balance(i, 10.0);
+	vector<TradeApi::Order> orders;
+	size_t placed = 0;
+
+	// what the live path does: a fresh snapshot of maps for every evaluation
+	measure("portfolio snapshot step", steps, [&]()
+	{
+		for (size_t s = 0; s < steps; ++s)
+		{
+			MarketSnapshot snapshot;
+			for (size_t i = 0; i < coins.size(); ++i)
+			{
+				snapshot.balances[coins[i]] = 10.0;
+				if (coins[i] == "BTC")
+					continue;
+				TradeApi::CoinInfo& ci = snapshot.tickers[coins[i]];
+				ci.coin = coins[i];
+				ci.buyPrice = ci.sellPrice = Decimal::fromUnits(prices[s * coins.size() + i]);
+			}
+			p.evaluate(snapshot, 0.05, true, orders);
+			placed += orders.size();
+		}
+	});
+	// the buffers have grown in the run above, so this one must not allocate
+	uint64_t allocations = measure("portfolio simulated step", steps, [&]()
+	{
+		for (size_t s = 0; s < steps; ++s)
+		{
+			for (size_t i = 0; i < coins.size(); ++i)
+			{
+				Decimal price = Decimal::fromUnits(prices[s * coins.size() + i]);
+				if (coins[i] != "BTC")
+					market.set_ticker(i, price, price);
+			}
+			p.evaluate(market, 0.05, true, orders);
+			placed -= orders.size();
+		}
+	});
+	// both runs must have placed the same orders
+	sink = static_cast<double>(placed);
+	if (placed)
+		printf("portfolio runs differ\n");
+	if (allocations)
+		printf("portfolio simulated step allocates\n");
+}
+
+static void index_bench()
+{
+	const size_t markets = 2000;
+	const size_t rounds = 1000;
+	map<string, TradeApi::CoinInfo> tickers;
+	for (size_t i = 0; i < markets; ++i)
+	{
+		char coin[8];
+		snprintf(coin, sizeof(coin), "C%04zu", i);
+		tickers[coin].coin = coin;
+	}
+	mt19937 random(1);
+	lognormal_distribution<double> volume(5.0, 2.0);
+	uniform_real_distribution<double> drift(0.8, 1.25);
+	vector<double> level(markets);
+	for (double& v : level)
+		v = volume(random);
+	// every round the volumes move around their level, as from one run to the next
+	vector<vector<Decimal>> volumes(rounds);
+	for (vector<Decimal>& round : volumes)
+		for (double v : level)
+			round.push_back(v * drift(random));
+	auto setRound = [&](size_t r)
+	{
+		size_t i = 0;
+		for (auto& t : tickers)
+			t.second.volume = volumes[r][i++];
+	};
+	size_t joined[2] = { 0, 0 };
+	for (size_t margin : { 0, 10 })
+	{
+		IndexTargets index(50, margin);
+		char name[40];
+		snprintf(name, sizeof(name), "index top 50/%zu margin %zu", markets, margin);
+		measure(name, rounds, [&]()
+		{
+			for (size_t r = 0; r < rounds; ++r)
+			{
+				setRound(r);
+				index.update(tickers);
+				joined[margin != 0] += index.joined();
+			}
+		});
+	}
+	// what a full sort of every market costs for the same selection
+	vector<pair<double, const string*>> all;
+	measure("index full sort", rounds, [&]()
+	{
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			setRound(r);
+			all.clear();
+			for (const auto& t : tickers)
+				all.push_back(make_pair(static_cast<double>(t.second.volume), &t.first));
+			sort(all.begin(), all.end(), greater<pair<double, const string*>>());
+			sink = all[49].first;
+		}
+	});
+	printf("  members joined             %8zu without margin, %zu with\n", joined[0], joined[1]);
+}
+
+int main()
+{
+	decimal_bench();
+	ticker_history_bench();
+	compression_bench();
+	portfolio_bench();
+	index_bench();
+	return 0;
+}
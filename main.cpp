@@ -5,15 +5,39 @@
 #include <iostream>
 #include <fstream>
 #include <chrono>
+#include <memory>
 #include "PoloniexTradeApi.h"
+#include "RecordedTransport.h"
 #include "Portfolio.h"
+#include "IndexTargets.h"
+#include "MarketSnapshot.h"
+#include "Metrics.h"
+#include "MemoryProfile.h"
 #include "Log.h"
 
 namespace po = boost::program_options;
 using namespace std;
 
+// writes the metrics and the memory profile, when asked for
+static void finish(const string& metricsFile)
+{
+	if (MemoryProfile::enabled())
+		MemoryProfile::report(cout);
+	if (metricsFile.empty())
+		return;
+	try
+	{
+		Metrics::instance().save(metricsFile);
+	}
+	catch (const exception& e)
+	{
+		cerr << e.what() << endl;
+	}
+}
+
 int main(int argc, char* argv[])
 {
+	string metricsFile;
 	try
 	{
 		Log::init();
@@ -24,10 +48,34 @@ int main(int argc, char* argv[])
 			("secret,s", po::value<string>(), "Poloniex API secret")
 			("coins,c", po::value< vector<string> >()->multitoken(), "Poloniex currency symbols, several values")
 			("parts,p", po::value< vector<double> >()->multitoken(), "Currency parts, several values")
+			("index", po::value<unsigned>(), "Hold the given number of BTC markets of the highest 24h volume instead of --coins and --parts")
+			("index-margin", po::value<unsigned>()->default_value(2), "Ranks past the index size a coin held may fall to before it is sold")
+			("index-weight", po::value<string>()->default_value("volume"), "Index parts by volume or equal")
+			("index-btc", po::value<double>()->default_value(5), "Part of the index portfolio kept in BTC, in percents")
+			("index-exclude", po::value< vector<string> >()->multitoken(), "Coins never in the index, besides USDT")
 			("threshold,t", po::value<double>(), "Threshold to align currency part, in percents")
 			("timeout", po::value<unsigned>(), "Order timeout in minutes")
 			("balancelog,b", po::value<string>(), "File to log current balance")
-			("orderlog,o", po::value<string>(), "File to log all orders operations");
+			("orderlog,o", po::value<string>(), "File to log all orders operations")
+			("snapshot", po::value<string>(), "File to cache tickers and balances between runs")
+			("snapshot-age", po::value<unsigned>()->default_value(60), "Maximum age of cached data to reuse, in seconds")
+			("shared-tickers", po::value<string>(), "Shared memory name to exchange tickers with other instances on this host")
+			("record-tickers", po::value<string>(), "File to append every ticker download to, delta compressed")
+			("order-state", po::value<string>(), "File remembering the orders placed, to keep fitting ones open across runs instead of cancelling all")
+			("rules", po::value<string>(), "File to keep the market rules learned from the exchange in")
+			("rules-age", po::value<unsigned>()->default_value(7 * 24 * 3600), "Maximum age of the kept market rules, in seconds")
+			("pair-spread", po::value<double>()->default_value(1), "Largest spread of a direct market between two coins to trade on, in percents; 0 trades through BTC only")
+			("report,r", "Only report balances, do not rebalance")
+			("metrics", po::value<string>(), "File to write metrics to at the end of the run")
+			("metrics-port", po::value<unsigned short>(), "Local port to serve metrics on while running")
+			("memory-profile", "Count allocations and peak memory by phase of the run and print them at the end")
+			("hedge", po::value<double>(), "Resend read requests slower than this latency quantile, e.g. 0.95")
+			("record", po::value<string>(), "File to record every exchange request and reply to")
+			("replay", po::value<string>(), "Recording to answer exchange requests from instead of the network")
+			("replay-timing", "Replay with the recorded latencies instead of at once")
+			("no-compression", "Do not ask the exchange for compressed replies")
+			("request-timeout", po::value<unsigned>()->default_value(30), "Time limit of every exchange request, in seconds")
+			("order-retries", po::value<unsigned>()->default_value(2), "Times to send an order again when its reply was lost and it was not placed");
 		po::variables_map vm;
 		po::store(po::parse_command_line(argc, argv, desc), vm);
 		po::notify(vm);
@@ -38,26 +86,80 @@ int main(int argc, char* argv[])
 			return 0;
 		}
 
+		if (vm.count("memory-profile"))
+			MemoryProfile::enable();
+		// the phase of the main thread, switched as the run goes on
+		unique_ptr<MemoryPhase> phase(new MemoryPhase("startup"));
+		if (vm.count("metrics"))
+			metricsFile = vm["metrics"].as<string>();
+		unique_ptr<MetricsServer> metricsServer;
+		if (vm.count("metrics-port"))
+			metricsServer.reset(new MetricsServer(vm["metrics-port"].as<unsigned short>()));
+
 		string key = vm["key"].as<string>();
 		string secret = vm["secret"].as<string>();
-		vector<string> coins = vm["coins"].as< vector<string> >();
-		vector<double> parts = vm["parts"].as< vector<double> >();
-		if (coins.size() != parts.size())
-			throw runtime_error("Coins number differs from parts number");
-		double threshold = vm["threshold"].as<double>();
-		unsigned timeout = vm["timeout"].as<unsigned>();
+		bool report = vm.count("report") > 0;
+		vector<string> coins;
+		vector<double> parts;
+		double threshold = 0.0;
+		unsigned timeout = 0;
+		bool index = vm.count("index") > 0;
+		if (!report)
+		{
+			if (!index)
+			{
+				coins = vm["coins"].as< vector<string> >();
+				parts = vm["parts"].as< vector<double> >();
+				if (coins.size() != parts.size())
+					throw runtime_error("Coins number differs from parts number");
+			}
+			threshold = vm["threshold"].as<double>();
+			timeout = vm["timeout"].as<unsigned>();
+		}
 
+        // an instant replay waits for nothing, order polling included
+        VirtualClock replayClock;
         PoloniexTradeApi trade(key, secret);
-        trade.cancelCurrentOrders();
-        map<string, double> bs = trade.nonZeroBalances();
-        map<string, double> btcbs = trade.nonZeroBalancesInBTC();
+        trade.set_timeout(chrono::seconds(vm["request-timeout"].as<unsigned>()));
+        trade.set_compression(!vm.count("no-compression"));
+        trade.set_order_retries(vm["order-retries"].as<unsigned>());
+        if (vm.count("record"))
+            trade.set_transport(make_shared<RecordingTransport>(trade.transport(), vm["record"].as<string>()));
+        if (vm.count("replay"))
+        {
+            bool timed = vm.count("replay-timing") > 0;
+            trade.set_transport(make_shared<ReplayTransport>(vm["replay"].as<string>(), timed));
+            if (!timed)
+                trade.set_clock(replayClock);
+        }
+        if (vm.count("hedge"))
+        {
+            HedgePolicy policy;
+            policy.enabled = true;
+            policy.quantile = vm["hedge"].as<double>();
+            trade.set_hedging(policy);
+        }
+        if (vm.count("snapshot"))
+            trade.set_snapshot(vm["snapshot"].as<string>(), vm["snapshot-age"].as<unsigned>());
+        if (vm.count("shared-tickers"))
+            trade.set_shared_tickers(vm["shared-tickers"].as<string>(), vm["snapshot-age"].as<unsigned>());
+        if (vm.count("record-tickers"))
+            trade.set_ticker_history(vm["record-tickers"].as<string>());
+        if (vm.count("rules"))
+            trade.set_rules(vm["rules"].as<string>(), vm["rules-age"].as<unsigned>());
+        bool reconcile = vm.count("order-state") > 0;
+        if (reconcile)
+            trade.set_order_state(vm["order-state"].as<string>());
+        trade.prefetch(!report && !reconcile, !report);
+        shared_ptr<const MarketSnapshot> market = trade.snapshot();
+        map<string, double> btcbs = market->balancesInBTC();
         double total = 0.0;
-        for (auto b : btcbs)
+        for (const auto& b : btcbs)
         {
-            cout << b.first << ": " << bs[b.first] << " (" << b.second << "BTC)" << std::endl;
+            cout << b.first << ": " << market->balance(b.first) << " (" << b.second << "BTC)" << std::endl;
             total += b.second;
         }
-        double usd_price = trade.info("USDT").lastPrice;
+        double usd_price = market->info("USDT").lastPrice;
         double usd_total = total / usd_price;
         cout << "Total: " << total << "BTC (" << usd_total << " USD)" << std::endl;
         if (vm.count("balancelog"))
@@ -69,22 +171,70 @@ int main(int argc, char* argv[])
             time_t ttp = chrono::system_clock::to_time_t(chrono::system_clock::now());
             fout << ttp << "," << total << "," << usd_total << endl;
         }
+        if (report)
+        {
+            finish(metricsFile);
+            return 0;
+        }
         Portfolio p;
-        for (unsigned i = 0; i < coins.size(); ++i)
-            p.addCoin(coins[i], parts[i]);
+        if (index)
+        {
+            double btcPart = vm["index-btc"].as<double>() / 100;
+            if (btcPart <= 0.0 || btcPart >= 1.0)
+                throw runtime_error("Index BTC part must be above 0 and below 100 percents");
+            unsigned size = vm["index"].as<unsigned>();
+            IndexTargets targets(size, vm["index-margin"].as<unsigned>());
+            string weight = vm["index-weight"].as<string>();
+            if (weight == "equal")
+                targets.set_weighting(IndexTargets::EQUAL);
+            else if (weight != "volume")
+                throw runtime_error("Unknown index weight " + weight);
+            targets.exclude("USDT");
+            if (vm.count("index-exclude"))
+                for (const string& coin : vm["index-exclude"].as< vector<string> >())
+                    targets.exclude(coin);
+            // the coins held are the members of the last run; dust worth
+            // less than a hundredth of an equal part is not
+            double dust = total * (1.0 - btcPart) / size / 100;
+            vector<string> held;
+            for (const auto& b : btcbs)
+                if (b.first != "BTC" && b.second > dust)
+                    held.push_back(b.first);
+            targets.set_members(held);
+            p.addCoin("BTC", btcPart);
+            for (const IndexTargets::Target& t : targets.update(market->tickers))
+            {
+                cout << "Index " << t.coin << ": " << t.part * 100 << "%" << endl;
+                p.addCoin(t.coin, t.part * (1.0 - btcPart));
+            }
+        }
+        else
+            for (unsigned i = 0; i < coins.size(); ++i)
+                p.addCoin(coins[i], parts[i]);
+        p.set_max_pair_spread(vm["pair-spread"].as<double>() / 100);
 
-        vector<TradeApi::Order> orders = p.checkCurrentState(trade, threshold);
-        if (!orders.size())
+        phase.reset();
+        phase.reset(new MemoryPhase("evaluation"));
+        vector<TradeApi::Order> orders = p.plan(trade, threshold);
+        if (!orders.size() && !reconcile)
+        {
+            finish(metricsFile);
             return 0;
+        }
 
         cout << "Execute " << orders.size() << " orders..." << endl;
         if (vm.count("orderlog"))
             trade.set_log(vm["orderlog"].as<string>());
+        phase.reset();
+        phase.reset(new MemoryPhase("execution"));
         trade.execute(orders, timeout);
+        phase.reset();
+        finish(metricsFile);
 	}
 	catch (const exception& e)
 	{
 		cerr << e.what() << endl;
+		finish(metricsFile);
 		system("pause");
 	}
 	return 0;
@@ -1,9 +1,46 @@
 #include "Portfolio.h"
+#include "MarketSnapshot.h"
 #include "TradeApi.h"
+#include "SnapshotCache.h"
+#include "SharedTickerCache.h"
+#include "TickerHistory.h"
+#include "HttpsClient.h"
+#include "RequestBuilder.h"
+#include "TestServer.h"
+#include "Metrics.h"
+#include "PoloniexTradeApi.h"
+#include "OrderExecutor.h"
+#include "ExecutionPlanner.h"
+#include "Reconciler.h"
+#include "OrderState.h"
+#include "MarketRules.h"
+#include "AsyncTradeApi.h"
+#include "CircuitBreaker.h"
+#include "Clock.h"
+#include "MarketPipeline.h"
+#include "SimulatedMarket.h"
+#include "RecordedTransport.h"
+#include "MemoryProfile.h"
+#include "IndexTargets.h"
+#include "SingleFlight.h"
+#include "HostResolver.h"
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE PortfolioTest
 #include <boost/test/unit_test.hpp>
 #include <boost/test/floating_point_comparison.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <tuple>
 
 using namespace std;
 
@@ -11,13 +48,13 @@ class TestTradeApi : public TradeApi
 {
 public:
 	void set(const map<std::string, CoinInfo>& tickers,
-		const map<std::string, double>& balances)
+		const map<std::string, Decimal>& balances)
 	{
 		m_tickers = tickers;
 		m_balances = balances;
 	}
 
-	virtual double balance(const string& coin)
+	virtual Decimal balance(const string& coin)
 	{
 		auto it = m_balances.find(coin);
 		if (it == m_balances.end())
@@ -27,6 +64,7 @@ public:
 
 	virtual CoinInfo info(const string& coin)
 	{
+		++infoCalls;
 		auto it = m_tickers.find(coin);
 		if (it == m_tickers.end())
 			return CoinInfo();
@@ -35,27 +73,20 @@ public:
 
 	virtual map<std::string, double> nonZeroBalancesInBTC()
 	{
-		map<std::string, double> balances;
-		for (auto b : m_balances)
-		{
-			if (b.second == 0.0)
-				continue;
-			if (b.first == "BTC")
-			{
-				balances[b.first] = b.second;
-			}
-			else
-			{
-				TradeApi::CoinInfo ci = m_tickers[b.first];
-				balances[b.first] = b.second * (ci.buyPrice + ci.sellPrice) / 2;
-			}
-		}
-		return balances;
+		return snapshot()->balancesInBTC();
+	}
+
+	virtual shared_ptr<const MarketSnapshot> snapshot()
+	{
+		shared_ptr<MarketSnapshot> s = make_shared<MarketSnapshot>();
+		s->tickers = m_tickers;
+		s->balances = m_balances;
+		return s;
 	}
 
-	virtual map<std::string, double> nonZeroBalances()
+	virtual map<std::string, Decimal> nonZeroBalances()
 	{
-		map<std::string, double> balances;
+		map<std::string, Decimal> balances;
 		for (auto b : m_balances)
 		{
 			if (b.second == 0.0)
@@ -65,40 +96,118 @@ public:
 		return balances;
 	}
 
-	virtual bool execute(const vector<Order>& orders, unsigned timeout)
+	virtual bool execute(const vector<Order>& /*orders*/, unsigned /*timeout*/)
 	{
 		return true;
 	}
 
+	// Orders hold their funds while open, like on the exchange. Every
+	// status check fills fillStep more of an open order, if set.
 	virtual long long createOrder(const Order& order)
 	{
-		return 0;
+		if (order.amount <= 0.0)
+			throw runtime_error("Invalid amount");
+		const string& held = (order.action == BUY) ? paid(order) : order.coin;
+		double amount = (order.action == BUY) ? order.amount * order.price : double(order.amount);
+		if (amount > m_balances[held] * (1 + 1e-9) + 1e-8)
+			throw runtime_error("Not enough " + held);
+		m_balances[held] = m_balances[held] - amount;
+		SimOrder& o = m_orders[++m_lastId];
+		o.order = order;
+		o.status.open = true;
+		return m_lastId;
 	}
 
     virtual void deleteOrder(long long id)
 	{
+		SimOrder& o = m_orders[id];
+		double left = 1.0 - o.status.filled;
+		if (o.order.action == BUY)
+			m_balances[paid(o.order)] = m_balances[paid(o.order)] + left * o.order.amount * o.order.price;
+		else
+			m_balances[o.order.coin] = m_balances[o.order.coin] + left * o.order.amount;
+		o.status.open = false;
+		cancelled.push_back(id);
 	}
 
 	virtual bool checkOrder(long long id, const string& coin)
 	{
-		return false;
+		return orderStatus(id, coin).open;
 	}
 
+	virtual OrderStatus orderStatus(long long id, const string& /*coin*/)
+	{
+		const OrderStatus& status = m_orders[id].status;
+		if (status.open && fillStep > 0)
+			fill(id, min(1.0, status.filled + fillStep));
+		return status;
+	}
+
+	// executes the given part of an open order
+	void fill(long long id, double filled)
+	{
+		SimOrder& o = m_orders[id];
+		double part = filled - o.status.filled;
+		if (o.order.action == BUY)
+			m_balances[o.order.coin] = m_balances[o.order.coin] + part * o.order.amount;
+		else
+			m_balances[paid(o.order)] = m_balances[paid(o.order)] + part * o.order.amount * o.order.price;
+		o.status.filled = filled;
+		o.status.open = filled < 1.0;
+	}
+
+	// open orders, those in foreign placed by hand
+	virtual vector<OpenOrder> openOrders()
+	{
+		vector<OpenOrder> res;
+		for (const auto& o : m_orders)
+		{
+			if (!o.second.status.open)
+				continue;
+			OpenOrder open;
+			open.id = o.first;
+			open.order = o.second.order;
+			open.order.amount = (1.0 - o.second.status.filled) * o.second.order.amount;
+			open.filled = o.second.status.filled;
+			open.own = !foreign.count(o.first);
+			res.push_back(open);
+		}
+		return res;
+	}
+
+	double fillStep = 0;
+	unsigned infoCalls = 0;
+	vector<long long> cancelled;
+	std::set<long long> foreign;
+
     virtual void cancelCurrentOrders()
     {
 
     }
 
 private:
+	static string paid(const Order& order)
+	{
+		return order.base.empty() ? "BTC" : order.base;
+	}
+
 	map<string, CoinInfo> m_tickers;
-	map<string, double> m_balances;
+	map<string, Decimal> m_balances;
+	struct SimOrder
+	{
+		Order order;
+		OrderStatus status;
+	};
+
+	map<long long, SimOrder> m_orders;
+	long long m_lastId = 0;
 };
 
 struct TradeFixture1
 {
 	TradeFixture1()
 	{
-		map<string, double> balances;
+		map<string, Decimal> balances;
 		balances["BTC"] = 0.5;
 		map<string, TradeApi::CoinInfo> tickers;
 		TradeApi::CoinInfo ci;
@@ -117,7 +226,7 @@ struct TradeFixture2
 {
 	TradeFixture2()
 	{
-		map<string, double> balances;
+		map<string, Decimal> balances;
 		balances["BTC"] = 0.21352728;
 		balances["BBR"] = 1265.05127482;
 		balances["ETH"] = 2.53003383;
@@ -155,7 +264,7 @@ struct TradeFixture3
 {
 	TradeFixture3()
 	{
-		map<string, double> balances;
+		map<string, Decimal> balances;
 		balances["BBR"] = 1000.0;
 		map<string, TradeApi::CoinInfo> tickers;
 		TradeApi::CoinInfo ci;
@@ -195,15 +304,15 @@ BOOST_FIXTURE_TEST_CASE(one_coin_cases, TradeFixture1)
 	BOOST_CHECK(o.size() == 1);
 	BOOST_CHECK(o[0].action == TradeApi::BUY);
 	BOOST_CHECK(o[0].coin == "BBR");
-	BOOST_CHECK_CLOSE(o[0].price, 0.077, 0.001);
-	BOOST_CHECK_CLOSE(o[0].amount, 0.5 / 0.077, 0.001);
+	BOOST_CHECK_CLOSE(double(o[0].price), 0.077, 0.001);
+	BOOST_CHECK_CLOSE(double(o[0].amount), 0.5 / 0.077, 0.001);
 	p.addCoin("BTC", 1);
 	o = p.checkCurrentState(trade, 0.1);
 	BOOST_CHECK(o.size() == 1);
 	BOOST_CHECK(o[0].action == TradeApi::BUY);
 	BOOST_CHECK(o[0].coin == "BBR");
-	BOOST_CHECK_CLOSE(o[0].price, 0.077, 0.001);
-	BOOST_CHECK_CLOSE(o[0].amount, 0.25 / 0.077, 0.001);
+	BOOST_CHECK_CLOSE(double(o[0].price), 0.077, 0.001);
+	BOOST_CHECK_CLOSE(double(o[0].amount), 0.25 / 0.077, 0.001);
 }
 
 BOOST_FIXTURE_TEST_CASE(many_coin_cases, TradeFixture2)
@@ -221,26 +330,26 @@ BOOST_FIXTURE_TEST_CASE(many_coin_cases, TradeFixture2)
 		if (o.coin == "BBR")
 		{
 			BOOST_CHECK(o.action == TradeApi::SELL);
-			BOOST_CHECK_CLOSE(o.price, 0.00006474, 0.01);
-			BOOST_CHECK_CLOSE(o.amount, 612.54, 0.01);
+			BOOST_CHECK_CLOSE(double(o.price), 0.00006474, 0.01);
+			BOOST_CHECK_CLOSE(double(o.amount), 612.54, 0.01);
 		}
 		if (o.coin == "ETH")
 		{
 			BOOST_CHECK(o.action == TradeApi::BUY);
-			BOOST_CHECK_CLOSE(o.price, 0.004715, 0.01);
-			BOOST_CHECK_CLOSE(o.amount, 6.43, 0.01);
+			BOOST_CHECK_CLOSE(double(o.price), 0.004715, 0.01);
+			BOOST_CHECK_CLOSE(double(o.amount), 6.43, 0.01);
 		}
 		if (o.coin == "NXT")
 		{
 			BOOST_CHECK(o.action == TradeApi::BUY);
-			BOOST_CHECK_CLOSE(o.price, 0.00003501, 0.01);
-			BOOST_CHECK_CLOSE(o.amount, 876.08, 0.01);
+			BOOST_CHECK_CLOSE(double(o.price), 0.00003501, 0.01);
+			BOOST_CHECK_CLOSE(double(o.amount), 876.08, 0.01);
 		}
 		if (o.coin == "XMR")
 		{
 			BOOST_CHECK(o.action == TradeApi::BUY);
-			BOOST_CHECK_CLOSE(o.price, 0.00231775, 0.01);
-			BOOST_CHECK_CLOSE(o.amount, 10.02, 0.01);
+			BOOST_CHECK_CLOSE(double(o.price), 0.00231775, 0.01);
+			BOOST_CHECK_CLOSE(double(o.amount), 10.02, 0.01);
 		}
 	}
 }
@@ -259,4 +368,2048 @@ BOOST_FIXTURE_TEST_CASE(completed_cases, TradeFixture3)
 	BOOST_CHECK(o[0].action == TradeApi::SELL);
 }
 
+BOOST_FIXTURE_TEST_CASE(metrics_cases, TradeFixture2)
+{
+	Metrics& m = Metrics::instance();
+	m.counter("test_requests_total", Metrics::label("command", "buy")).inc(2);
+	BOOST_CHECK_EQUAL(m.counter("test_requests_total", Metrics::label("command", "buy")).value(), 2u);
+	Histogram& h = m.histogram("test_duration_seconds", "", { 1.0, 2.0, 4.0 });
+	for (int i = 0; i < 100; ++i)
+		h.observe(i < 50 ? 0.5 : 1.5);
+	BOOST_CHECK_EQUAL(h.count(), 100u);
+	BOOST_CHECK_CLOSE(h.sum(), 100.0, 0.001);
+	BOOST_CHECK_CLOSE(h.quantile(0.5), 1.0, 0.001);
+	BOOST_CHECK_CLOSE(h.quantile(0.75), 1.5, 0.001);
+	BOOST_CHECK_THROW(m.gauge("test_requests_total"), logic_error);
+
+	Portfolio p;
+	p.addCoin("BBR", 1);
+	p.addCoin("BTC", 1);
+	p.checkCurrentState(trade, 0.1);
+	ostringstream out;
+	m.write(out);
+	string text = out.str();
+	BOOST_CHECK(text.find("# TYPE test_requests_total counter\ntest_requests_total{command=\"buy\"} 2\n") != string::npos);
+	BOOST_CHECK(text.find("test_duration_seconds_bucket{le=\"1\"} 50\n") != string::npos);
+	BOOST_CHECK(text.find("test_duration_seconds_bucket{le=\"+Inf\"} 100\n") != string::npos);
+	BOOST_CHECK(text.find("portfolio_drift{coin=\"ETH\"}") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_cache_cases)
+{
+	SnapshotCache::Snapshot s;
+	TradeApi::CoinInfo ci;
+	ci.coin = "BBR";
+	ci.buyPrice = 0.00006251;
+	ci.sellPrice = 0.00006697;
+	ci.lastPrice = 0.00006251;
+	ci.volume = 125.5;
+	s.tickers["BBR"] = ci;
+	TradeApi::CoinInfo& usdt = s.tickers["USDT"];
+	usdt.coin = "USDT";
+	usdt.rate = Decimal::parse("71235.49999999");
+	s.balances["BTC"] = 0.21352728;
+	s.tickersTime = 1000;
+	s.balancesTime = 2000;
+	SnapshotCache("snapshot_test.bin", "key1").save(s);
+
+	SnapshotCache::Snapshot r;
+	BOOST_REQUIRE(SnapshotCache("snapshot_test.bin", "key1").load(r));
+	BOOST_REQUIRE(r.tickers.size() == 2);
+	BOOST_CHECK(r.tickers["BBR"].coin == "BBR");
+	BOOST_CHECK_EQUAL(r.tickers["USDT"].rate, usdt.rate);
+	BOOST_CHECK(r.tickers["BBR"].sellPrice == 0.00006697);
+	BOOST_CHECK(r.tickers["BBR"].volume == 125.5);
+	BOOST_CHECK(r.balances["BTC"] == 0.21352728);
+	BOOST_CHECK(r.tickersTime == 1000);
+	BOOST_CHECK(r.balancesTime == 2000);
+
+	// balances of another account are not reused
+	BOOST_REQUIRE(SnapshotCache("snapshot_test.bin", "key2").load(r));
+	BOOST_CHECK(r.tickers.size() == 2);
+	BOOST_CHECK(r.balances.empty());
+	BOOST_CHECK(r.balancesTime == 0);
+
+	BOOST_CHECK(!SnapshotCache("snapshot_missing.bin", "key1").load(r));
+	std::remove("snapshot_test.bin");
+
+	// a rebalancing run plans from the snapshot while the tickers download
+	// again, and places its orders at the new prices
+	string rate, amount;
+	TestServer server([&](const TestServer::Request& req, TestServer::Response& res)
+	{
+		const string& body = req.body();
+		if (req.target() == "/public?command=returnTicker")
+			res.body() = "{\"BTC_ETH\":{\"last\":\"0.0057\",\"highestBid\":\"0.0056\",\"lowestAsk\":\"0.0058\"}}";
+		else if (body.find("command=buy") != string::npos)
+		{
+			size_t from = body.find("rate=") + 5;
+			rate = body.substr(from, body.find('&', from) - from);
+			from = body.find("amount=") + 7;
+			amount = body.substr(from, body.find('&', from) - from);
+			res.body() = "{\"orderNumber\":\"1\"}";
+		}
+		else
+			res.body() = "{}";
+	});
+	server.set_latency([]() { return chrono::milliseconds(200); });
+	ci.coin = "ETH";
+	ci.buyPrice = 0.0046;
+	ci.sellPrice = 0.0048;
+	s.tickers.clear();
+	s.tickers["ETH"] = ci;
+	s.tickersTime = s.balancesTime = time(0);
+	SnapshotCache("snapshot_test.bin", "key1").save(s);
+	PoloniexTradeApi trade("key1", "secret", "127.0.0.1", server.port());
+	trade.set_snapshot("snapshot_test.bin", 60);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	trade.prefetch(false, true);
+	BOOST_CHECK_EQUAL(trade.snapshot()->info("ETH").buyPrice.str(), "0.0046");
+	BOOST_CHECK(chrono::steady_clock::now() - start < chrono::milliseconds(150));
+	TradeApi::Order o;
+	o.coin = "ETH";
+	o.amount = 1.0;
+	o.price = 0.0047;
+	trade.execute(vector<TradeApi::Order>(1, o), 0);
+	BOOST_CHECK_EQUAL(rate, "0.0057");
+	BOOST_CHECK_EQUAL(amount, "0.8245614");
+	BOOST_CHECK_EQUAL(trade.info("ETH").buyPrice.str(), "0.0056");
+	std::remove("snapshot_test.bin");
+}
+
+BOOST_AUTO_TEST_CASE(request_allocation_cases)
+{
+	TestServer server([](const TestServer::Request&, TestServer::Response& res)
+	{
+		res.body() = "{\"BTC\":\"0.50000000\",\"ETH\":\"2.53003383\"}";
+	});
+	HttpsClient client("127.0.0.1", server.port());
+	string body;
+	string reply;
+	for (int i = 0; i < 10; ++i)
+	{
+		AllocationCounter counter;
+		{
+			RequestParams params;
+			params.add("command", "buy");
+			params.add("currencyPair", "BTC_ETH");
+			params.add("rate", 0.00470002);
+			params.add("amount", 6.43);
+			params.write(body, 1500000000ULL + i);
+			char sign[129];
+			signRequest("secret", body, sign);
+			const string& r = client.post("/tradingApi", body,
+				{ { "Key", "key" }, { "Sign", sign } });
+			reply.assign(r);
+		}
+		// the first requests size the buffers, later ones reuse them
+		if (i >= 2)
+			BOOST_CHECK_EQUAL(counter.allocations(), 0u);
+	}
+	BOOST_CHECK(reply == "{\"BTC\":\"0.50000000\",\"ETH\":\"2.53003383\"}");
+	BOOST_CHECK(body.find("nonce=1500000009&command=buy&currencyPair=BTC_ETH&rate=") == 0);
+	BOOST_CHECK_EQUAL(server.requests(), 10u);
+
+	char sign[129];
+	signRequest("secret", "nonce=1", sign);
+	BOOST_CHECK_EQUAL(strlen(sign), 128u);
+}
+
+static double percentile(vector<double> v, double q)
+{
+	sort(v.begin(), v.end());
+	return v[static_cast<size_t>(q * (v.size() - 1))];
+}
+
+BOOST_AUTO_TEST_CASE(hedged_request_cases)
+{
+	TestServer server([](const TestServer::Request&, TestServer::Response& res)
+	{
+		res.body() = "{}";
+	});
+	// every tenth response stalls
+	atomic<unsigned> served(0);
+	server.set_latency([&served]()
+	{
+		return chrono::milliseconds((++served % 10 == 0) ? 300 : 1);
+	});
+
+	vector<double> plain, hedged;
+	for (int hedge = 0; hedge < 2; ++hedge)
+	{
+		PoloniexTradeApi trade("key", "secret", "127.0.0.1", server.port());
+		HedgePolicy policy;
+		policy.enabled = hedge != 0;
+		policy.quantile = 0.8;
+		policy.minDelay = chrono::milliseconds(20);
+		policy.minSamples = 10;
+		trade.set_hedging(policy);
+		vector<double>& latencies = hedge ? hedged : plain;
+		for (int i = 0; i < 60; ++i)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			trade.getCurrentOrders();
+			latencies.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		}
+	}
+	BOOST_TEST_MESSAGE("without hedging: p50 " << percentile(plain, 0.5) << "s, p99 " << percentile(plain, 0.99) << "s");
+	BOOST_TEST_MESSAGE("with hedging: p50 " << percentile(hedged, 0.5) << "s, p99 " << percentile(hedged, 0.99) << "s");
+	BOOST_CHECK(percentile(plain, 0.99) >= 0.3);
+	BOOST_CHECK(percentile(hedged, 0.99) < 0.15);
+	BOOST_CHECK(Metrics::instance().counter("poloniex_hedge_wins_total",
+		Metrics::label("command", "returnOpenOrders")).value() > 0);
+
+	// attempts run on reused threads, and the slower ones still running
+	// are waited for when the workers go instead of left behind
+	atomic<int> made(0), finished(0);
+	{
+		HedgeWorkers workers;
+		for (int i = 0; i < 20; ++i)
+		{
+			bool hedgeSent = false, hedgeWon = false;
+			int winner = ::hedged<int>(workers, [&made, &finished]()
+			{
+				int n = made++;
+				return std::function<int()>([&finished, n]()
+				{
+					this_thread::sleep_for(chrono::milliseconds((n % 2) ? 0 : 20));
+					++finished;
+					return n;
+				});
+			}, chrono::milliseconds(5), hedgeSent, hedgeWon);
+			BOOST_CHECK(hedgeSent && hedgeWon);
+			BOOST_CHECK_EQUAL(winner % 2, 1);
+		}
+		BOOST_CHECK(workers.threads() < 10u);
+	}
+	BOOST_CHECK_EQUAL(finished, 40);
+
+	// the nonce error of an attempt overtaken by its hedge does not win
+	atomic<unsigned> answered(0);
+	TestServer overtaken([&answered](const TestServer::Request&, TestServer::Response& res)
+	{
+		if (++answered == 1)
+			res.body() = "{\"error\":\"Nonce must be greater than 2.\"}";
+		else
+			res.body() = "{\"BTC_ETH\":[{\"orderNumber\":\"42\",\"type\":\"buy\",\"rate\":\"0.0047\","
+				"\"amount\":\"1\",\"startingAmount\":\"1\"}]}";
+	});
+	atomic<unsigned> started(0);
+	overtaken.set_latency([&started]()
+	{
+		return chrono::milliseconds((++started == 1) ? 50 : 150);
+	});
+	PoloniexTradeApi trade("key", "secret", "127.0.0.1", overtaken.port());
+	HedgePolicy policy;
+	policy.enabled = true;
+	policy.initialDelay = chrono::milliseconds(20);
+	trade.set_hedging(policy);
+	BOOST_CHECK_EQUAL(trade.openOrders().size(), 1u);
+	BOOST_CHECK_EQUAL(answered, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(request_timeout_cases)
+{
+	TestServer server([](const TestServer::Request&, TestServer::Response& res)
+	{
+		res.body() = "{}";
+	});
+	server.set_silent(true);
+
+	HttpsClient client("127.0.0.1", server.port());
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	try
+	{
+		client.get("/public?command=returnTicker", start + chrono::milliseconds(200));
+		BOOST_ERROR("request to a silent server returned");
+	}
+	catch (const boost::system::system_error& e)
+	{
+		BOOST_CHECK(e.code() == boost::asio::error::timed_out);
+	}
+	BOOST_CHECK(chrono::steady_clock::now() - start < chrono::seconds(1));
+
+	PoloniexTradeApi trade("key", "secret", "127.0.0.1", server.port());
+	trade.set_timeout(chrono::milliseconds(100));
+	trade.set_circuit_breaker(2, chrono::milliseconds(300));
+	BOOST_CHECK_THROW(trade.getCurrentOrders(), boost::system::system_error);
+	BOOST_CHECK_THROW(trade.getCurrentOrders(), boost::system::system_error);
+	// the circuit is open: no connection is even attempted
+	start = chrono::steady_clock::now();
+	BOOST_CHECK_THROW(trade.getCurrentOrders(), CircuitOpenError);
+	BOOST_CHECK(chrono::steady_clock::now() - start < chrono::milliseconds(50));
+	BOOST_CHECK_EQUAL(server.requests(), 0u);
+
+	// once the cooldown has passed a probe closes the circuit again
+	server.set_silent(false);
+	this_thread::sleep_for(chrono::milliseconds(350));
+	BOOST_CHECK(trade.getCurrentOrders().empty());
+	BOOST_CHECK(trade.getCurrentOrders().empty());
+	BOOST_CHECK_EQUAL(server.requests(), 2u);
+	BOOST_CHECK_EQUAL(Metrics::instance().gauge("circuit_breaker_state",
+		Metrics::label("host", "127.0.0.1")).value(), CircuitBreaker::CLOSED);
+}
+
+BOOST_AUTO_TEST_CASE(startup_prefetch_cases)
+{
+	TestServer server([](const TestServer::Request& req, TestServer::Response& res)
+	{
+		if (req.target() == "/public?command=returnTicker")
+			res.body() = "{\"BTC_ETH\":{\"last\":\"0.0047\",\"highestBid\":\"0.0046\",\"lowestAsk\":\"0.0048\",\"baseVolume\":\"812.5\"},"
+				"\"USDT_BTC\":{\"last\":\"6400\",\"highestBid\":\"6390\",\"lowestAsk\":\"6410\",\"baseVolume\":\"64000000\",\"quoteVolume\":\"10000\"}}";
+		else if (req.body().find("command=returnBalances") != string::npos)
+			res.body() = "{\"BTC\":\"0.50000000\",\"ETH\":\"10.00000000\"}";
+		else
+			res.body() = "{}";
+	});
+	server.set_latency([]() { return chrono::milliseconds(200); });
+
+	PoloniexTradeApi trade("key", "secret", "127.0.0.1", server.port());
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	trade.prefetch(true);
+	map<string, double> btc = trade.nonZeroBalancesInBTC();
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	BOOST_TEST_MESSAGE("startup: " << elapsed.count() << "s");
+	// open orders and then balances, with the ticker downloaded alongside
+	BOOST_CHECK(elapsed < chrono::milliseconds(550));
+	BOOST_CHECK_EQUAL(server.requests(), 3u);
+	BOOST_CHECK_EQUAL(btc.size(), 2u);
+	BOOST_CHECK_CLOSE(btc["ETH"], 0.047, 1e-6);
+	BOOST_CHECK_CLOSE(double(trade.info("USDT").lastPrice), 1.0 / 6400, 1e-6);
+	// 24h volumes in BTC
+	BOOST_CHECK_EQUAL(trade.info("ETH").volume, 812.5);
+	BOOST_CHECK_EQUAL(trade.info("USDT").volume, 10000.0);
+}
+
+BOOST_AUTO_TEST_CASE(usdt_rate_cases)
+{
+	string rate;
+	TestServer server([&rate](const TestServer::Request& req, TestServer::Response& res)
+	{
+		const string& body = req.body();
+		if (req.target() == "/public?command=returnTicker")
+			res.body() = "{\"USDT_BTC\":{\"last\":\"71234.56789012\",\"highestBid\":\"71230.12345678\","
+				"\"lowestAsk\":\"71240.87654321\"},"
+				"\"BTC_DEAD\":{\"last\":\"0\",\"highestBid\":\"0\",\"lowestAsk\":\"0\"}}";
+		else if (body.find("command=buy") != string::npos || body.find("command=sell") != string::npos)
+		{
+			size_t from = body.find("rate=") + 5;
+			rate = body.substr(from, body.find('&', from) - from);
+			res.body() = "{\"orderNumber\":\"1\"}";
+		}
+		else
+			res.body() = "{}";
+	});
+	PoloniexTradeApi trade("key", "secret", "127.0.0.1", server.port());
+	TradeApi::CoinInfo usdt = trade.info("USDT");
+	BOOST_CHECK_EQUAL(usdt.rate, Decimal::parse("71235.49999999"));
+	// the inverse keeps few digits, the rate sent is the one quoted
+	TradeApi::Order o;
+	o.coin = "USDT";
+	o.amount = 1000.0;
+	o.action = TradeApi::SELL;
+	o.price = (usdt.buyPrice + usdt.sellPrice) / 2;
+	o.rate = usdt.rate;
+	trade.createOrder(o);
+	BOOST_CHECK_EQUAL(rate, "71235.49999999");
+	// a price changed since goes at its inverse
+	o.price = 1.0 / 60000;
+	trade.createOrder(o);
+	BOOST_CHECK_CLOSE(stod(rate), 60000.0, 0.1);
+
+	// planned orders carry the rate
+	MarketSnapshot usdtMarket;
+	usdtMarket.tickers["USDT"] = usdt;
+	usdtMarket.balances["BTC"] = 1.0;
+	Portfolio stable;
+	stable.addCoin("BTC", 0.5);
+	stable.addCoin("USDT", 0.5);
+	vector<TradeApi::Order> planned = stable.checkCurrentState(usdtMarket, 0.05);
+	BOOST_REQUIRE_EQUAL(planned.size(), 1u);
+	BOOST_CHECK_EQUAL(planned[0].rate, usdt.rate);
+
+	// a market without quotes is not traded, rather than failing the plan
+	MarketSnapshot market;
+	market.tickers["DEAD"] = trade.info("DEAD");
+	market.balances["BTC"] = 1.0;
+	Portfolio p;
+	p.addCoin("BTC", 0.5);
+	p.addCoin("DEAD", 0.5);
+	BOOST_CHECK(p.checkCurrentState(market, 0.05).empty());
+	BOOST_CHECK(!p.completed());
+}
+
+BOOST_FIXTURE_TEST_CASE(order_executor_cases, TradeFixture2)
+{
+	vector<TradeApi::Order> orders(3);
+	orders[0].coin = "ETH";
+	orders[0].amount = 1.0;
+	orders[1].coin = "XMR";
+	orders[1].amount = 2.0;
+	orders[2].coin = "NXT";
+	vector<TradeApi::OrderEvent> events;
+	OrderExecutor executor(trade, [&](const TradeApi::OrderEvent& e)
+	{
+		events.push_back(e);
+		// the first order fills in two steps, the second never does
+		if (e.index == 0 && e.type == TradeApi::OrderEvent::PLACED)
+			trade.fill(e.id, 0.5);
+		else if (e.index == 0 && e.type == TradeApi::OrderEvent::PARTIALLY_FILLED)
+			trade.fill(e.id, 1.0);
+	});
+	executor.set_poll_interval(chrono::milliseconds(10));
+	BOOST_CHECK(executor.run(orders, chrono::milliseconds(100)));
+
+	vector<pair<size_t, TradeApi::OrderEvent::Type>> seen;
+	for (const TradeApi::OrderEvent& e : events)
+		seen.push_back(make_pair(e.index, e.type));
+	vector<pair<size_t, TradeApi::OrderEvent::Type>> expected = {
+		{ 0, TradeApi::OrderEvent::PLACED },
+		{ 1, TradeApi::OrderEvent::PLACED },
+		{ 2, TradeApi::OrderEvent::FAILED },
+		{ 0, TradeApi::OrderEvent::PARTIALLY_FILLED },
+		{ 0, TradeApi::OrderEvent::FILLED },
+		{ 1, TradeApi::OrderEvent::CANCELLED } };
+	BOOST_CHECK(seen == expected);
+	BOOST_CHECK_EQUAL(events[2].error, "Invalid amount");
+	BOOST_CHECK_CLOSE(events[3].filled, 0.5, 1e-9);
+	BOOST_REQUIRE_EQUAL(trade.cancelled.size(), 1u);
+	BOOST_CHECK_EQUAL(trade.cancelled[0], events[1].id);
+
+	// both adapters stacked still give the portfolio the same orders
+	Portfolio direct, stacked;
+	direct.addCoin("BTC", 1);
+	direct.addCoin("ETH", 1);
+	stacked.addCoin("BTC", 1);
+	stacked.addCoin("ETH", 1);
+	AsyncTradeApiAdapter async(trade);
+	BlockingTradeApiAdapter blocking(async);
+	future<TradeApi::CoinInfo> eth = async.info("ETH");
+	future<Decimal> btc = async.balance("BTC");
+	BOOST_CHECK_CLOSE(double(eth.get().buyPrice), 0.00470002, 1e-9);
+	BOOST_CHECK_CLOSE(double(btc.get()), 0.21352728, 1e-9);
+	vector<TradeApi::Order> a = direct.checkCurrentState(trade, 10);
+	vector<TradeApi::Order> b = stacked.checkCurrentState(blocking, 10);
+	BOOST_REQUIRE_EQUAL(a.size(), b.size());
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		BOOST_CHECK_EQUAL(a[i].coin, b[i].coin);
+		BOOST_CHECK_EQUAL(a[i].amount, b[i].amount);
+	}
+	BOOST_CHECK_THROW(async.createOrder(TradeApi::Order()).get(), runtime_error);
+
+	// the adapter's snapshot knows only the coins held, a new one is
+	// priced by info()
+	shared_ptr<const MarketSnapshot> held = trade.snapshot();
+	map<string, TradeApi::CoinInfo> tickers = held->tickers;
+	TradeApi::CoinInfo& ltc = tickers["LTC"];
+	ltc.coin = "LTC";
+	ltc.buyPrice = 0.0099;
+	ltc.sellPrice = 0.0101;
+	ltc.lastPrice = 0.01;
+	trade.set(tickers, held->balances);
+	BOOST_CHECK(!blocking.snapshot()->ticker("LTC"));
+	Portfolio newCoin;
+	newCoin.addCoin("BTC", 1);
+	newCoin.addCoin("LTC", 1);
+	size_t ltcBuys = 0;
+	for (const TradeApi::Order& o : newCoin.plan(blocking, 0.1))
+		if (o.coin == "LTC")
+		{
+			++ltcBuys;
+			BOOST_CHECK(o.action == TradeApi::BUY);
+			BOOST_CHECK_CLOSE(double(o.price), 0.01, 1e-9);
+		}
+	BOOST_CHECK_EQUAL(ltcBuys, 1u);
+
+	// calls run on one thread in the order they were made, so an order
+	// never goes out before the cancelling asked for ahead of it
+	struct Recording : TestTradeApi
+	{
+		vector<string> calls;
+		std::set<thread::id> threads;
+		virtual void cancelCurrentOrders()
+		{
+			this_thread::sleep_for(chrono::milliseconds(2));
+			calls.push_back("cancel");
+			threads.insert(this_thread::get_id());
+		}
+		virtual long long createOrder(const Order&)
+		{
+			calls.push_back("create");
+			threads.insert(this_thread::get_id());
+			return 0;
+		}
+	} recording;
+	vector<future<void>> cancels;
+	vector<future<long long>> creates;
+	{
+		AsyncTradeApiAdapter ordered(recording);
+		for (int i = 0; i < 10; ++i)
+		{
+			cancels.push_back(ordered.cancelCurrentOrders());
+			creates.push_back(ordered.createOrder(TradeApi::Order()));
+		}
+	}
+	BOOST_REQUIRE_EQUAL(recording.calls.size(), 20u);
+	for (size_t i = 0; i < recording.calls.size(); ++i)
+		BOOST_CHECK_EQUAL(recording.calls[i], (i % 2) ? "create" : "cancel");
+	BOOST_CHECK_EQUAL(recording.threads.size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(decimal_cases)
+{
+	const char* exact[] = { "0", "1", "0.00470002", "1265.05127482", "-0.5",
+		"0.00000001", "92233720368.54775807" };
+	for (const char* text : exact)
+		BOOST_CHECK_EQUAL(Decimal::parse(text).str(), text);
+
+	BOOST_CHECK_EQUAL(Decimal::parse("1e-05").str(), "0.00001");
+	BOOST_CHECK_EQUAL(Decimal::parse("2.50000000").str(), "2.5");
+	BOOST_CHECK_EQUAL(Decimal::parse("0.000000005").units(), 1);
+	BOOST_CHECK_EQUAL(Decimal::parse("-0.000000015").units(), -2);
+	BOOST_CHECK_EQUAL(Decimal::parse(".5").units(), 50000000);
+	BOOST_CHECK_EQUAL(Decimal(1e-05).str(), "0.00001");
+	BOOST_CHECK_EQUAL(Decimal(0.1 + 0.2).str(), "0.3");
+	BOOST_CHECK_EQUAL(Decimal(6.43).units(), 643000000);
+	BOOST_CHECK(Decimal::parse("0.00470002") == 0.00470002);
+
+	Decimal d;
+	const char* bad[] = { "", "-", ".", "abc", "1.2.3", "1e", "0x10", "1e20" };
+	for (const char* text : bad)
+		BOOST_CHECK(!Decimal::parse(text, text + strlen(text), d));
+	BOOST_CHECK_THROW(Decimal::parse(string("1,5")), runtime_error);
+	BOOST_CHECK_THROW(Decimal(1.0 / 0.0), range_error);
+
+	string body;
+	RequestParams params;
+	params.add("rate", 0.00001);
+	params.add("amount", Decimal::parse("12.30000000"));
+	params.write(body, 1);
+	BOOST_CHECK_EQUAL(body, "nonce=1&rate=0.00001&amount=12.3");
+}
+
+BOOST_FIXTURE_TEST_CASE(execution_planner_cases, TradeFixture3)
+{
+	// all BTC for the buys has to come from selling BBR
+	Portfolio p;
+	p.addCoin("BBR", 1);
+	p.addCoin("XMR", 1);
+	p.addCoin("ETH", 1);
+	p.addCoin("NXT", 1);
+	vector<TradeApi::Order> orders = p.plan(trade, 0.1);
+	BOOST_REQUIRE_EQUAL(orders.size(), 4u);
+	p.checkCurrentState(trade, 0.1);
+	BOOST_CHECK(!p.completed());
+
+	trade.fillStep = 0.25;
+	vector<TradeApi::OrderEvent> events;
+	ExecutionPlanner planner(trade, [&events](const TradeApi::OrderEvent& e) { events.push_back(e); });
+	planner.set_poll_interval(chrono::milliseconds(1));
+	planner.set_fee(0);
+	BOOST_CHECK(!planner.run(orders, trade.balance("BTC"), chrono::seconds(5)));
+
+	// the first buy goes out on a partial fill of the sell
+	size_t sellFilled = events.size(), firstBuy = events.size(), filled = 0;
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		const TradeApi::OrderEvent& e = events[i];
+		BOOST_CHECK(e.type != TradeApi::OrderEvent::FAILED);
+		if (e.order.action == TradeApi::SELL && e.type == TradeApi::OrderEvent::FILLED)
+			sellFilled = i;
+		if (e.order.action == TradeApi::BUY && e.type == TradeApi::OrderEvent::PLACED)
+			firstBuy = min(firstBuy, i);
+		if (e.type == TradeApi::OrderEvent::FILLED)
+			++filled;
+	}
+	BOOST_CHECK(events[0].order.action == TradeApi::SELL);
+	BOOST_CHECK(firstBuy < sellFilled);
+	BOOST_CHECK_EQUAL(filled, 4u);
+
+	// converged within a single run
+	BOOST_CHECK(p.checkCurrentState(trade, 0.1).empty());
+	BOOST_CHECK(p.completed());
+	BOOST_CHECK(double(trade.balance("BTC")) >= 0);
+}
+
+BOOST_AUTO_TEST_CASE(shared_ticker_cases)
+{
+	const string name = "portfolio_test_tickers";
+	SharedTickerCache::remove(name);
+	map<string, TradeApi::CoinInfo> tickers[2], read;
+	for (int v = 0; v < 2; ++v)
+		for (const char* coin : { "BBR", "ETH", "NXT", "XMR" })
+		{
+			TradeApi::CoinInfo& ci = tickers[v][coin];
+			ci.coin = coin;
+			ci.buyPrice = Decimal::fromUnits(100 + v);
+			ci.sellPrice = Decimal::fromUnits(200 + v);
+			ci.lastPrice = Decimal::fromUnits(300 + v);
+			ci.rate = Decimal::fromUnits(400 + v);
+		}
+	{
+		SharedTickerCache writer(name), reader(name);
+		BOOST_CHECK(!reader.read(read, 60));
+		BOOST_CHECK(writer.publish(tickers[0]));
+		BOOST_REQUIRE(reader.read(read, 60));
+		BOOST_REQUIRE_EQUAL(read.size(), 4u);
+		BOOST_CHECK_EQUAL(read["ETH"].sellPrice.units(), 200);
+		BOOST_CHECK_EQUAL(read["ETH"].rate.units(), 400);
+
+		// readers never see a table half way between two publishes
+		atomic<bool> stop(false);
+		atomic<unsigned> torn(0), reads(0);
+		thread publisher([&]()
+		{
+			for (int i = 0; !stop; ++i)
+				writer.publish(tickers[i % 2]);
+		});
+		vector<thread> readers;
+		for (int t = 0; t < 3; ++t)
+			readers.push_back(thread([&]()
+			{
+				SharedTickerCache own(name);
+				map<string, TradeApi::CoinInfo> r;
+				for (int i = 0; i < 2000; ++i)
+				{
+					if (!own.read(r, 60))
+						continue;
+					++reads;
+					int64_t v = r["BBR"].buyPrice.units() - 100;
+					for (const auto& t : r)
+						if (t.second.buyPrice.units() != 100 + v || t.second.lastPrice.units() != 300 + v)
+							++torn;
+				}
+			}));
+		for (thread& t : readers)
+			t.join();
+		stop = true;
+		publisher.join();
+		BOOST_CHECK_EQUAL(torn, 0u);
+		BOOST_CHECK(reads > 0u);
+	}
+
+	// a second instance takes the tickers from the first one's download
+	TestServer server([](const TestServer::Request&, TestServer::Response& res)
+	{
+		res.body() = "{\"BTC_ETH\":{\"last\":\"0.0047\",\"highestBid\":\"0.0046\",\"lowestAsk\":\"0.0048\"}}";
+	});
+	SharedTickerCache::remove(name);
+	PoloniexTradeApi first("key", "secret", "127.0.0.1", server.port());
+	first.set_shared_tickers(name, 60);
+	BOOST_CHECK_EQUAL(first.info("ETH").lastPrice.str(), "0.0047");
+	PoloniexTradeApi second("key2", "secret2", "127.0.0.1", server.port());
+	second.set_shared_tickers(name, 60);
+	BOOST_CHECK_EQUAL(second.info("ETH").buyPrice.str(), "0.0046");
+	BOOST_CHECK_EQUAL(server.requests(), 1u);
+	SharedTickerCache::remove(name);
+}
+
+BOOST_FIXTURE_TEST_CASE(reconcile_cases, TradeFixture2)
+{
+	auto order = [](const char* coin, TradeApi::Operation action, double amount, double price)
+	{
+		TradeApi::Order o;
+		o.coin = coin;
+		o.action = action;
+		o.amount = amount;
+		o.price = price;
+		return o;
+	};
+	// left open by an earlier run, the ETH sell half filled
+	long long eth = trade.createOrder(order("ETH", TradeApi::SELL, 1.0, 0.00473));
+	trade.fill(eth, 0.5);
+	long long xmr = trade.createOrder(order("XMR", TradeApi::BUY, 2.0, 0.0023));
+	long long nxt = trade.createOrder(order("NXT", TradeApi::SELL, 100, 0.000035));
+	long long bbr = trade.createOrder(order("BBR", TradeApi::BUY, 100, 0.00006));
+	trade.foreign.insert(nxt);
+
+	vector<TradeApi::Order> orders = {
+		order("ETH", TradeApi::SELL, 0.49, 0.00473),
+		order("XMR", TradeApi::BUY, 2.0, 0.00232),
+		order("NXT", TradeApi::SELL, 100, 0.000035) };
+	map<size_t, TradeApi::OpenOrder> placed = Reconciler(trade).run(orders);
+
+	// kept within the tolerances, moved when the price is off, the rest
+	// cancelled, manual orders too
+	BOOST_REQUIRE_EQUAL(placed.size(), 2u);
+	BOOST_CHECK_EQUAL(placed[0].id, eth);
+	BOOST_CHECK_CLOSE(placed[0].filled, 0.5, 1e-9);
+	BOOST_CHECK_EQUAL(placed[0].order.amount.str(), "0.5");
+	BOOST_CHECK(placed[1].id > bbr);
+	BOOST_CHECK_EQUAL(placed[1].order.price.str(), "0.00232");
+	set<long long> cancelled(trade.cancelled.begin(), trade.cancelled.end());
+	BOOST_CHECK(cancelled == set<long long>({ xmr, nxt, bbr }));
+
+	// the kept sell reports fills of what was left, from zero
+	trade.fillStep = 0.25;
+	vector<TradeApi::OrderEvent> events;
+	ExecutionPlanner planner(trade, [&events](const TradeApi::OrderEvent& e) { events.push_back(e); });
+	planner.set_poll_interval(chrono::milliseconds(1));
+	BOOST_CHECK(!planner.run(orders, trade.balance("BTC"), chrono::seconds(5), placed));
+	vector<double> ethFills;
+	size_t created = 0;
+	for (const TradeApi::OrderEvent& e : events)
+	{
+		BOOST_CHECK(e.type != TradeApi::OrderEvent::FAILED);
+		if (e.index == 0 && e.type != TradeApi::OrderEvent::PLACED)
+			ethFills.push_back(e.filled);
+		if (e.type == TradeApi::OrderEvent::PLACED && e.id > placed[1].id)
+			++created;
+	}
+	BOOST_CHECK(ethFills == vector<double>({ 0.5, 1.0 }));
+	BOOST_CHECK_EQUAL(created, 1u);
+
+	// ids of placed orders survive in the state file until they are gone
+	string path = "order_state_test.txt";
+	std::remove(path.c_str());
+	TestServer server([](const TestServer::Request& req, TestServer::Response& res)
+	{
+		const string& body = req.body();
+		if (body.find("command=buy") != string::npos)
+			res.body() = "{\"orderNumber\":\"42\"}";
+		else if (body.find("command=returnOpenOrders") != string::npos)
+			res.body() = "{\"BTC_ETH\":[{\"orderNumber\":\"42\",\"type\":\"buy\",\"rate\":\"0.0047\","
+				"\"amount\":\"0.5\",\"startingAmount\":\"1\"}],"
+				"\"USDT_BTC\":[{\"orderNumber\":\"7\",\"type\":\"sell\",\"rate\":\"6400\","
+				"\"amount\":\"0.1\",\"startingAmount\":\"0.1\"}]}";
+		else if (body.find("command=moveOrder") != string::npos)
+			res.body() = "{\"success\":1,\"orderNumber\":\"43\"}";
+		else
+			res.body() = "{\"success\":1}";
+	});
+	PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+	polo.set_order_state(path);
+	BOOST_CHECK_EQUAL(polo.createOrder(order("ETH", TradeApi::BUY, 1.0, 0.0047)), 42);
+	vector<TradeApi::OpenOrder> open = polo.openOrders();
+	BOOST_REQUIRE_EQUAL(open.size(), 2u);
+	BOOST_CHECK(open[0].own);
+	BOOST_CHECK_EQUAL(open[0].order.coin, "ETH");
+	BOOST_CHECK_CLOSE(open[0].filled, 0.5, 1e-9);
+	BOOST_CHECK(!open[1].own);
+	BOOST_CHECK_EQUAL(open[1].order.coin, "USDT");
+	BOOST_CHECK(open[1].order.action == TradeApi::BUY);
+	BOOST_CHECK_EQUAL(open[1].order.amount.str(), "640");
+	BOOST_CHECK(OrderState(path).contains(42));
+	BOOST_CHECK_EQUAL(polo.moveOrder(42, order("ETH", TradeApi::BUY, 0.5, 0.0048)), 43);
+	BOOST_CHECK(!OrderState(path).contains(42));
+	BOOST_CHECK(OrderState(path).contains(43));
+	polo.deleteOrder(43);
+	BOOST_CHECK(!OrderState(path).contains(43));
+	std::remove(path.c_str());
+}
 
+BOOST_AUTO_TEST_CASE(ticker_history_cases)
+{
+	const char* path = "ticker_history_test.bin";
+	std::remove(path);
+	map<string, TradeApi::CoinInfo> tickers;
+	for (const char* coin : { "BBR", "ETH", "XMR" })
+	{
+		TradeApi::CoinInfo& ci = tickers[coin];
+		ci.coin = coin;
+		ci.buyPrice = Decimal::parse("0.0047");
+		ci.sellPrice = Decimal::parse("0.0048");
+		ci.lastPrice = Decimal::parse("0.00475");
+	}
+	vector<map<string, TradeApi::CoinInfo>> recorded;
+	{
+		TickerRecorder recorder(path, 8);
+		for (int i = 0; i < 50; ++i)
+		{
+			// prices move both ways, and a market comes and goes
+			for (auto& t : tickers)
+				t.second.lastPrice = Decimal::fromUnits(t.second.lastPrice.units() + ((i % 3) - 1) * 1000);
+			if (i == 20)
+				tickers["NXT"].coin = "NXT";
+			if (i == 30)
+				tickers.erase("NXT");
+			recorder.append(1000 + i * 60, tickers);
+			recorded.push_back(tickers);
+		}
+	}
+	{
+		// a later run goes on in the same file
+		TickerRecorder recorder(path, 8);
+		recorder.append(1000 + 50 * 60, tickers);
+		recorded.push_back(tickers);
+	}
+	// an interrupted append leaves a torn frame at the end
+	{
+		ofstream f(path, ios_base::binary | ios_base::app);
+		f.write("D\x20\x01", 3);
+	}
+
+	TickerHistoryReader reader(path);
+	BOOST_CHECK(reader.keyframes() >= 8u);
+	size_t n = 0;
+	for (; reader.next(); ++n)
+	{
+		BOOST_REQUIRE(n < recorded.size());
+		const TickerHistoryReader::Snapshot& s = reader.snapshot();
+		BOOST_CHECK_EQUAL(s.time, static_cast<time_t>(1000 + n * 60));
+		BOOST_REQUIRE_EQUAL(s.tickers.size(), recorded[n].size());
+		for (const TradeApi::CoinInfo& ci : s.tickers)
+		{
+			const TradeApi::CoinInfo& expected = recorded[n][ci.coin];
+			BOOST_CHECK_EQUAL(ci.buyPrice.units(), expected.buyPrice.units());
+			BOOST_CHECK_EQUAL(ci.sellPrice.units(), expected.sellPrice.units());
+			BOOST_CHECK_EQUAL(ci.lastPrice.units(), expected.lastPrice.units());
+		}
+	}
+	BOOST_CHECK_EQUAL(n, recorded.size());
+
+	// any point in time, between keyframes too
+	reader.seek(1000 + 27 * 60 - 30);
+	BOOST_REQUIRE(reader.next());
+	BOOST_CHECK_EQUAL(reader.snapshot().time, 1000 + 27 * 60);
+	BOOST_CHECK_EQUAL(reader.snapshot().tickers.size(), 4u);
+	BOOST_CHECK_EQUAL(reader.snapshot().tickers[0].lastPrice.units(), recorded[27]["BBR"].lastPrice.units());
+	reader.seek(0);
+	BOOST_REQUIRE(reader.next());
+	BOOST_CHECK_EQUAL(reader.snapshot().time, 1000);
+	reader.seek(1000 + 60 * 60);
+	BOOST_CHECK(!reader.next());
+
+	// the next run cuts the torn frames off, a real one too, and records after them
+	{
+		ifstream f(path, ios_base::binary | ios_base::ate);
+		BOOST_REQUIRE(::truncate(path, static_cast<off_t>(f.tellg()) - 5) == 0);
+		recorded.pop_back();
+	}
+	{
+		TickerRecorder recorder(path, 8);
+		for (int i = 0; i < 3; ++i)
+		{
+			recorder.append(1000 + (50 + i) * 60, tickers);
+			recorded.push_back(tickers);
+		}
+	}
+	TickerHistoryReader resumed(path);
+	for (n = 0; resumed.next(); ++n)
+	{
+		BOOST_REQUIRE(n < recorded.size());
+		BOOST_CHECK_EQUAL(resumed.snapshot().time, static_cast<time_t>(1000 + n * 60));
+		BOOST_CHECK_EQUAL(resumed.snapshot().tickers.back().lastPrice.units(),
+			recorded[n].rbegin()->second.lastPrice.units());
+	}
+	BOOST_CHECK_EQUAL(n, recorded.size());
+	std::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(compression_cases)
+{
+	// a ticker large enough for compression to matter
+	string ticker = "{";
+	for (int i = 0; i < 200; ++i)
+	{
+		char market[160];
+		snprintf(market, sizeof(market), "%s\"BTC_C%03d\":{\"last\":\"0.00%06d\",\"highestBid\":\"0.00%06d\","
+			"\"lowestAsk\":\"0.00%06d\"}", i ? "," : "", i, 1000 + i, 990 + i, 1010 + i);
+		ticker += market;
+	}
+	ticker += "}";
+	const string balances = "{\"BTC\":\"0.50000000\",\"C007\":\"10.00000000\"}";
+	atomic<bool> corrupt(false);
+	atomic<unsigned> plain(0);
+	TestServer server([&](const TestServer::Request& req, TestServer::Response& res)
+	{
+		string accepted(req[boost::beast::http::field::accept_encoding]);
+		if (accepted.empty())
+		{
+			++plain;
+			res.body() = (req.method() == boost::beast::http::verb::get) ? ticker : balances;
+			return;
+		}
+		if (req.method() == boost::beast::http::verb::get)
+		{
+			res.set(boost::beast::http::field::content_encoding, "gzip");
+			res.body() = TestServer::compress(ticker, true);
+		}
+		else
+		{
+			res.set(boost::beast::http::field::content_encoding, "deflate");
+			res.body() = TestServer::compress(balances, false);
+		}
+		if (corrupt)
+			res.body().resize(res.body().size() / 2);
+	});
+	Counter& received = Metrics::instance().counter("https_bytes_received_total",
+		Metrics::label("host", "127.0.0.1"));
+
+	PoloniexTradeApi trade("key", "secret", "127.0.0.1", server.port());
+	uint64_t before = received.value();
+	BOOST_CHECK_EQUAL(trade.info("C007").lastPrice.str(), "0.00001007");
+	uint64_t compressed = received.value() - before;
+	BOOST_CHECK_CLOSE(double(trade.balance("C007")), 10.0, 1e-9);
+	BOOST_CHECK_EQUAL(plain, 0u);
+
+	PoloniexTradeApi uncompressed("key", "secret", "127.0.0.1", server.port());
+	uncompressed.set_compression(false);
+	before = received.value();
+	BOOST_CHECK_EQUAL(uncompressed.info("C199").sellPrice.str(), "0.00001209");
+	uint64_t raw = received.value() - before;
+	BOOST_CHECK_EQUAL(plain, 1u);
+	BOOST_TEST_MESSAGE("ticker on the wire: " << compressed << " bytes compressed, " << raw << " plain");
+	BOOST_CHECK(compressed * 3 < raw);
+
+	corrupt = true;
+	PoloniexTradeApi broken("key", "secret", "127.0.0.1", server.port());
+	BOOST_CHECK_THROW(broken.balance("BTC"), runtime_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(virtual_clock_cases, TradeFixture2)
+{
+	VirtualClock clock;
+	trade.set_clock(clock);
+	const Clock::TimePoint start = clock.now();
+	auto minutes = [&clock, start]()
+	{
+		return chrono::duration_cast<chrono::minutes>(clock.now() - start).count();
+	};
+	auto order = [](const char* coin, TradeApi::Operation action, double amount, double price)
+	{
+		TradeApi::Order o;
+		o.coin = coin;
+		o.action = action;
+		o.amount = amount;
+		o.price = price;
+		return o;
+	};
+
+	// an hour of polling every 30 seconds: the ETH sell fills in two
+	// steps, the XMR buy at once later on, the NXT sell never
+	vector<TradeApi::Order> orders = {
+		order("ETH", TradeApi::SELL, 1.0, 0.00473),
+		order("XMR", TradeApi::BUY, 2.0, 0.00232),
+		order("NXT", TradeApi::SELL, 100, 0.000035) };
+	vector<tuple<size_t, TradeApi::OrderEvent::Type, long long>> seen;
+	auto events = [&](const TradeApi::OrderEvent& e)
+	{
+		seen.push_back(make_tuple(e.index, e.type, minutes()));
+		if (e.type != TradeApi::OrderEvent::PLACED)
+			return;
+		long long id = e.id;
+		TestTradeApi* t = &trade;
+		if (e.index == 0)
+		{
+			clock.schedule(chrono::minutes(10), [t, id]() { t->fill(id, 0.5); });
+			clock.schedule(chrono::minutes(25), [t, id]() { t->fill(id, 1.0); });
+		}
+		else if (e.index == 1)
+			clock.schedule(chrono::minutes(40), [t, id]() { t->fill(id, 1.0); });
+	};
+	chrono::steady_clock::time_point real = chrono::steady_clock::now();
+	BOOST_CHECK(static_cast<TradeApi&>(trade).execute(orders, 60, events));
+	BOOST_CHECK(chrono::steady_clock::now() - real < chrono::seconds(1));
+	BOOST_CHECK_EQUAL(minutes(), 60);
+	typedef TradeApi::OrderEvent E;
+	vector<tuple<size_t, TradeApi::OrderEvent::Type, long long>> expected = {
+		make_tuple(0, E::PLACED, 0),
+		make_tuple(2, E::PLACED, 0),
+		make_tuple(1, E::PLACED, 0),
+		make_tuple(0, E::PARTIALLY_FILLED, 10),
+		make_tuple(0, E::FILLED, 25),
+		make_tuple(1, E::FILLED, 40),
+		make_tuple(2, E::CANCELLED, 60) };
+	BOOST_CHECK(seen == expected);
+	// the cancelled sell gave its coins back
+	BOOST_CHECK_CLOSE(double(trade.balance("NXT")), 330.53391706, 1e-9);
+	BOOST_CHECK_CLOSE(double(trade.balance("XMR")), 10.20689865, 1e-9);
+
+	// a buy waiting on a sell that stops half way is never placed
+	seen.clear();
+	orders = {
+		order("BBR", TradeApi::SELL, 1000, 0.00006697),
+		order("ETH", TradeApi::BUY, 100, 0.0047) };
+	auto halfway = [&](const TradeApi::OrderEvent& e)
+	{
+		seen.push_back(make_tuple(e.index, e.type, minutes()));
+		TestTradeApi* t = &trade;
+		long long id = e.id;
+		if (e.type == TradeApi::OrderEvent::PLACED)
+			clock.schedule(chrono::minutes(5), [t, id]() { t->fill(id, 0.5); });
+	};
+	BOOST_CHECK(static_cast<TradeApi&>(trade).execute(orders, 30, halfway));
+	expected = {
+		make_tuple(0, E::PLACED, 60),
+		make_tuple(0, E::PARTIALLY_FILLED, 65),
+		make_tuple(0, E::CANCELLED, 90),
+		make_tuple(1, E::FAILED, 90) };
+	BOOST_CHECK(seen == expected);
+	BOOST_CHECK_CLOSE(double(trade.balance("BBR")), 1265.05127482 - 500, 1e-9);
+
+	// the breaker's cooldown runs on the same clock
+	CircuitBreaker breaker("virtual", 2, chrono::seconds(30));
+	breaker.set_clock(clock);
+	breaker.failure();
+	breaker.failure();
+	BOOST_CHECK(breaker.state() == CircuitBreaker::OPEN);
+	BOOST_CHECK_THROW(breaker.acquire(), CircuitOpenError);
+	clock.advance(chrono::seconds(29));
+	BOOST_CHECK(breaker.state() == CircuitBreaker::OPEN);
+	clock.advance(chrono::seconds(1));
+	BOOST_CHECK(breaker.state() == CircuitBreaker::HALF_OPEN);
+	breaker.acquire();
+	breaker.success();
+	BOOST_CHECK(breaker.state() == CircuitBreaker::CLOSED);
+}
+
+BOOST_FIXTURE_TEST_CASE(market_snapshot_cases, TradeFixture2)
+{
+	// the portfolio values everything from one snapshot
+	Portfolio p;
+	p.addCoin("BTC", 1);
+	p.addCoin("ETH", 1);
+	p.addCoin("XMR", 1);
+	shared_ptr<const MarketSnapshot> before = trade.snapshot();
+	vector<TradeApi::Order> orders = p.checkCurrentState(trade, 0.1);
+	BOOST_CHECK(!orders.empty());
+	BOOST_CHECK_EQUAL(trade.infoCalls, 0u);
+	BOOST_CHECK_THROW(before->info("DOGE"), runtime_error);
+	BOOST_CHECK(!before->ticker("DOGE"));
+	BOOST_CHECK_EQUAL(before->balance("DOGE").units(), 0);
+
+	// a snapshot held stays as it was while trading goes on
+	trade.createOrder(orders[0]);
+	BOOST_CHECK_EQUAL(before->balance("BTC").str(), "0.21352728");
+	BOOST_CHECK_EQUAL(before->balance("BBR").str(), "1265.05127482");
+
+	// shared until tickers or balances are read again
+	atomic<unsigned> balanceReads(0);
+	TestServer server([&](const TestServer::Request& req, TestServer::Response& res)
+	{
+		if (req.target() == "/public?command=returnTicker")
+			res.body() = "{\"BTC_ETH\":{\"last\":\"0.0047\",\"highestBid\":\"0.0046\",\"lowestAsk\":\"0.0048\"}}";
+		else if (req.body().find("command=returnBalances") != string::npos)
+			res.body() = (balanceReads++ == 0) ? "{\"BTC\":\"0.5\",\"ETH\":\"10\"}" : "{\"BTC\":\"0.6\",\"ETH\":\"9\"}";
+		else
+			res.body() = "{}";
+	});
+	PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+	shared_ptr<const MarketSnapshot> first = polo.snapshot();
+	unsigned requests = server.requests();
+	BOOST_CHECK(polo.snapshot() == first);
+	BOOST_CHECK_CLOSE(polo.nonZeroBalancesInBTC()["ETH"], 0.047, 1e-9);
+	BOOST_CHECK(polo.snapshot() == first);
+	BOOST_CHECK_EQUAL(server.requests(), requests);
+	polo.prefetch(true);
+	shared_ptr<const MarketSnapshot> second = polo.snapshot();
+	BOOST_CHECK(second != first);
+	BOOST_CHECK_EQUAL(first->balance("ETH").str(), "10");
+	BOOST_CHECK_EQUAL(second->balance("ETH").str(), "9");
+	BOOST_CHECK(second->ticker("ETH") != nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(market_rules_cases)
+{
+	MarketRules rules;
+	MarketRules::Rule r;
+	r.tick = Decimal::fromUnits(100);
+	r.step = Decimal::fromUnits(1000);
+	rules.set("ETH", r);
+	TradeApi::Order o;
+	o.coin = "ETH";
+	o.price = Decimal::fromUnits(1234567);
+	o.amount = Decimal::fromUnits(987654321);
+	string reason;
+	BOOST_CHECK(rules.apply(o, reason));
+	BOOST_CHECK_EQUAL(o.price.units(), 1234600);
+	BOOST_CHECK_EQUAL(o.amount.units(), 987654000);
+
+	// two pieces of dust make an order, a lone one is dropped
+	vector<TradeApi::Order> orders(3);
+	orders[0].coin = orders[1].coin = "XMR";
+	orders[0].price = 0.01;
+	orders[0].amount = 0.006;
+	orders[1].price = 0.02;
+	orders[1].amount = 0.002;
+	orders[2].coin = "LTC";
+	orders[2].action = TradeApi::SELL;
+	orders[2].price = 0.01;
+	orders[2].amount = 0.001;
+	BOOST_CHECK_EQUAL(rules.prepare(orders), 1u);
+	BOOST_REQUIRE_EQUAL(orders.size(), 1u);
+	BOOST_CHECK_EQUAL(orders[0].amount.str(), "0.008");
+	BOOST_CHECK_EQUAL(orders[0].price.str(), "0.0125");
+
+	BOOST_CHECK(rules.learn("XMR", "Total must be at least 0.001."));
+	BOOST_CHECK(!rules.learn("XMR", "Total must be at least 0.001."));
+	BOOST_CHECK(!rules.learn("XMR", "Not enough BTC."));
+	BOOST_CHECK_EQUAL(rules.rule("XMR").minTotal.str(), "0.001");
+	BOOST_CHECK(rules.set_frozen("DOGE", true));
+	BOOST_CHECK(!rules.set_frozen("DOGE", true));
+
+	const char* path = "market_rules_test.txt";
+	rules.save(path);
+	MarketRules loaded;
+	BOOST_CHECK(loaded.load(path, 60));
+	BOOST_CHECK_EQUAL(loaded.rule("XMR").minTotal.str(), "0.001");
+	BOOST_CHECK_EQUAL(loaded.rule("ETH").step.units(), 1000);
+	BOOST_CHECK(loaded.rule("DOGE").frozen);
+	std::remove(path);
+
+	// an order the rules reject never reaches the exchange
+	string error;
+	TestServer server([&](const TestServer::Request&, TestServer::Response& res)
+	{
+		res.body() = error.empty() ? "{\"orderNumber\":\"5\"}" : "{\"error\":\"" + error + "\"}";
+	});
+	PoloniexTradeApi trade("key", "secret", "127.0.0.1", server.port());
+	Counter& local = Metrics::instance().counter("orders_rejected_total", Metrics::label("where", "local"));
+	Counter& remote = Metrics::instance().counter("orders_rejected_total", Metrics::label("where", "remote"));
+	uint64_t localBefore = local.value(), remoteBefore = remote.value();
+	o.coin = "XMR";
+	o.price = 0.01;
+	o.amount = 0.005;
+	BOOST_CHECK_THROW(trade.createOrder(o), std::runtime_error);
+	BOOST_CHECK_EQUAL(server.requests(), 0u);
+	BOOST_CHECK_EQUAL(local.value() - localBefore, 1u);
+
+	// a rejection by the exchange teaches the minimum for the next order
+	o.amount = 0.05;
+	error = "Total must be at least 0.001.";
+	BOOST_CHECK_THROW(trade.createOrder(o), std::runtime_error);
+	BOOST_CHECK_EQUAL(server.requests(), 1u);
+	BOOST_CHECK_EQUAL(remote.value() - remoteBefore, 1u);
+	o.amount = 0.09;
+	BOOST_CHECK_THROW(trade.createOrder(o), std::runtime_error);
+	BOOST_CHECK_EQUAL(server.requests(), 1u);
+	error.clear();
+	o.amount = 0.1;
+	BOOST_CHECK_EQUAL(trade.createOrder(o), 5);
+
+	// events of execute() tell positions in the orders given, merged and
+	// dropped ones included
+	atomic<int> ids(10);
+	TestServer exchange([&ids](const TestServer::Request& req, TestServer::Response& res)
+	{
+		const string& body = req.body();
+		if (body.find("command=sell") != string::npos)
+			res.body() = "{\"orderNumber\":\"" + to_string(++ids) + "\"}";
+		else if (body.find("command=returnBalances") != string::npos)
+			res.body() = "{\"BTC\":\"1\",\"XMR\":\"1\",\"LTC\":\"1\",\"ETH\":\"1\"}";
+		else if (body.find("command=returnOpenOrders") != string::npos)
+			res.body() = "[]";
+		else
+			res.body() = "{}";
+	});
+	PoloniexTradeApi executing("key", "secret", "127.0.0.1", exchange.port());
+	VirtualClock clock;
+	executing.set_clock(clock);
+	orders.assign(4, TradeApi::Order());
+	orders[0].coin = orders[2].coin = "XMR";
+	orders[1].coin = "LTC";
+	orders[3].coin = "ETH";
+	for (TradeApi::Order& sell : orders)
+	{
+		sell.action = TradeApi::SELL;
+		sell.price = 0.01;
+		sell.amount = 0.05;
+	}
+	orders[1].amount = 0.001;
+	vector<pair<size_t, TradeApi::OrderEvent::Type>> seen;
+	map<size_t, string> errors;
+	executing.execute(orders, 1, [&](const TradeApi::OrderEvent& e)
+	{
+		seen.push_back(make_pair(e.index, e.type));
+		if (e.type == TradeApi::OrderEvent::FAILED)
+			errors[e.index] = e.error;
+		if (e.type == TradeApi::OrderEvent::PLACED)
+			BOOST_CHECK_EQUAL(e.order.coin, orders[e.index].coin);
+	});
+	typedef TradeApi::OrderEvent E;
+	vector<pair<size_t, TradeApi::OrderEvent::Type>> expected = {
+		{ 1, E::FAILED }, { 2, E::FAILED }, { 0, E::PLACED }, { 3, E::PLACED },
+		{ 0, E::FILLED }, { 3, E::FILLED } };
+	BOOST_CHECK(seen == expected);
+	BOOST_CHECK(errors[1].find("Total") != string::npos);
+	BOOST_CHECK_EQUAL(errors[2], "merged into order 0");
+}
+
+BOOST_AUTO_TEST_CASE(direct_pair_cases)
+{
+	map<string, TradeApi::CoinInfo> tickers;
+	TradeApi::CoinInfo ci;
+	ci.coin = "ETH";
+	ci.buyPrice = ci.sellPrice = ci.lastPrice = 0.01;
+	tickers["ETH"] = ci;
+	ci.coin = "XMR";
+	ci.buyPrice = ci.sellPrice = ci.lastPrice = 0.005;
+	tickers["XMR"] = ci;
+	ci.buyPrice = 0.499;
+	ci.sellPrice = 0.501;
+	ci.lastPrice = 0.5;
+	tickers["ETH_XMR"] = ci;
+	map<string, Decimal> balances;
+	balances["BTC"] = 1;
+	balances["ETH"] = 100;
+	TestTradeApi trade;
+	trade.set(tickers, balances);
+
+	// ETH goes into XMR in one order on their own market
+	Portfolio p;
+	p.addCoin("BTC", 1);
+	p.addCoin("ETH", 0.5);
+	p.addCoin("XMR", 0.5);
+	vector<TradeApi::Order> orders = p.plan(trade, 0.05);
+	BOOST_REQUIRE_EQUAL(orders.size(), 1u);
+	BOOST_CHECK_EQUAL(orders[0].market(), "ETH_XMR");
+	BOOST_CHECK(orders[0].action == TradeApi::BUY);
+	BOOST_CHECK_EQUAL(orders[0].price.str(), "0.5");
+	BOOST_CHECK_EQUAL(orders[0].amount.str(), "100");
+
+	// paid in ETH, it needs no BTC to be placed
+	trade.fillStep = 1.0;
+	ExecutionPlanner planner(trade);
+	planner.set_poll_interval(chrono::milliseconds(1));
+	BOOST_CHECK(!planner.run(orders, Decimal(), chrono::seconds(1)));
+	BOOST_CHECK_EQUAL(trade.balance("ETH").str(), "50");
+	BOOST_CHECK_EQUAL(trade.balance("XMR").str(), "100");
+	BOOST_CHECK_EQUAL(trade.balance("BTC").str(), "1");
+
+	// a wide spread or no direct routing goes through BTC again
+	trade.set(tickers, balances);
+	p.set_max_pair_spread(0.0);
+	BOOST_CHECK_EQUAL(p.plan(trade, 0.05).size(), 2u);
+	tickers["ETH_XMR"].buyPrice = 0.45;
+	tickers["ETH_XMR"].sellPrice = 0.55;
+	trade.set(tickers, balances);
+	p.set_max_pair_spread(0.01);
+	orders = p.plan(trade, 0.05);
+	BOOST_REQUIRE_EQUAL(orders.size(), 2u);
+	BOOST_CHECK(orders[0].base.empty() && orders[1].base.empty());
+
+	// the exchange keeps the direct markets and orders on them
+	string body;
+	TestServer server([&](const TestServer::Request& req, TestServer::Response& res)
+	{
+		if (req.target() == "/public?command=returnTicker")
+			res.body() = "{\"BTC_XMR\":{\"last\":\"0.005\",\"highestBid\":\"0.005\",\"lowestAsk\":\"0.005\"},"
+				"\"ETH_XMR\":{\"last\":\"0.5\",\"highestBid\":\"0.499\",\"lowestAsk\":\"0.501\"}}";
+		else
+		{
+			body = req.body();
+			res.body() = "{\"orderNumber\":\"7\"}";
+		}
+	});
+	PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+	const TradeApi::CoinInfo* pair = polo.snapshot()->pair("ETH", "XMR");
+	BOOST_REQUIRE(pair);
+	BOOST_CHECK_EQUAL(pair->coin, "XMR");
+	BOOST_CHECK_EQUAL(pair->sellPrice.str(), "0.501");
+	BOOST_CHECK(!polo.snapshot()->pair("XMR", "ETH"));
+	TradeApi::Order o;
+	o.coin = "XMR";
+	o.base = "ETH";
+	o.price = 0.5;
+	o.amount = 1;
+	BOOST_CHECK_EQUAL(polo.createOrder(o), 7);
+	BOOST_CHECK(body.find("command=buy") != string::npos);
+	BOOST_CHECK(body.find("currencyPair=ETH_XMR") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(market_pipeline_cases)
+{
+	VirtualClock clock;
+	MarketPipeline pipeline({ "ETH", "XMR" }, clock);
+	Counter& conflated = Metrics::instance().counter("market_pipeline_conflated_total");
+	Histogram& staleness = Metrics::instance().histogram("market_pipeline_staleness_seconds");
+	uint64_t conflatedBefore = conflated.value(), observedBefore = staleness.count();
+
+	// only the latest value of every coin is kept
+	map<string, TradeApi::CoinInfo> tickers;
+	for (const char* coin : { "ETH", "XMR", "DOGE" })
+	{
+		tickers[coin].coin = coin;
+		tickers[coin].buyPrice = tickers[coin].sellPrice = 0.01;
+	}
+	pipeline.publish(tickers);
+	BOOST_CHECK_EQUAL(pipeline.pending(), 2u);
+	tickers["ETH"].buyPrice = tickers["ETH"].sellPrice = 0.02;
+	pipeline.publish(tickers);
+	map<string, Decimal> balances;
+	balances["BTC"] = 1;
+	balances["ETH"] = 100;
+	pipeline.publish(balances);
+	BOOST_CHECK_EQUAL(pipeline.pending(), 3u);
+	BOOST_CHECK_EQUAL(conflated.value() - conflatedBefore, 2u);
+
+	clock.advance(chrono::seconds(2));
+	MarketSnapshot snapshot;
+	BOOST_CHECK(pipeline.consume(snapshot));
+	BOOST_CHECK(!pipeline.consume(snapshot));
+	BOOST_CHECK_EQUAL(pipeline.pending(), 0u);
+	BOOST_CHECK_EQUAL(snapshot.info("ETH").buyPrice.str(), "0.02");
+	BOOST_CHECK(!snapshot.ticker("DOGE"));
+	BOOST_CHECK_EQUAL(snapshot.balance("ETH").str(), "100");
+	BOOST_CHECK_EQUAL(staleness.count() - observedBefore, 3u);
+	Portfolio p;
+	p.addCoin("BTC", 1);
+	p.addCoin("ETH", 1);
+	BOOST_CHECK_EQUAL(p.checkCurrentState(snapshot, 0.05).size(), 1u);
+
+	// a slot taken as soon as it is put is never counted below zero
+	{
+		vector<string> coins;
+		map<string, TradeApi::CoinInfo> many;
+		for (int c = 0; c < 16; ++c)
+		{
+			coins.push_back("C" + to_string(c));
+			many[coins.back()].coin = coins.back();
+		}
+		MarketPipeline racing(coins);
+		Gauge& depth = Metrics::instance().gauge("market_pipeline_depth");
+		atomic<bool> done(false);
+		double deepest = 0;
+		thread consumer([&]()
+		{
+			MarketSnapshot s;
+			while (!done)
+			{
+				racing.consume(s);
+				deepest = max(deepest, max(depth.value(), double(racing.pending())));
+			}
+		});
+		for (int i = 1; i <= 20000; ++i)
+		{
+			for (auto& t : many)
+				t.second.buyPrice = t.second.sellPrice = Decimal::fromUnits(i);
+			racing.publish(many);
+		}
+		done = true;
+		consumer.join();
+		BOOST_CHECK(deepest <= coins.size() + 1);
+	}
+
+	// a fast producer is evaluated at the bounded rate and never torn
+	MarketPipeline live({ "ETH" });
+	atomic<unsigned> evaluations(0);
+	atomic<bool> torn(false);
+	double last = 0.0;
+	live.start([&](const shared_ptr<const MarketSnapshot>& s)
+	{
+		const TradeApi::CoinInfo& ci = s->info("ETH");
+		if (ci.buyPrice.units() != ci.sellPrice.units() || ci.buyPrice < last)
+			torn = true;
+		last = ci.buyPrice;
+		++evaluations;
+	}, chrono::milliseconds(20));
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 1; i <= 200000; ++i)
+	{
+		tickers["ETH"].buyPrice = tickers["ETH"].sellPrice = Decimal::fromUnits(i);
+		live.publish(tickers);
+	}
+	this_thread::sleep_for(chrono::milliseconds(60));
+	live.stop();
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	BOOST_CHECK(!torn);
+	BOOST_CHECK(evaluations > 0u);
+	BOOST_CHECK(evaluations <= elapsed / 0.02 + 2);
+	BOOST_CHECK_EQUAL(last, 0.002);
+}
+
+BOOST_FIXTURE_TEST_CASE(simulated_market_cases, TradeFixture2)
+{
+	Portfolio live, simulated;
+	for (Portfolio* p : { &live, &simulated })
+	{
+		p->addCoin("BTC", 1);
+		p->addCoin("ETH", 2);
+		p->addCoin("XMR", 1);
+		p->addCoin("DOGE", 0.5);
+	}
+	shared_ptr<const MarketSnapshot> snapshot = trade.snapshot();
+	vector<string> coins = { "BTC", "DOGE" };
+	for (const auto& b : snapshot->balances)
+		if (b.first != "BTC")
+			coins.push_back(b.first);
+	SimulatedMarket market(coins);
+	for (const auto& b : snapshot->balances)
+		market.set_balance(market.index(b.first), b.second);
+	for (const auto& t : snapshot->tickers)
+		market.set_ticker(market.index(t.first), t.second.buyPrice, t.second.sellPrice);
+	market.set_ticker(market.index("DOGE"), 0.0000003, 0.0000003);
+	BOOST_CHECK_THROW(SimulatedMarket({ "ETH", "ETH" }), runtime_error);
+	map<string, double> held;
+	for (const auto& b : snapshot->balances)
+		held[b.first] = b.second;
+
+	// both instantiations agree over a random walk of prices and balances
+	mt19937 random(7);
+	uniform_real_distribution<double> step(0.9, 1.1);
+	vector<TradeApi::Order> orders;
+	size_t compared = 0;
+	for (int i = 0; i < 200; ++i)
+	{
+		map<string, TradeApi::CoinInfo> tickers;
+		map<string, Decimal> balances;
+		for (const string& coin : coins)
+		{
+			size_t index = market.index(coin);
+			Decimal amount = held[coin] * step(random);
+			if (coin != "BTC")
+			{
+				TradeApi::CoinInfo ci = market.info(coin);
+				Decimal price = double(ci.buyPrice) * step(random);
+				market.set_ticker(index, price, double(price) * 1.01);
+				tickers[coin] = market.info(coin);
+			}
+			market.set_balance(index, amount);
+			balances[coin] = amount;
+		}
+		trade.set(tickers, balances);
+		bool fund = (i % 2) != 0;
+		vector<TradeApi::Order> expected = fund ? live.plan(trade, 0.05) : live.checkCurrentState(trade, 0.05);
+		simulated.evaluate(market, 0.05, fund, orders);
+		BOOST_REQUIRE_EQUAL(orders.size(), expected.size());
+		BOOST_CHECK_EQUAL(simulated.completed(), live.completed());
+		for (size_t j = 0; j < orders.size(); ++j)
+		{
+			BOOST_CHECK_EQUAL(orders[j].coin, expected[j].coin);
+			BOOST_CHECK(orders[j].action == expected[j].action);
+			BOOST_CHECK_EQUAL(orders[j].amount.units(), expected[j].amount.units());
+			BOOST_CHECK_EQUAL(orders[j].price.units(), expected[j].price.units());
+		}
+		compared += orders.size();
+	}
+	BOOST_CHECK(compared > 100u);
+
+	// with its buffers grown, evaluating allocates nothing
+	AllocationCounter counter;
+	for (int i = 0; i < 10; ++i)
+		simulated.evaluate(market, 0.05, true, orders);
+	BOOST_CHECK_EQUAL(counter.allocations(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(record_replay_cases)
+{
+	TestServer server([](const TestServer::Request& req, TestServer::Response& res)
+	{
+		if (req.target() == "/public?command=returnTicker")
+		{
+			res.set(boost::beast::http::field::content_encoding, "gzip");
+			res.body() = TestServer::compress(
+				"{\"BTC_ETH\":{\"last\":\"0.0047\",\"highestBid\":\"0.0046\",\"lowestAsk\":\"0.0048\"}}", true);
+		}
+		else if (req.body().find("command=returnBalances") != string::npos)
+			res.body() = "{\"BTC\":\"0.5\",\"ETH\":\"10\"}";
+		else
+			res.body() = "{\"error\":\"Invalid order number.\"}";
+	});
+	server.set_latency([]() { return chrono::milliseconds(50); });
+	const char* path = "replay_test.rec";
+	{
+		PoloniexTradeApi trade("key", "secret", "127.0.0.1", server.port());
+		trade.set_transport(make_shared<RecordingTransport>(trade.transport(), path));
+		BOOST_CHECK_EQUAL(trade.info("ETH").buyPrice.str(), "0.0046");
+		BOOST_CHECK_EQUAL(trade.balance("ETH").str(), "10");
+		BOOST_CHECK_THROW(trade.deleteOrder(42), runtime_error);
+	}
+	unsigned requests = server.requests();
+	BOOST_CHECK_EQUAL(requests, 3u);
+
+	// the secret never reaches the file
+	ifstream f(path, ios_base::binary);
+	string recorded((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+	BOOST_CHECK(recorded.find("secret") == string::npos);
+	BOOST_CHECK(recorded.find("command=returnBalances") != string::npos);
+
+	// replayed at once, with other nonces, and without the server
+	for (bool timed : { false, true })
+	{
+		shared_ptr<ReplayTransport> replay = make_shared<ReplayTransport>(path, timed);
+		BOOST_CHECK_EQUAL(replay->remaining(), 3u);
+		PoloniexTradeApi trade("key", "other", "127.0.0.1", server.port());
+		trade.set_transport(replay);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		BOOST_CHECK_EQUAL(trade.info("ETH").buyPrice.str(), "0.0046");
+		BOOST_CHECK_EQUAL(trade.balance("ETH").str(), "10");
+		BOOST_CHECK_THROW(trade.deleteOrder(43), runtime_error);
+		chrono::steady_clock::duration spent = chrono::steady_clock::now() - start;
+		BOOST_CHECK(timed ? spent >= chrono::milliseconds(150) : spent < chrono::milliseconds(50));
+		BOOST_CHECK_EQUAL(replay->remaining(), 0u);
+		// a request not recorded has no answer
+		BOOST_CHECK_THROW(trade.getCurrentOrders(), runtime_error);
+	}
+	BOOST_CHECK_EQUAL(server.requests(), requests);
+	std::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(memory_profile_cases)
+{
+	auto find = [](const string& name)
+	{
+		for (const MemoryProfile::Phase& p : MemoryProfile::phases())
+			if (p.name == name)
+				return p;
+		return MemoryProfile::Phase();
+	};
+	{
+		// nothing is attributed before the profile is enabled
+		MemoryPhase phase("test disabled");
+		unique_ptr<vector<int>> v(new vector<int>(10));
+	}
+	BOOST_CHECK(find("test disabled").name.empty());
+
+	MemoryProfile::enable();
+	BOOST_CHECK(MemoryProfile::enabled());
+	{
+		MemoryPhase outer("test outer");
+		AllocationCounter counter;
+		unique_ptr<vector<int>> a(new vector<int>(100));
+		{
+			MemoryPhase inner("test inner");
+			unique_ptr<vector<int>> b(new vector<int>(200));
+			unique_ptr<vector<int>> c(new vector<int>(200));
+		}
+		unique_ptr<vector<int>> d(new vector<int>(100));
+		BOOST_CHECK_EQUAL(counter.allocations(), 8u);
+		BOOST_CHECK(counter.bytes() >= 600 * sizeof(int));
+	}
+	MemoryProfile::Phase outer = find("test outer");
+	MemoryProfile::Phase inner = find("test inner");
+	BOOST_CHECK_EQUAL(outer.allocations, 4u);
+	BOOST_CHECK_EQUAL(inner.allocations, 4u);
+	BOOST_CHECK(inner.bytes >= 400 * sizeof(int));
+	BOOST_CHECK(outer.peakRss > 0);
+
+	// another thread has its own phase; the same name adds up
+	thread([]()
+	{
+		MemoryPhase phase("test inner");
+		unique_ptr<string> s(new string(100, 'x'));
+	}).join();
+	BOOST_CHECK_EQUAL(find("test inner").allocations, 6u);
+	BOOST_CHECK_EQUAL(find("test outer").allocations, 4u);
+
+	// over-aligned and nothrow allocations are counted too
+	{
+		struct alignas(64) Line { char bytes[64]; };
+		AllocationCounter counter;
+		unique_ptr<Line> line(new Line());
+		BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(line.get()) % 64, 0u);
+		unique_ptr<int> n(new (nothrow) int(1));
+		BOOST_CHECK_EQUAL(counter.allocations(), 2u);
+	}
+	// a failed allocation asks the new_handler before giving up
+	{
+		static int handled;
+		handled = 0;
+		new_handler previous = set_new_handler([]()
+		{
+			if (++handled == 2)
+				set_new_handler(nullptr);
+		});
+		volatile size_t huge = numeric_limits<size_t>::max() / 2;
+		BOOST_CHECK(new (nothrow) char[huge] == nullptr);
+		BOOST_CHECK_EQUAL(handled, 2);
+		set_new_handler(previous);
+	}
+
+	ostringstream report;
+	MemoryProfile::report(report);
+	BOOST_CHECK(report.str().find("test outer") != string::npos);
+	BOOST_CHECK(report.str().find("other") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(index_target_cases)
+{
+	map<string, TradeApi::CoinInfo> tickers;
+	auto set = [&tickers](const string& coin, double volume)
+	{
+		TradeApi::CoinInfo& ci = tickers[coin];
+		ci.coin = coin;
+		ci.buyPrice = ci.sellPrice = 0.001;
+		ci.volume = volume;
+	};
+	// A to F by falling volume, besides markets never ranked
+	set("A", 600);
+	set("B", 500);
+	set("C", 400);
+	set("D", 300);
+	set("E", 200);
+	set("F", 100);
+	set("G", 0);
+	set("USDT", 10000);
+	set("A_B", 10000);
+	auto names = [](const vector<IndexTargets::Target>& targets)
+	{
+		string res;
+		for (const IndexTargets::Target& t : targets)
+			res += t.coin;
+		return res;
+	};
+
+	BOOST_CHECK_THROW(IndexTargets(0, 1), runtime_error);
+	IndexTargets index(3, 1);
+	index.exclude("USDT");
+	const vector<IndexTargets::Target>& targets = index.update(tickers);
+	BOOST_CHECK_EQUAL(names(targets), "ABC");
+	BOOST_CHECK_EQUAL(index.joined(), 3u);
+	BOOST_CHECK_CLOSE(targets[0].part, 0.4, 1e-9);
+	BOOST_CHECK_CLOSE(targets[2].part, 400.0 / 1500, 1e-9);
+
+	// C falls to the fourth rank and stays, at the third it would be let in
+	set("D", 450);
+	BOOST_CHECK_EQUAL(names(index.update(tickers)), "ABC");
+	BOOST_CHECK_EQUAL(index.joined(), 0u);
+	BOOST_CHECK_EQUAL(index.left(), 0u);
+	// past the margin it makes way for the best outsider
+	set("E", 420);
+	BOOST_CHECK_EQUAL(names(index.update(tickers)), "ABD");
+	BOOST_CHECK_EQUAL(index.joined(), 1u);
+	BOOST_CHECK_EQUAL(index.left(), 1u);
+	// C coming back to the fourth rank does not get in again
+	set("C", 430);
+	BOOST_CHECK_EQUAL(names(index.update(tickers)), "ABD");
+
+	// members held before the first update, equally weighted
+	IndexTargets held(3, 2);
+	held.exclude("USDT");
+	held.set_weighting(IndexTargets::EQUAL);
+	held.set_members({ "F", "E", "ZZZ" });
+	BOOST_CHECK_EQUAL(names(held.update(tickers)), "ABE");
+	BOOST_CHECK_EQUAL(held.left(), 2u);
+	for (const IndexTargets::Target& t : held.targets())
+		BOOST_CHECK_CLOSE(t.part, 1.0 / 3, 1e-9);
+
+	// more members than places within the margin: the best ranked stay
+	IndexTargets crowded(3, 2);
+	crowded.exclude("USDT");
+	crowded.set_members({ "A", "B", "C", "D", "E" });
+	BOOST_CHECK_EQUAL(names(crowded.update(tickers)), "ABD");
+	BOOST_CHECK_EQUAL(crowded.joined(), 0u);
+	BOOST_CHECK_EQUAL(crowded.left(), 2u);
+
+	// any score from the ticker ranks
+	IndexTargets spread(2, 0);
+	spread.exclude("USDT");
+	tickers["F"].sellPrice = 0.002;
+	tickers["B"].sellPrice = 0.0015;
+	spread.set_ranking([](const TradeApi::CoinInfo& ci) { return ci.sellPrice - ci.buyPrice; });
+	BOOST_CHECK_EQUAL(names(spread.update(tickers)), "FB");
+
+	// fewer markets than places
+	IndexTargets large(10, 5);
+	BOOST_CHECK_EQUAL(names(large.update(tickers)), "USDTABDCEF");
+}
+
+BOOST_AUTO_TEST_CASE(single_flight_cases)
+{
+	// callers overlapping the first share its result or its error
+	SingleFlight<int> flights;
+	atomic<int> runs(0);
+	auto slow = [&runs](bool fail)
+	{
+		++runs;
+		this_thread::sleep_for(chrono::milliseconds(100));
+		if (fail)
+			throw runtime_error("failed");
+		return 42;
+	};
+	for (bool fail : { false, true })
+	{
+		runs = 0;
+		atomic<int> joined(0), failed(0), results(0);
+		vector<thread> callers;
+		for (int i = 0; i < 4; ++i)
+			callers.emplace_back([&]()
+			{
+				bool j = false;
+				try
+				{
+					results += *flights.run("key", [&]() { return slow(fail); }, j);
+				}
+				catch (const runtime_error&)
+				{
+					++failed;
+				}
+				joined += j;
+			});
+		for (thread& t : callers)
+			t.join();
+		BOOST_CHECK_EQUAL(runs, 1);
+		BOOST_CHECK_EQUAL(joined, 3);
+		BOOST_CHECK_EQUAL(results, fail ? 0 : 4 * 42);
+		BOOST_CHECK_EQUAL(failed, fail ? 4 : 0);
+		BOOST_CHECK_EQUAL(flights.inFlight(), 0u);
+	}
+	// other keys and later calls run on their own
+	bool joined = true;
+	BOOST_CHECK_EQUAL(*flights.run("other", []() { return 1; }, joined), 1);
+	BOOST_CHECK(!joined);
+
+	TestServer server([](const TestServer::Request& req, TestServer::Response& res)
+	{
+		const string& body = req.body();
+		if (req.target() == "/public?command=returnTicker")
+			res.body() = "{\"BTC_ETH\":{\"last\":\"0.0047\",\"highestBid\":\"0.0046\",\"lowestAsk\":\"0.0048\"}}";
+		else if (body.find("command=buy") != string::npos)
+			res.body() = "{\"orderNumber\":\"42\"}";
+		else if (body.find("command=returnOpenOrders") != string::npos)
+			res.body() = "{\"BTC_ETH\":[{\"orderNumber\":\"42\",\"type\":\"buy\",\"rate\":\"0.0047\","
+				"\"amount\":\"0.5\",\"startingAmount\":\"1\"}]}";
+		else
+			res.body() = "{}";
+	});
+	server.set_latency([]() { return chrono::milliseconds(200); });
+	Counter& coalesced = Metrics::instance().counter("poloniex_coalesced_requests_total",
+		Metrics::label("command", "returnOpenOrders"));
+	uint64_t coalescedBefore = coalesced.value();
+	PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+
+	// the same read from four threads goes out once
+	atomic<size_t> open(0);
+	vector<thread> readers;
+	for (int i = 0; i < 4; ++i)
+		readers.emplace_back([&]() { open += polo.openOrders().size(); });
+	for (thread& t : readers)
+		t.join();
+	BOOST_CHECK_EQUAL(open, 4u);
+	BOOST_CHECK_EQUAL(server.requests(), 1u);
+	BOOST_CHECK_EQUAL(coalesced.value() - coalescedBefore, 3u);
+	double requests = Metrics::instance().counter("poloniex_requests_total",
+		Metrics::label("command", "returnOpenOrders")).value();
+	BOOST_CHECK_CLOSE(Metrics::instance().gauge("poloniex_coalescing_ratio",
+		Metrics::label("command", "returnOpenOrders")).value(),
+		coalesced.value() / (coalesced.value() + requests), 1e-9);
+
+	// orders are never merged, and a read after one does not join a read before it
+	thread first([&]() { polo.openOrders(); });
+	this_thread::sleep_for(chrono::milliseconds(50));
+	TradeApi::Order eth;
+	eth.coin = "ETH";
+	eth.amount = 1.0;
+	eth.price = 0.0047;
+	thread buy([&]() { polo.createOrder(eth); });
+	thread buy2([&]() { polo.createOrder(eth); });
+	this_thread::sleep_for(chrono::milliseconds(50));
+	thread second([&]() { polo.openOrders(); });
+	for (thread* t : { &first, &buy, &buy2, &second })
+		t->join();
+	BOOST_CHECK_EQUAL(server.requests(), 5u);
+
+	// the ticker is shared between objects on the same transport only
+	PoloniexTradeApi other("key2", "secret2", "127.0.0.1", server.port());
+	other.set_transport(polo.transport());
+	PoloniexTradeApi apart("key3", "secret3", "127.0.0.1", server.port());
+	double prices[3] = { 0.0, 0.0, 0.0 };
+	thread a([&]() { prices[0] = polo.info("ETH").buyPrice; });
+	thread b([&]() { prices[1] = other.info("ETH").buyPrice; });
+	thread c([&]() { prices[2] = apart.info("ETH").buyPrice; });
+	a.join();
+	b.join();
+	c.join();
+	for (double price : prices)
+		BOOST_CHECK_EQUAL(price, 0.0046);
+	BOOST_CHECK_EQUAL(server.requests(), 7u);
+}
+
+BOOST_AUTO_TEST_CASE(dns_connect_cases)
+{
+	using boost::asio::ip::tcp;
+	typedef HostResolver::Endpoint Endpoint;
+	TestServer server([](const TestServer::Request&, TestServer::Response& res)
+	{
+		res.body() = "{}";
+	});
+	Endpoint live(boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(stoi(server.port())));
+
+	// a listener with its backlog full drops every further connect, as a
+	// host that went away does
+	boost::asio::io_service ios;
+	tcp::acceptor blackhole(ios);
+	blackhole.open(tcp::v4());
+	blackhole.bind(Endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	blackhole.listen(0);
+	vector<unique_ptr<tcp::socket>> queued;
+	for (int i = 0; i < 3; ++i)
+	{
+		queued.emplace_back(new tcp::socket(ios));
+		queued.back()->open(tcp::v4());
+		queued.back()->non_blocking(true);
+		// asio would wait for the connect to finish
+		Endpoint target = blackhole.local_endpoint();
+		::connect(queued.back()->native_handle(), target.data(), target.size());
+	}
+	this_thread::sleep_for(chrono::milliseconds(100));
+	Endpoint dead = blackhole.local_endpoint();
+
+	// the stub answers with the dead address first
+	atomic<bool> fail(false);
+	HostResolver resolver(chrono::seconds(60), [&](const string& host, const string& /*port*/)
+	{
+		if (fail)
+			throw boost::system::system_error(boost::asio::error::host_not_found);
+		if (host == "slow.test")
+			this_thread::sleep_for(chrono::milliseconds(300));
+		return vector<Endpoint>({ dead, live });
+	});
+	VirtualClock clock;
+	resolver.set_clock(clock);
+	Counter& attempts = Metrics::instance().counter("https_connect_attempts_total",
+		Metrics::label("host", "stub.test"));
+	uint64_t attemptsBefore = attempts.value();
+	{
+		HttpsClient client("stub.test", server.port());
+		client.set_resolver(resolver);
+		client.set_connect_stagger(chrono::milliseconds(100));
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		BOOST_CHECK_EQUAL(client.get("/public?command=returnTicker"), "{}");
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		BOOST_TEST_MESSAGE("connect past a dead address: " << elapsed.count() << "s");
+		BOOST_CHECK(elapsed >= chrono::milliseconds(100));
+		BOOST_CHECK(elapsed < chrono::milliseconds(900));
+		BOOST_CHECK_EQUAL(attempts.value() - attemptsBefore, 2u);
+	}
+	{
+		// the dead address alone times out at the deadline
+		HostResolver deadOnly(chrono::seconds(60), [&](const string&, const string&)
+		{
+			return vector<Endpoint>({ dead });
+		});
+		HttpsClient client("dead.test", server.port());
+		client.set_resolver(deadOnly);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		BOOST_CHECK_THROW(client.get("/", start + chrono::milliseconds(200)), boost::system::system_error);
+		BOOST_CHECK(chrono::steady_clock::now() - start < chrono::milliseconds(900));
+	}
+	BOOST_CHECK_EQUAL(resolver.lookups(), 1u);
+
+	// kept for the ttl, refreshed in the background past its half
+	vector<Endpoint> found = resolver.resolve("stub.test", server.port());
+	BOOST_REQUIRE_EQUAL(found.size(), 2u);
+	BOOST_CHECK(found[0] == dead);
+	BOOST_CHECK_EQUAL(resolver.lookups(), 1u);
+	clock.advance(chrono::seconds(40));
+	BOOST_CHECK_EQUAL(resolver.resolve("stub.test", server.port()).size(), 2u);
+	BOOST_CHECK_EQUAL(resolver.lookups(), 2u);
+	this_thread::sleep_for(chrono::milliseconds(100));
+	// a failed lookup keeps the expired addresses in use
+	fail = true;
+	clock.advance(chrono::seconds(120));
+	BOOST_CHECK_EQUAL(resolver.resolve("stub.test", server.port()).size(), 2u);
+	BOOST_CHECK_EQUAL(resolver.lookups(), 3u);
+	// and is an error for a name never resolved
+	BOOST_CHECK_THROW(resolver.resolve("new.test", "443"), boost::system::system_error);
+	fail = false;
+	// a lookup slower than the deadline times out, and its result is kept
+	BOOST_CHECK_THROW(resolver.resolve("slow.test", "443",
+		chrono::steady_clock::now() + chrono::milliseconds(50)), boost::system::system_error);
+	this_thread::sleep_for(chrono::milliseconds(400));
+	BOOST_CHECK_EQUAL(resolver.resolve("slow.test", "443").size(), 2u);
+
+	// the families alternate
+	Endpoint v6a(boost::asio::ip::address_v6::loopback(), 1), v6b(boost::asio::ip::address_v6::loopback(), 2);
+	Endpoint v4a(boost::asio::ip::address_v4::loopback(), 3);
+	HostResolver mixed(chrono::seconds(60), [&](const string&, const string&)
+	{
+		return vector<Endpoint>({ v6a, v6b, v4a });
+	});
+	BOOST_CHECK(mixed.resolve("mixed.test", "443") == vector<Endpoint>({ v6a, v4a, v6b }));
+}
+
+BOOST_AUTO_TEST_CASE(order_retry_cases)
+{
+	// an exchange that keeps orders by client id and can lose a buy or its
+	// reply, or take a lost buy late and fill it at once; like Poloniex it
+	// refuses a client id only while an order with it is open
+	enum Loss { NONE, REQUEST, REPLY, LATE };
+	atomic<int> loss(NONE), losses(0);
+	atomic<bool> fill(false), hideOpen(false), hideOnce(false);
+	atomic<unsigned> buys(0);
+	mutex m;
+	map<long long, long long> open, filled;
+	long long nextId = 100, late = 0;
+	bool dropping = false;
+	TestServer server([&](const TestServer::Request& req, TestServer::Response& res)
+	{
+		const string& body = req.body();
+		lock_guard<mutex> lock(m);
+		if (body.find("command=buy") != string::npos)
+		{
+			++buys;
+			long long clientId = stoll(body.substr(body.find("clientOrderId=") + 14));
+			if (late)
+				filled[late] = nextId++;
+			late = 0;
+			dropping = loss != NONE && losses-- > 0;
+			if (dropping && loss == LATE)
+				late = clientId;
+			if (dropping && (loss == REQUEST || loss == LATE))
+				return;
+			if (open.count(clientId))
+			{
+				res.body() = "{\"error\":\"Order with this clientOrderId already exists.\"}";
+				return;
+			}
+			(fill ? filled : open)[clientId] = nextId;
+			res.body() = "{\"orderNumber\":\"" + to_string(nextId++) + "\"}";
+		}
+		else if (body.find("command=returnOpenOrders") != string::npos)
+		{
+			string orders;
+			if (!hideOpen && !hideOnce)
+				for (const auto& o : open)
+					orders += string(orders.empty() ? "" : ",") + "{\"orderNumber\":\"" + to_string(o.second) +
+						"\",\"type\":\"buy\",\"rate\":\"0.0047\",\"amount\":\"1\",\"startingAmount\":\"1\","
+						"\"clientOrderId\":\"" + to_string(o.first) + "\"}";
+			hideOnce = false;
+			res.body() = "{\"BTC_ETH\":[" + orders + "]}";
+		}
+		else if (body.find("command=returnTradeHistory") != string::npos)
+		{
+			string trades;
+			for (const auto& o : filled)
+				trades += string(trades.empty() ? "" : ",") + "{\"orderNumber\":\"" + to_string(o.second) +
+					"\",\"type\":\"buy\",\"rate\":\"0.0047\",\"amount\":\"1\",\"clientOrderId\":\"" +
+					to_string(o.first) + "\"}";
+			res.body() = "[" + trades + "]";
+		}
+		else if (body.find("command=cancelOrder") != string::npos)
+		{
+			long long id = stoll(body.substr(body.find("orderNumber=") + 12));
+			for (auto it = open.begin(); it != open.end(); ++it)
+				if (it->second == id)
+				{
+					open.erase(it);
+					break;
+				}
+			res.body() = "{\"success\":1}";
+		}
+		else
+			res.body() = "{}";
+	});
+	server.set_drop([&](const TestServer::Request&)
+	{
+		lock_guard<mutex> lock(m);
+		bool drop = dropping;
+		dropping = false;
+		return drop;
+	});
+	TradeApi::Order eth;
+	eth.coin = "ETH";
+	eth.amount = 1.0;
+	eth.price = 0.0047;
+	Counter& recovered = Metrics::instance().counter("orders_recovered_total");
+	Counter& retried = Metrics::instance().counter("orders_retried_total");
+	uint64_t recoveredBefore = recovered.value(), retriedBefore = retried.value();
+	auto place = [&](Loss lost)
+	{
+		PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+		polo.set_timeout(chrono::seconds(1));
+		loss = lost;
+		losses = 1;
+		long long id = polo.createOrder(eth);
+		loss = NONE;
+		return id;
+	};
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	// placed, reply lost: found open, never sent twice
+	BOOST_CHECK_EQUAL(place(REPLY), 100);
+	BOOST_CHECK_EQUAL(buys, 1u);
+	BOOST_CHECK_EQUAL(recovered.value() - recoveredBefore, 1u);
+	// lost on the way there: sent again at once
+	buys = 0;
+	BOOST_CHECK_EQUAL(place(REQUEST), 101);
+	BOOST_CHECK_EQUAL(buys, 2u);
+	BOOST_CHECK_EQUAL(retried.value() - retriedBefore, 1u);
+	// filled at once: found in the trade history
+	buys = 0;
+	fill = true;
+	BOOST_CHECK_EQUAL(place(REPLY), 102);
+	BOOST_CHECK_EQUAL(buys, 1u);
+	fill = false;
+	// placed late, after the lookup: the retry is refused and the order found then
+	buys = 0;
+	hideOnce = true;
+	BOOST_CHECK_EQUAL(place(REPLY), 103);
+	BOOST_CHECK_EQUAL(buys, 2u);
+	BOOST_CHECK_EQUAL(recovered.value() - recoveredBefore, 3u);
+	// taken after the lookup and filled at once: the retry is accepted, and
+	// the duplicate it placed is cancelled again
+	Counter& duplicated = Metrics::instance().counter("orders_duplicated_total");
+	uint64_t duplicatedBefore = duplicated.value();
+	buys = 0;
+	BOOST_CHECK_EQUAL(place(LATE), 104);
+	BOOST_CHECK_EQUAL(buys, 2u);
+	BOOST_CHECK_EQUAL(duplicated.value() - duplicatedBefore, 1u);
+	{
+		lock_guard<mutex> lock(m);
+		for (const auto& o : open)
+			BOOST_CHECK(o.second != 105);
+	}
+	// over a kept connection the client does not send the order again itself
+	buys = 0;
+	{
+		PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+		polo.set_timeout(chrono::seconds(1));
+		polo.openOrders();
+		loss = REPLY;
+		losses = 1;
+		BOOST_CHECK_EQUAL(polo.createOrder(eth), 106);
+		loss = NONE;
+	}
+	BOOST_CHECK_EQUAL(buys, 1u);
+	BOOST_CHECK_EQUAL(recovered.value() - recoveredBefore, 5u);
+	BOOST_CHECK(chrono::steady_clock::now() - start < chrono::seconds(2));
+
+	// a recorded loss replays as the same transport error, so the order is
+	// looked for and sent again as it was
+	const char* recording = "order_retry_test.rec";
+	buys = 0;
+	{
+		PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+		polo.set_timeout(chrono::seconds(1));
+		polo.set_transport(make_shared<RecordingTransport>(polo.transport(), recording));
+		loss = REQUEST;
+		losses = 1;
+		BOOST_CHECK_EQUAL(polo.createOrder(eth), 107);
+		loss = NONE;
+	}
+	BOOST_CHECK_EQUAL(buys, 2u);
+	{
+		shared_ptr<ReplayTransport> replay = make_shared<ReplayTransport>(recording, false);
+		PoloniexTradeApi polo("key", "other", "127.0.0.1", server.port());
+		polo.set_transport(replay);
+		BOOST_CHECK_EQUAL(polo.createOrder(eth), 107);
+		BOOST_CHECK_EQUAL(replay->remaining(), 0u);
+	}
+	BOOST_CHECK_EQUAL(buys, 2u);
+	std::remove(recording);
+
+	// never found: the client id is kept, and a later run takes the order as its own
+	string path = "order_retry_test.txt";
+	std::remove(path.c_str());
+	hideOpen = true;
+	{
+		PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+		polo.set_order_state(path);
+		polo.set_order_retries(1);
+		loss = REPLY;
+		losses = 2;
+		BOOST_CHECK_THROW(polo.createOrder(eth), boost::system::system_error);
+		loss = NONE;
+	}
+	hideOpen = false;
+	{
+		PoloniexTradeApi polo("key", "secret", "127.0.0.1", server.port());
+		polo.set_order_state(path);
+		vector<TradeApi::OpenOrder> orders = polo.openOrders();
+		BOOST_REQUIRE_EQUAL(orders.size(), 6u);
+		size_t own = 0;
+		for (const TradeApi::OpenOrder& o : orders)
+			if (o.own)
+			{
+				++own;
+				BOOST_CHECK_EQUAL(o.id, 108);
+				BOOST_CHECK(o.clientId != 0);
+			}
+		BOOST_CHECK_EQUAL(own, 1u);
+		BOOST_CHECK(OrderState(path).contains(108));
+	}
+	std::remove(path.c_str());
+}